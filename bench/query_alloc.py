@@ -0,0 +1,48 @@
+"""Query allocations per lookup, with and without Query freelist.
+
+Lookups are answered from Resolver cache, so no network traffic is measured,
+only binding overhead of submit and completion.
+
+    python bench/query_alloc.py [lookups]
+"""
+from __future__ import print_function
+import sys
+import time
+import udns
+
+
+def run(resolver, n):
+    done = []
+    cb = lambda r, _data: done.append(r)
+    before = udns.query_freelist_stats()
+    start = time.time()
+    for _ in range(n):
+        resolver.submit_a4("localhost", cb)
+        resolver.ioevent()
+    elapsed = time.time() - start
+    after = udns.query_freelist_stats()
+    assert len(done) == n
+    return (after["allocated"] - before["allocated"],
+            after["reused"] - before["reused"],
+            elapsed)
+
+
+def main():
+    n = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+    R = udns.Resolver()
+    R.cache_max_bytes = 1 << 20
+    R.submit_a4("localhost", lambda r, _data: None)
+    if not R.run(5):
+        sys.exit("localhost did not resolve, nothing to cache")
+
+    print("%-10s %12s %12s %12s %10s" % ("freelist", "allocs", "reused", "allocs/op", "ns/op"))
+    for size in (0, udns.query_freelist_stats()["size"]):
+        udns.set_query_freelist_size(size)
+        run(R, min(n, 1000)) # warm up
+        allocated, reused, elapsed = run(R, n)
+        print("%-10d %12d %12d %12.3f %10.0f" % (
+            size, allocated, reused, float(allocated) / n, elapsed * 1e9 / n))
+
+
+if __name__ == "__main__":
+    main()
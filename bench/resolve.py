@@ -0,0 +1,128 @@
+"""Throughput and latency of submit_a4 against local stub nameserver.
+
+Starts bench/stubdns.py on a free loopback port, points a Resolver at it
+with add_serv() and keeps `concurrency` lookups in flight until `lookups`
+are done. Every name is unique, so cache and coalescing do not help.
+Latency percentiles come from Resolver.stats().
+
+    python bench/resolve.py [-n lookups] [-c 1,16,256] [--transport mmsg] [stub options]
+
+Run with LD_PRELOAD=bench/syscount.so (see `make bench`) to also print
+socket send/receive syscalls per lookup.
+
+Stub options (--delay, --jitter, --loss, --truncate, --answers) are passed
+to bench/stubdns.py, see its --help.
+"""
+from __future__ import print_function
+import ctypes
+import optparse
+import os
+import resource
+import subprocess
+import sys
+import time
+import udns
+
+
+STUB_OPTIONS = ("--delay", "--jitter", "--loss", "--truncate", "--answers", "--zone")
+
+
+def parse_args(argv):
+    p = optparse.OptionParser(usage="%prog [options]")
+    p.add_option("-n", "--lookups", type="int", default=20000)
+    p.add_option("-c", "--concurrency", default="1,16,128,1024")
+    p.add_option("--opts", default="timeout:1 attempts:3", help="Resolver.set_opts() string")
+    p.add_option("--transport", default="udns", choices=["udns", "mmsg"], help="Resolver.set_transport()")
+    for name in STUB_OPTIONS:
+        p.add_option(name)
+    return p.parse_args(argv)[0]
+
+
+def start_stub(opts):
+    stub = os.path.join(os.path.dirname(os.path.abspath(__file__)), "stubdns.py")
+    args = [sys.executable, stub, "--port", "0"]
+    for name in STUB_OPTIONS:
+        value = getattr(opts, name[2:])
+        if value is not None:
+            args += [name, value]
+    proc = subprocess.Popen(args, stdout=subprocess.PIPE)
+    line = proc.stdout.readline().decode()
+    if not line.startswith("port "):
+        proc.kill()
+        sys.exit("stub nameserver did not start")
+    return proc, int(line.split()[1])
+
+
+def rss_kb():
+    try:
+        with open("/proc/self/statm") as f:
+            return int(f.read().split()[1]) * resource.getpagesize() // 1024
+    except IOError:
+        return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+
+def syscounts():
+    """(sends, receives) so far, or None without bench/syscount.so preloaded."""
+    try:
+        lib = ctypes.CDLL(None)
+        lib.syscount_sends.restype = lib.syscount_recvs.restype = ctypes.c_ulonglong
+        return lib.syscount_sends(), lib.syscount_recvs()
+    except AttributeError:
+        return None
+
+
+def run(resolver, n, concurrency):
+    state = {"submitted": 0}
+
+    def submit():
+        resolver.submit_a4("q%d.bench." % state["submitted"], done)
+        state["submitted"] += 1
+
+    def done(_result, _data):
+        if state["submitted"] < n:
+            submit()
+
+    resolver.reset_stats()
+    calls = syscounts()
+    start = time.time()
+    for _ in range(min(concurrency, n)):
+        submit()
+    resolver.run()
+    elapsed = time.time() - start
+    if calls is not None:
+        calls = [float(b - a) / n for a, b in zip(calls, syscounts())]
+    return elapsed, resolver.stats(), calls
+
+
+def main():
+    opts = parse_args(sys.argv[1:])
+    stub, port = start_stub(opts)
+    try:
+        R = udns.Resolver(True, False)
+        R.add_serv(None)
+        R.add_serv("127.0.0.1")
+        R.set_opts("port:%d %s" % (port, opts.opts))
+        R.open()
+        if "mmsg" == opts.transport:
+            R.set_transport(udns.TRANSPORT_MMSG)
+
+        print("transport %s" % opts.transport)
+        print("%11s %9s %9s %9s %9s %9s %7s %9s %7s %7s" % (
+            "concurrency", "qps", "p50 us", "p99 us", "p999 us", "max us", "errors", "rss KB",
+            "send/q", "recv/q"))
+        for c in [int(c) for c in opts.concurrency.split(",")]:
+            run(R, min(opts.lookups, 1000), c) # warm up
+            elapsed, st, calls = run(R, opts.lookups, c)
+            lat = st["latency"]
+            print("%11d %9.0f %9d %9d %9d %9d %7d %9d %7s %7s" % (
+                c, opts.lookups / elapsed, lat["p50"], lat["p99"], lat["p999"], lat["max"],
+                sum(st["errors"].values()), rss_kb(),
+                "-" if calls is None else "%.2f" % calls[0],
+                "-" if calls is None else "%.2f" % calls[1]))
+    finally:
+        stub.kill()
+        stub.wait()
+
+
+if __name__ == "__main__":
+    main()
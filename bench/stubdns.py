@@ -0,0 +1,149 @@
+"""Loopback stub nameserver for benchmarks.
+
+Answers every A query with synthetic addresses, or with addresses from
+--zone file (lines of "name addr [addr...]"). Names starting with "nx" get
+NXDOMAIN. Replies can be delayed, dropped and truncated to model a real
+upstream. Other query types get empty NOERROR replies.
+
+    python bench/stubdns.py --port 0 --delay 2 --loss 0.01
+
+Prints "port N" once listening. Single threaded, delayed replies are kept
+in a heap so delay does not limit throughput.
+"""
+from __future__ import print_function
+import heapq
+import optparse
+import random
+import select
+import socket
+import struct
+import sys
+import time
+
+
+def parse_args(argv):
+    p = optparse.OptionParser(usage="%prog [options]")
+    p.add_option("--addr", default="127.0.0.1")
+    p.add_option("--port", type="int", default=0, help="0 picks free port")
+    p.add_option("--answers", type="int", default=1, help="A records per answer")
+    p.add_option("--ttl", type="int", default=300)
+    p.add_option("--zone", help="file with 'name addr [addr...]' lines")
+    p.add_option("--delay", type="float", default=0.0, help="reply delay, ms")
+    p.add_option("--jitter", type="float", default=0.0, help="random extra delay up to, ms")
+    p.add_option("--loss", type="float", default=0.0, help="fraction of queries dropped")
+    p.add_option("--truncate", type="float", default=0.0, help="fraction of replies with TC bit and no answers")
+    p.add_option("--seed", type="int", default=1)
+    opts, _ = p.parse_args(argv)
+    return opts
+
+
+def load_zone(path):
+    zone = {}
+    if path:
+        with open(path) as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) >= 2 and not fields[0].startswith("#"):
+                    zone[fields[0].lower().rstrip(".")] = [socket.inet_aton(a) for a in fields[1:]]
+    return zone
+
+
+def parse_query(pkt):
+    pkt = bytearray(pkt)
+    i, labels = 12, []
+    while pkt[i]:
+        labels.append(bytes(pkt[i + 1:i + 1 + pkt[i]]).decode("ascii", "replace"))
+        i += 1 + pkt[i]
+    qtype, = struct.unpack("!H", bytes(pkt[i + 1:i + 3]))
+    return ".".join(labels).lower(), qtype, i + 5
+
+
+class Stub(object):
+    def __init__(self, opts):
+        self.opts = opts
+        self.zone = load_zone(opts.zone)
+        self.random = random.Random(opts.seed)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+        self.sock.bind((opts.addr, opts.port))
+        self.sock.setblocking(False)
+        self.port = self.sock.getsockname()[1]
+        self.pending = [] # (send time, seq, reply, addr)
+        self.seq = 0
+
+    def answer_addrs(self, name):
+        if name in self.zone:
+            return self.zone[name]
+        h = hash(name) & 0xffff
+        return [struct.pack("!BBBB", 10, h >> 8, h & 0xff, i) for i in range(self.opts.answers)]
+
+    def reply(self, pkt):
+        qid, = struct.unpack("!H", pkt[:2])
+        name, qtype, end = parse_query(pkt)
+        question = pkt[12:end]
+        rcode, tc, rrs = 0, 0, []
+        if name.startswith("nx"):
+            rcode = 3
+        elif self.opts.truncate and self.random.random() < self.opts.truncate:
+            tc = 0x0200
+        elif 1 == qtype:
+            rrs = [struct.pack("!HHHIH", 0xc00c, 1, 1, self.opts.ttl, 4) + a
+                   for a in self.answer_addrs(name)]
+        hdr = struct.pack("!HHHHHH", qid, 0x8180 | tc | rcode, 1, len(rrs), 0, 0)
+        return hdr + question + b"".join(rrs)
+
+    def delay(self):
+        d = self.opts.delay
+        if self.opts.jitter:
+            d += self.random.random() * self.opts.jitter
+        return d / 1000.0
+
+    def serve(self):
+        print("port %d" % self.port)
+        sys.stdout.flush()
+        while True:
+            timeout = None
+            if self.pending:
+                timeout = max(0.0, self.pending[0][0] - time.time())
+            readable, _, _ = select.select([self.sock], [], [], timeout)
+            if readable:
+                self.receive()
+            now = time.time()
+            while self.pending and self.pending[0][0] <= now:
+                _, _, reply, addr = heapq.heappop(self.pending)
+                self.send(reply, addr)
+
+    def receive(self):
+        while True:
+            try:
+                pkt, addr = self.sock.recvfrom(4096)
+            except socket.error:
+                return
+            if len(pkt) < 17:
+                continue
+            if self.opts.loss and self.random.random() < self.opts.loss:
+                continue
+            reply = self.reply(pkt)
+            d = self.delay()
+            if d > 0:
+                self.seq += 1
+                heapq.heappush(self.pending, (time.time() + d, self.seq, reply, addr))
+            else:
+                self.send(reply, addr)
+
+    def send(self, reply, addr):
+        try:
+            self.sock.sendto(reply, addr)
+        except socket.error:
+            pass
+
+
+def main():
+    try:
+        Stub(parse_args(sys.argv[1:])).serve()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,61 @@
+/* Counts socket send/receive syscalls of the process it is preloaded into.
+ *
+ *     LD_PRELOAD=bench/syscount.so python bench/resolve.py --transport mmsg
+ *
+ * bench/resolve.py reads the counters with ctypes when they are present.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+static unsigned long long sends, recvs;
+
+unsigned long long syscount_sends(void) { return sends; }
+unsigned long long syscount_recvs(void) { return recvs; }
+
+#define NEXT(name) \
+    static __typeof__(name) *next_##name; \
+    if (!next_##name) next_##name = (__typeof__(name) *)dlsym(RTLD_NEXT, #name)
+
+ssize_t
+sendto (int fd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    NEXT(sendto);
+    sends++;
+    return next_sendto(fd, buf, len, flags, to, tolen);
+}
+
+ssize_t
+sendmsg (int fd, const struct msghdr *msg, int flags) {
+    NEXT(sendmsg);
+    sends++;
+    return next_sendmsg(fd, msg, flags);
+}
+
+int
+sendmmsg (int fd, struct mmsghdr *msgs, unsigned int n, int flags) {
+    NEXT(sendmmsg);
+    sends++;
+    return next_sendmmsg(fd, msgs, n, flags);
+}
+
+ssize_t
+recvfrom (int fd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
+    NEXT(recvfrom);
+    recvs++;
+    return next_recvfrom(fd, buf, len, flags, from, fromlen);
+}
+
+ssize_t
+recvmsg (int fd, struct msghdr *msg, int flags) {
+    NEXT(recvmsg);
+    recvs++;
+    return next_recvmsg(fd, msg, flags);
+}
+
+int
+recvmmsg (int fd, struct mmsghdr *msgs, unsigned int n, int flags, struct timespec *timeout) {
+    NEXT(recvmmsg);
+    recvs++;
+    return next_recvmmsg(fd, msgs, n, flags, timeout);
+}
@@ -3,9 +3,11 @@
 
 CC      := gcc
 MAKE    := make
-PYTHON  := python
+PYTHON  := python3
 
 CFLAGS  := -Wall -Wextra
 LDFLAGS :=
 
 #DEBUG := 1
+# USDT probes, needs <sys/sdt.h>, see udns/probes.h
+#USDT := 1
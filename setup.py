@@ -1,16 +1,26 @@
-from distutils.core import setup, Extension
+from setuptools import setup, Extension
 import os
 
 
 PACKAGE = 'udns'
 SOURCES = [
     'udns/mod_udns.c',
+    'udns/cache.c',
+    'udns/hosts.c',
+    'udns/mmsg.c',
+    'udns/stats.c',
+    'udns/tcp.c',
+    'udns/thread.c',
 ]
 
 README = open('README.rst').read().strip() if os.path.isfile('README.rst') else ''
 
+# PYUDNS_USDT=1 python setup.py build compiles in USDT probes, see udns/probes.h
+MACROS = [('PYUDNS_USDT', '1')] if os.environ.get('PYUDNS_USDT') else []
+
 udns_module = Extension('udns._udns', SOURCES,
-                        libraries=['udns'],
+                        define_macros=MACROS,
+                        libraries=['udns', 'ev'],
                         language='c')
 
 setup(name='pyudns',
@@ -23,4 +33,5 @@ setup(name='pyudns',
       long_description=README,
       ext_modules=[udns_module],
       license='MIT License',
+      python_requires='>=3.9',
      )
@@ -1,5 +1,14 @@
+import array
+import asyncio
+import gc
+import os
+import select
+import socket
+import tempfile
+import threading
 import time
 import udns
+import udns.aio
 import unittest
 
 
@@ -56,6 +65,190 @@ class InterfaceTestCase(unittest.TestCase):
         q = R.submit_a4("localhost", lambda r, _data: None)
         q.cancel()
 
+    def test_033(self):
+        R = udns.Resolver()
+        R.submit_a4("localhost", lambda r, _data: None, None, udns.RESULT_PACKED)
+
+    def test_034(self):
+        R = udns.Resolver()
+        self.assertTrue(R.run(0))
+        R.run_until_idle()
+
+    def test_035(self):
+        R = udns.Resolver()
+        R.cache_max_bytes = 1 << 20
+        R.negative_ttl = 10
+        self.assertEqual(R.cache_stats["max_bytes"], 1 << 20)
+        R.cache_clear()
+
+    def test_036(self):
+        R = udns.Resolver()
+        q = R.submit_a4("localhost", lambda r, _data: None)
+        self.assertFalse(hasattr(q, "__dict__"))
+        q.cancel()
+
+    def test_041(self):
+        R = udns.Resolver()
+        q = R.submit_a4_many(["localhost", "localhost"], lambda r, _data: None)
+        q.cancel()
+
+    def test_042(self):
+        R = udns.Resolver()
+        flags = []
+        R.submit_a4_many([], lambda r, _data: flags.append(r))
+        self.assertEqual(flags, [()])
+
+    def test_043(self):
+        R = udns.Resolver()
+        self.assertEqual(R.resolve_many([]), {})
+        self.assertRaises(ValueError, R.resolve_many, ["localhost"], 5)
+        self.assertRaises(TypeError, R.resolve_many, [1])
+
+
+    def test_051(self):
+        stats = udns.query_freelist_stats()
+        udns.set_query_freelist_size(0)
+        self.assertEqual(udns.query_freelist_stats()["free"], 0)
+        udns.set_query_freelist_size(stats["size"])
+
+    def test_052(self):
+        rr = udns.RR()
+        self.assertEqual(len(rr), 0)
+        self.assertRaises(ValueError, memoryview, rr)
+        for name in ("query", "cname", "ttl", "count", "qclass", "qtype", "types"):
+            self.assertRaises(ValueError, getattr, rr, name)
+
+    def test_053(self):
+        R = udns.Resolver()
+        st = R.stats()
+        self.assertEqual(st["submits"], 0)
+        self.assertEqual(st["latency"]["p99"], 0)
+        self.assertTrue(udns.E_NXDOMAIN in st["errors"])
+
+    def test_054(self):
+        R = udns.Resolver(True, False)
+        self.assertEqual(R.sock, -1)
+        self.assertEqual(R.add_serv(None), 0)
+        self.assertEqual(R.add_serv("127.0.0.1"), 1)
+        self.assertRaises(ValueError, R.set_opts, "nosuchopt:1")
+        R.set_opts("timeout:1 attempts:1")
+        self.assertEqual(R.open(), R.sock)
+        self.assertTrue(R.sock >= 0)
+        self.assertRaises(RuntimeError, R.add_serv, "127.0.0.2")
+
+    def test_055(self):
+        R = udns.aio.Resolver()
+        self.assertTrue(isinstance(R.resolver, udns.Resolver))
+        q = R.resolver.submit_a4("localhost", lambda r, _data: None)
+        self.assertEqual(q.status, 0)
+        R.close()
+
+    def test_056(self):
+        R = udns.Resolver()
+        self.assertRaises(ValueError, R.set_transport, 5)
+        sock = R.set_transport(udns.TRANSPORT_MMSG)
+        self.assertEqual(R.sock, sock)
+        self.assertNotEqual(R.set_transport(udns.TRANSPORT_UDNS), sock)
+        R.submit_a4("localhost", lambda r, _data: None)
+        self.assertRaises(RuntimeError, R.set_transport, udns.TRANSPORT_MMSG)
+
+    def test_057(self):
+        R = udns.Resolver()
+        self.assertEqual(R.hosts_file, None)
+        self.assertRaises(IOError, setattr, R, "hosts_file", "/nonexistent/hosts")
+        self.assertEqual(R.hosts_file, None)
+        self.assertEqual(R.hosts_stats["entries"], 0)
+
+    def test_058(self):
+        R = udns.Resolver()
+        self.assertEqual(R.drain(), [])
+        self.assertRaises(ValueError, R.drain, -1)
+        self.assertRaises(TypeError, R.submit_a4, "localhost", 1)
+        q = R.submit_a4_many([], None)
+        self.assertEqual(R.drain(0), [])
+        self.assertEqual(R.drain(), [(q, ())])
+        self.assertEqual(udns.ResolverPool(2).drain(), [])
+
+    def test_059(self):
+        R = udns.ThreadedResolver(False)
+        self.assertRaises(RuntimeError, R.submit_a4, "localhost", None)
+        self.assertEqual(R.add_serv(None), 0)
+        self.assertEqual(R.add_serv("127.0.0.1"), 1)
+        R.set_opts("timeout:1")
+        self.assertEqual(R.start(), R.fd)
+        self.assertRaises(RuntimeError, R.add_serv, "127.0.0.2")
+        self.assertRaises(TypeError, R.submit_a4, "localhost", 1)
+        self.assertEqual(R.active, 0)
+        self.assertEqual(R.drain(), [])
+        self.assertFalse(R.wait(0))
+        R.close()
+        self.assertRaises(RuntimeError, R.submit_a4, "localhost", None)
+
+    def test_060(self):
+        R = udns.Resolver()
+        self.assertRaises(ValueError, R.set_prefetch, 1.5)
+        self.assertRaises(ValueError, R.set_prefetch, 0.5, 8, 0)
+        R.set_prefetch(0.8, 4, 100.0)
+        self.assertEqual(R.cache_stats["prefetches"], 0)
+        R.set_prefetch(0)
+
+    def test_061(self):
+        P = udns.ResolverPool(3)
+        self.assertEqual(len(P.socks), 3)
+        self.assertEqual(len(set(P.socks)), 3)
+        self.assertEqual(P.active, 0)
+
+    def test_062(self):
+        self.assertRaises(ValueError, udns.ResolverPool, 0)
+        self.assertRaises(ValueError, udns.ResolverPool, 2, 99)
+
+    def test_063(self):
+        R = udns.Resolver()
+        self.assertRaises(IOError, R.load_cache, "/nonexistent/cache")
+        with tempfile.NamedTemporaryFile() as f:
+            f.write(b"not a snapshot" * 10)
+            f.flush()
+            self.assertRaises(ValueError, R.load_cache, f.name)
+        self.assertEqual(R.cache_stats["snapshot_entries"], 0)
+
+    def test_064(self):
+        R = udns.Resolver(True, False)
+        self.assertEqual(R.server_stats, [])
+        R.add_serv(None)
+        R.add_serv("127.0.0.1")
+        R.add_serv("127.0.0.2")
+        R.set_transport(udns.TRANSPORT_MMSG)
+        stats = R.server_stats
+        self.assertEqual([s["address"] for s in stats], ["127.0.0.1", "127.0.0.2"])
+        self.assertFalse(stats[1]["preferred"])
+        self.assertEqual(stats[0]["rtt_ms"], None)
+        self.assertTrue(stats[0]["preferred"])
+
+    def test_065(self):
+        R = udns.Resolver()
+        fd = R.tcp_sock
+        self.assertEqual(R.tcp_sock, fd)
+        self.assertNotEqual(fd, R.sock)
+        self.assertEqual(R.tcp_stats["connections"], 0)
+
+    def test_066(self):
+        R = udns.Resolver()
+        self.assertEqual((R.max_inflight, R.queued), (0, 0))
+        R.max_inflight = 10
+        self.assertEqual(R.max_inflight, 10)
+        with self.assertRaises(ValueError):
+            R.max_inflight = -1
+
+    def test_067(self):
+        R = udns.Resolver()
+        self.assertEqual(R.resolution_delay, 0.05)
+        R.resolution_delay = None
+        self.assertEqual(R.resolution_delay, None)
+        with self.assertRaises(ValueError):
+            R.resolution_delay = -1
+        with self.assertRaises(ValueError):
+            R.submit_addr("localhost", None, None, 12345)
+
 
 class BasicTestCase(unittest.TestCase):
     def setUp(self):
@@ -68,7 +261,7 @@ class BasicTestCase(unittest.TestCase):
             flags.append(r)
         self.R.submit_a4("localhost", cb)
         # simulation of dumb event loop
-        for _ in xrange(TIMEOUT * 100):
+        for _ in range(TIMEOUT * 100):
             self.R.ioevent()
             self.R.timeouts(1)
             time.sleep(0.01)
@@ -76,6 +269,544 @@ class BasicTestCase(unittest.TestCase):
                 break
         self.assertTrue(flags)
 
+    def test_run_001(self):
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        self.R.submit_a4("localhost", cb)
+        self.assertTrue(self.R.run(5))
+        self.assertTrue(flags)
+        self.assertFalse(self.R.active)
+
+    def test_run_002(self):
+        def cb(r, _data):
+            raise ZeroDivisionError
+        self.R.submit_a4("localhost", cb)
+        self.assertRaises(ZeroDivisionError, self.R.run, 5)
+
+    def test_cache_001(self):
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        self.R.cache_max_bytes = 1 << 20
+        self.R.submit_a4("localhost", cb)
+        self.R.run(5)
+        self.R.submit_a4("localhost", cb)
+        self.assertEqual(len(flags), 1)
+        self.R.ioevent()
+        self.assertEqual(len(flags), 2)
+        self.assertEqual(flags[0], flags[1])
+        self.assertEqual(self.R.cache_stats["hits"], 1)
+
+    def test_cache_snapshot_001(self):
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        self.R.cache_max_bytes = 1 << 20
+        self.R.submit_a4("localhost", cb)
+        self.R.submit_a4("nxdomain.test", cb)
+        self.R.run(5)
+        with tempfile.TemporaryDirectory() as d:
+            path = os.path.join(d, "cache")
+            self.assertEqual(self.R.save_cache(path), 2)
+            R = udns.Resolver(True)
+            R.cache_max_bytes = 1 << 20
+            self.assertEqual(R.load_cache(path), 2)
+            R.submit_a4("LOCALHOST.", cb)
+            R.submit_a4("nxdomain.test", cb)
+            self.assertEqual(R.active, 2)
+            R.ioevent()
+            self.assertEqual(flags, [("127.0.0.1",), None, ("127.0.0.1",), None])
+            st = R.cache_stats
+            self.assertEqual((st["snapshot_hits"], st["entries"], st["misses"]), (2, 2, 0))
+            # records not asked for are carried over by next save
+            R.cache_clear()
+            R.load_cache(path)
+            R.submit_a4("localhost", cb)
+            self.assertEqual(R.save_cache(path), 2)
+
+    def test_cache_snapshot_002(self):
+        self.R.cache_max_bytes = 1 << 20
+        self.R.submit_a4("localhost", None)
+        self.R.run(5)
+        with tempfile.TemporaryDirectory() as d:
+            path = os.path.join(d, "cache")
+            self.assertEqual(self.R.save_cache(path.encode()), 1)
+            self.assertEqual(os.listdir(d), ["cache"])
+            # nrr of record claims more addresses than its data holds
+            with open(path, "r+b") as f:
+                data = bytearray(f.read())
+                rec = data.index(b"localhost\0") - 40
+                data[rec + 20:rec + 24] = array.array("i", [1000]).tobytes()
+                f.seek(0)
+                f.write(data)
+            R = udns.Resolver(True)
+            R.cache_max_bytes = 1 << 20
+            self.assertEqual(R.load_cache(path), 1)
+            R.submit_a4("localhost", None)
+            self.assertEqual(R.active, 1)
+            self.assertEqual(R.cache_stats["snapshot_hits"], 0)
+
+    def test_coalesce_001(self):
+        flags = []
+        def cb(r, data):
+            flags.append(data)
+        queries = [self.R.submit_a4("localhost", cb, i) for i in range(5)]
+        self.assertEqual(self.R.active, 1)
+        queries[2].cancel()
+        self.assertEqual(self.R.active, 1)
+        self.R.run(5)
+        self.assertEqual(flags, [0, 1, 3, 4])
+
+    def test_max_inflight_001(self):
+        flags = []
+        def cb(r, data):
+            flags.append(data)
+        self.R.max_inflight = 1
+        self.R.submit_a4("first.test", cb, "first")
+        self.R.submit_a4("low.test", cb, "low")
+        self.R.submit("high.test", udns.C_IN, udns.T_A, cb, "high", 0, 5)
+        self.R.submit_a4("first.test", cb, "shared") # joins lookup in flight
+        self.R.submit_a4("gone.test", cb, "gone").cancel()
+        self.assertEqual((self.R.queued, self.R.active), (2, 3))
+        self.assertTrue(self.R.run(5))
+        self.assertEqual(flags, ["first", "shared", "high", "low"])
+        self.assertEqual(self.R.queued, 0)
+
+    def test_async_resolve_packed_001(self):
+        TIMEOUT = 5 # sec
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        self.R.submit_a4("localhost", cb, None, udns.RESULT_PACKED)
+        for _ in range(TIMEOUT * 100):
+            self.R.ioevent()
+            self.R.timeouts(1)
+            time.sleep(0.01)
+            if not self.R.active:
+                break
+        self.assertTrue(flags)
+        self.assertEqual(len(flags[0]) % 4, 0)
+
+    def test_async_resolve_many_001(self):
+        TIMEOUT = 5 # sec
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        self.R.submit_a4_many(iter(["localhost"] * 3), cb)
+        for _ in range(TIMEOUT * 100):
+            self.R.ioevent()
+            self.R.timeouts(1)
+            time.sleep(0.01)
+            if not self.R.active:
+                break
+        self.assertEqual(len(flags), 1)
+        self.assertEqual(len(flags[0]), 3)
+
+    def test_resolve_many_001(self):
+        r = self.R.resolve_many(["localhost", "localhost."], udns.T_A, 5)
+        self.assertEqual(sorted(r.keys()), ["localhost", "localhost."])
+        self.assertTrue(isinstance(r["localhost"], tuple))
+        self.assertEqual(self.R.active, 0)
+
+    def test_submit_raw_001(self):
+        flags = []
+        def cb(rr, _data):
+            flags.append(rr)
+        self.R.submit("localhost", udns.C_IN, udns.T_A, cb)
+        self.R.run(5)
+        rr = flags[0]
+        self.assertEqual(rr.qtype, udns.T_A)
+        self.assertEqual(len(rr), rr.count)
+        self.assertEqual(list(rr), ["127.0.0.1"])
+        self.assertTrue(len(memoryview(rr).tobytes()) > 12)
+
+    def test_ptr_001(self):
+        flags = {}
+        def cb(r, data):
+            flags[data] = r
+        addrs = array.array("B", [10, 0, 0, 1, 10, 0, 0, 2, 10, 0, 0, 1])
+        self.R.submit_ptr_many(addrs, socket.AF_INET, cb, 4)
+        self.assertEqual(self.R.active, 2) # duplicate address shares lookup
+        self.R.submit_ptr_many(socket.inet_pton(socket.AF_INET6, "2001:db8::1"), socket.AF_INET6, cb, 6)
+        self.assertTrue(self.R.run(5))
+        self.assertEqual(flags, {4: (("host.example",),) * 3, 6: (("host.example",),)})
+        with self.assertRaises(ValueError):
+            self.R.submit_ptr_many(b"\x0a\x00\x00", socket.AF_INET, cb)
+
+    def test_addr_001(self):
+        flags = {}
+        def cb(r, data):
+            flags[data] = r
+        self.R.submit_addr("localhost", cb, "any")
+        self.R.submit_addr("localhost", cb, "v4", socket.AF_INET)
+        q = self.R.submit_addr("nxdomain.test", cb, "nx")
+        self.assertEqual(self.R.active, 4) # AAAA and A lookups, v4 one shared
+        self.assertTrue(self.R.run(5))
+        self.assertEqual(flags, {"any": ("::1", "127.0.0.1"), "v4": ("127.0.0.1",), "nx": None})
+        self.assertEqual(q.status, udns.E_NXDOMAIN)
+
+    def test_addr_002(self):
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        R = udns.Resolver(True, False)
+        R.add_serv(None)
+        R.add_serv("127.0.0.2") # nothing listens, AAAA is never answered
+        R.open()
+        R.resolution_delay = 0.2
+        with tempfile.NamedTemporaryFile("w", suffix=".hosts") as f:
+            f.write("10.1.2.3 v4only.test\n")
+            f.flush()
+            R.hosts_file = f.name
+            started = time.monotonic()
+            R.submit_addr("v4only.test", cb)
+            self.assertTrue(R.run(5))
+        self.assertTrue(0.15 < time.monotonic() - started < 1)
+        self.assertEqual(flags, [("10.1.2.3",)])
+        self.assertEqual(R.active, 0)
+
+    def test_addr_003(self):
+        # same as test_addr_002, loop driven by timeouts() and next_deadline
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        R = udns.Resolver(True, False)
+        R.add_serv(None)
+        R.add_serv("127.0.0.2")
+        R.open()
+        R.resolution_delay = 0.2
+        self.assertEqual(R.next_deadline, None)
+        with tempfile.NamedTemporaryFile("w", suffix=".hosts") as f:
+            f.write("10.1.2.3 v4only.test\n")
+            f.flush()
+            R.hosts_file = f.name
+            started = time.monotonic()
+            R.submit_addr("v4only.test", cb)
+            # hosts file answer is delivered by ioevent()
+            R.ioevent()
+            while not flags and time.monotonic() - started < 5:
+                R.timeouts(-1)
+                wait = R.next_deadline - time.monotonic()
+                select.select([R.sock], [], [], max(0, wait))
+                R.ioevent()
+        self.assertTrue(0.15 < time.monotonic() - started < 0.6)
+        self.assertEqual(flags, [("10.1.2.3",)])
+        # unanswered AAAA was dropped with the query
+        R.timeouts(-1)
+        self.assertEqual(R.next_deadline, None)
+        self.assertEqual(R.active, 0)
+
+    def test_mmsg_001(self):
+        flags = []
+        def cb(r, data):
+            flags.append((data, r))
+        self.R.set_transport(udns.TRANSPORT_MMSG)
+        self.R.submit_a4("localhost", cb, 0)
+        self.R.submit_a4("nxdomain.test", cb, 1)
+        self.R.submit("localhost", udns.C_IN, udns.T_A, cb, 2)
+        self.R.submit_a4("cancelled.test", cb, 3).cancel()
+        self.assertTrue(self.R.run(5))
+        flags.sort(key=lambda f: f[0])
+        self.assertEqual(flags[0], (0, ("127.0.0.1",)))
+        self.assertEqual(flags[1], (1, None))
+        self.assertEqual(list(flags[2][1]), ["127.0.0.1"])
+        self.assertEqual(len(flags), 3)
+        self.assertEqual(self.R.stats()["errors"][udns.E_NXDOMAIN], 1)
+
+    def test_mmsg_002(self):
+        flags = []
+        def cb(r, data):
+            flags.append(r)
+        R = udns.Resolver(True, False)
+        R.add_serv(None)
+        R.add_serv("127.0.0.2") # nothing listens, datagrams are lost
+        R.add_serv("127.0.0.1")
+        R.set_opts("timeout:1 attempts:1")
+        R.set_transport(udns.TRANSPORT_MMSG)
+        R.submit_a4("localhost", cb)
+        self.assertTrue(R.run(5))
+        dead, live = R.server_stats
+        self.assertEqual((dead["timeouts"], dead["rtt_ms"]), (1, None))
+        self.assertTrue(live["rtt_ms"] > 0)
+        self.assertTrue(live["preferred"])
+        # steered past the server that timed out, no retry needed
+        R.submit_a4("localhost", cb)
+        self.assertTrue(R.run(5))
+        self.assertEqual(R.server_stats[0]["sent"], 1)
+        self.assertEqual(flags, [("127.0.0.1",)] * 2)
+
+    def test_mmsg_003(self):
+        flags = []
+        def cb(r, data):
+            flags.append(r)
+        R = udns.Resolver(True, False)
+        R.add_serv(None)
+        R.add_serv("127.0.0.2") # nothing listens, query stays in flight
+        R.set_transport(udns.TRANSPORT_MMSG)
+        q = R.submit_a4("localhost", cb)
+        R.close()
+        self.assertEqual(R.sock, -1)
+        R.ioevent()
+        self.assertEqual(flags, [None])
+        self.assertEqual(q.status, udns.E_TEMPFAIL)
+        self.assertEqual(R.active, 0)
+
+    def test_tcp_001(self):
+        flags = []
+        def cb(r, data):
+            flags.append((data, r))
+        # stub server truncates big* answers over UDP
+        self.R.submit_a4("big1.test", cb, 0)
+        self.R.submit_a4("big2.test", cb, 1)
+        self.R.submit("big3.test", udns.C_IN, udns.T_A, cb, 2)
+        self.assertTrue(self.R.run(5))
+        flags.sort(key=lambda f: f[0])
+        self.assertEqual([len(r) for _data, r in flags], [60, 60, 60])
+        stats = self.R.tcp_stats
+        self.assertEqual((stats["queries"], stats["active"]), (3, 0))
+        # pipelined on the pooled connection
+        self.assertEqual(stats["connects"], 1)
+
+    def test_tcp_002(self):
+        flags = []
+        def cb(r, data):
+            flags.append(r)
+        q = self.R.submit_a4("big1.test", cb)
+        self.R.timeouts(-1)
+        while self.R.tcp_stats["active"] == 0:
+            select.select([self.R.sock], [], [], 5)
+            self.R.ioevent()
+        self.R.close()
+        self.assertEqual(self.R.tcp_stats["active"], 0)
+        self.R.ioevent()
+        self.assertEqual(flags, [None])
+        self.assertEqual(q.status, udns.E_TEMPFAIL)
+
+    def test_hosts_001(self):
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        with tempfile.NamedTemporaryFile("w", suffix=".hosts") as f:
+            f.write("# comment\n10.1.2.3 pinned.test alias.test\n::1 pinned.test\n")
+            f.flush()
+            self.R.hosts_file = f.name
+            self.assertEqual(self.R.hosts_stats["entries"], 2)
+            self.R.submit_a4("PINNED.test.", cb)
+            self.R.submit_a4("alias.test", cb, None, udns.RESULT_PACKED)
+            self.assertEqual(self.R.active, 2)
+            self.R.ioevent()
+            self.assertEqual(flags, [("10.1.2.3",), b"\x0a\x01\x02\x03"])
+            r = self.R.resolve_many(["pinned.test"], udns.T_AAAA)
+            self.assertEqual(r, {"pinned.test": ("::1",)})
+            # rewritten file is picked up on a later second
+            f.seek(0)
+            f.write("10.3.2.1 pinned.test\n")
+            f.truncate()
+            f.flush()
+            time.sleep(1.1)
+            self.assertEqual(self.R.resolve_many(["pinned.test"]), {"pinned.test": ("10.3.2.1",)})
+            self.assertEqual(self.R.hosts_stats["reloads"], 2)
+        self.R.hosts_file = None
+
+    def test_drain_001(self):
+        q1 = self.R.submit_a4("localhost", None, 1)
+        q2 = self.R.submit_a4("nxdomain.test", None, 2)
+        q3 = self.R.submit("localhost", udns.C_IN, udns.T_A, None)
+        q4 = self.R.submit_a4_many(["localhost"], None)
+        self.R.submit_a4("cancelled.test", None).cancel()
+        self.assertTrue(self.R.run(5))
+        done = dict((id(q), r) for q, r in self.R.drain())
+        self.assertEqual(len(done), 4)
+        self.assertEqual(done[id(q1)], ("127.0.0.1",))
+        self.assertEqual(done[id(q2)], None)
+        self.assertEqual(list(done[id(q3)]), ["127.0.0.1"])
+        self.assertEqual(done[id(q4)], (("127.0.0.1",),))
+        self.assertEqual(q1.data, 1)
+        self.assertEqual(self.R.drain(), [])
+
+    def test_drain_002(self):
+        freed = []
+        class Data(object):
+            def __del__(self):
+                freed.append(True)
+        R = udns.Resolver()
+        R.submit_a4("localhost", None, Data())
+        R.submit("localhost", udns.C_IN, udns.T_A, None, Data())
+        self.assertTrue(R.run(5))
+        # completions left in ring point back at resolver
+        del R
+        gc.collect()
+        self.assertEqual(freed, [True, True])
+        # close() drops them
+        self.R.submit_a4("localhost", None)
+        self.assertTrue(self.R.run(5))
+        self.R.close()
+        self.assertEqual(self.R.drain(), [])
+
+    def test_threaded_001(self):
+        R = udns.ThreadedResolver()
+        flags = []
+        def cb(r, data):
+            flags.append((data, r))
+        def worker(i):
+            for j in range(20):
+                R.submit_a4("localhost", None, (i, j))
+        threads = [threading.Thread(target=worker, args=(i,)) for i in range(4)]
+        for t in threads:
+            t.start()
+        R.submit_a4("nxdomain.test", cb, 1)
+        R.submit("localhost", udns.C_IN, udns.T_A, cb, 2)
+        R.submit_a4("cancelled.test", cb, 3).cancel()
+        for t in threads:
+            t.join()
+        self.assertTrue(R.run(5))
+        self.assertEqual(R.active, 0)
+        flags.sort(key=lambda f: f[0])
+        self.assertEqual(flags[0], (1, None))
+        self.assertEqual(list(flags[1][1]), ["127.0.0.1"])
+        self.assertEqual(len(flags), 2)
+        done = R.drain()
+        self.assertEqual(len(done), 80)
+        self.assertEqual(set(r for _q, r in done), set([("127.0.0.1",)]))
+
+    def test_threaded_002(self):
+        # nothing listens on port 9, close() fails query in flight
+        R = udns.ThreadedResolver(False)
+        R.add_serv(None)
+        R.add_serv("127.0.0.1")
+        R.set_opts("port:9 timeout:5")
+        R.start()
+        q = R.submit_a4("localhost", None)
+        R.close()
+        self.assertEqual(R.drain(), [(q, None)])
+        self.assertEqual(q.status, udns.E_TEMPFAIL)
+
+    def test_threaded_003(self):
+        # cancelled query in flight is dropped from udns, not left to time out
+        R = udns.ThreadedResolver(False)
+        R.add_serv(None)
+        R.add_serv("127.0.0.2") # nothing listens, datagrams are lost
+        R.set_opts("timeout:5")
+        R.start()
+        q = R.submit_a4("localhost", None)
+        time.sleep(0.1) # taken by I/O thread
+        q.cancel()
+        self.assertTrue(R.run(2))
+        self.assertEqual(R.active, 0)
+        self.assertEqual(R.drain(), [])
+        R.close()
+        self.assertRaises(RuntimeError, R.submit_a4, "localhost", None)
+
+    def test_prefetch_001(self):
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        self.R.cache_max_bytes = 1 << 20
+        # 1% of stub TTL 300 is 3 seconds, use 0.1% to wait a bit more than 1
+        self.R.set_prefetch(0.001, 2, 1.0)
+        for i in range(3):
+            self.R.submit_a4("localhost", cb)
+            self.R.run(5)
+        self.assertEqual(self.R.cache_stats["prefetches"], 0)
+        time.sleep(1.1)
+        self.R.submit_a4("localhost", cb)
+        self.R.submit_a4("localhost", cb)
+        # two cache hits and one refresh query
+        self.assertEqual(self.R.active, 3)
+        self.assertTrue(self.R.run(5))
+        self.assertEqual(flags, [("127.0.0.1",)] * 5)
+        st = self.R.cache_stats
+        self.assertEqual((st["misses"], st["prefetches"]), (1, 1))
+        self.assertEqual(self.R.stats()["submits"], 5)
+
+    def test_stats_001(self):
+        q = self.R.submit_a4("localhost", lambda r, _data: None)
+        self.R.submit_a4("nxdomain.test", lambda r, _data: None)
+        q.cancel()
+        self.R.run(5)
+        st = self.R.stats()
+        self.assertEqual(st["submits"], 2)
+        self.assertEqual(st["completions"] + st["cancels"], 2)
+        self.assertEqual(st["errors"][udns.E_NXDOMAIN], 1)
+        self.assertEqual(st["inflight"], 0)
+        self.assertEqual(st["inflight_peak"], 2)
+        self.assertTrue(st["latency"]["p50"] <= st["latency"]["p999"])
+        self.R.reset_stats()
+        self.assertEqual(self.R.stats()["submits"], 0)
+
+    def test_aio_001(self):
+        R = udns.aio.Resolver(self.R)
+
+        async def main():
+            addrs = await asyncio.wait_for(R.resolve_a4("localhost"), 5)
+            self.assertEqual(addrs, ("127.0.0.1",))
+            with self.assertRaises(udns.aio.Error) as e:
+                await asyncio.wait_for(R.resolve_a4("nxdomain.test"), 5)
+            self.assertEqual(e.exception.status, udns.E_NXDOMAIN)
+            task = asyncio.ensure_future(R.resolve_a4("slow.test"))
+            await asyncio.sleep(0)
+            task.cancel()
+            await asyncio.gather(task, return_exceptions=True)
+            self.assertEqual(self.R.active, 0)
+            rr = await asyncio.wait_for(R.resolve("localhost", udns.T_A), 5)
+            self.assertEqual(list(rr), ["127.0.0.1"])
+
+        asyncio.run(main())
+
+    def test_pool_001(self):
+        TIMEOUT = 5 # sec
+        P = udns.ResolverPool(2, udns.POOL_ROUND_ROBIN)
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        P.submit_a4("localhost", cb)
+        P.submit_a4_many(["localhost"] * 4, cb)
+        # same name is coalesced within each resolver
+        self.assertEqual([R.active for R in P.resolvers], [1, 1])
+        for _ in range(TIMEOUT * 100):
+            P.ioevent()
+            P.timeouts(1)
+            time.sleep(0.01)
+            if not P.active:
+                break
+        self.assertEqual(len(flags), 2)
+        self.assertEqual(len(flags[1]), 4)
+
+    def test_pool_002(self):
+        P = udns.ResolverPool(2)
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        for R in P.resolvers:
+            R.set_transport(udns.TRANSPORT_MMSG)
+        # sent on next ioevent(), in flight when pool is closed
+        q = P.submit_a4("localhost", cb)
+        P.close()
+        self.assertEqual([R.sock for R in P.resolvers], [-1, -1])
+        P.ioevent()
+        self.assertEqual(flags, [None])
+        self.assertEqual(q.status, udns.E_TEMPFAIL)
+        self.assertEqual(P.active, 0)
+
+    def test_pool_003(self):
+        # truncated answer retried over TCP, driven only by ready fds
+        P = udns.ResolverPool(2)
+        flags = []
+        def cb(r, _data):
+            flags.append(r)
+        P.submit_a4("big1.test", cb)
+        socks = P.socks + P.tcp_socks
+        started = time.monotonic()
+        while not flags and time.monotonic() - started < 5:
+            P.timeouts(-1)
+            for sock in select.select(socks, [], [], 1)[0]:
+                P.ioevent(sock)
+        self.assertTrue(time.monotonic() - started < 1)
+        self.assertEqual([len(r) for r in flags], [60])
+        self.assertEqual(sum(R.tcp_stats["queries"] for R in P.resolvers), 1)
+        P.close()
+
 
 if __name__ == "__main__":
     unittest.main()
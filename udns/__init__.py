@@ -1 +1 @@
-from _udns import *
+from ._udns import *
@@ -0,0 +1,137 @@
+"""asyncio integration.
+
+Resolver socket and its TCP fd (retries of truncated answers) are watched
+with loop.add_reader(), udns retransmits and submit_addr() resolution delay
+are driven by one call_at() timer rescheduled from Resolver.timeouts() and
+next_deadline, so an idle resolver costs no wakeups.
+Futures are completed from the C callback.
+
+    R = udns.aio.Resolver()
+    addrs = await R.resolve_a4("example.com")
+"""
+import asyncio
+import time
+from . import _udns
+
+
+class Error(Exception):
+    """Lookup failed, `status` is one of udns.E_* codes."""
+
+    def __init__(self, status, name):
+        Exception.__init__(self, status, name)
+        self.status = status
+        self.name = name
+
+
+def _complete(result, fut):
+    if not fut.done():
+        fut.set_result(result)
+
+
+class Resolver(object):
+    """Wraps udns.Resolver (or new one) for use from coroutines of one loop.
+
+    Attaches to the running loop on first lookup. Plain submit_* methods of
+    `resolver` keep working, their callbacks are run by this loop too.
+    """
+
+    def __init__(self, resolver=None):
+        self.resolver = _udns.Resolver() if resolver is None else resolver
+        self._loop = None
+        self._sock = -1
+        self._tcp_sock = -1
+        self._timer = None
+        self._timer_at = None
+        self._tick_handle = None
+
+    async def resolve_a4(self, name, flags=0):
+        """Returns tuple of IPv4 address strings, or bytes with RESULT_PACKED."""
+        self._attach()
+        fut = self._loop.create_future()
+        return await self._wait(self.resolver.submit_a4(name, _complete, fut, flags), fut, name)
+
+    async def resolve(self, name, qtype=_udns.T_A, qclass=_udns.C_IN, flags=0):
+        """Returns RR object, see Resolver.submit()."""
+        self._attach()
+        fut = self._loop.create_future()
+        return await self._wait(self.resolver.submit(name, qclass, qtype, _complete, fut, flags), fut, name)
+
+    def close(self):
+        """Detaches from loop and closes underlying resolver."""
+        self._detach()
+        self.resolver.close()
+        # fails lookups whose TRANSPORT_MMSG or TCP socket was just closed
+        self.resolver.ioevent()
+
+    async def _wait(self, query, fut, name):
+        self._tick_soon()
+        try:
+            result = await fut
+        except asyncio.CancelledError:
+            query.cancel()
+            raise
+        if result is None:
+            raise Error(query.status or _udns.E_NOMEM, name)
+        return result
+
+    def _attach(self):
+        loop = asyncio.get_running_loop()
+        if loop is self._loop and self.resolver.sock == self._sock:
+            return
+        self._detach()
+        self._loop = loop
+        self._sock = self.resolver.sock
+        self._tcp_sock = self.resolver.tcp_sock
+        for sock in (self._sock, self._tcp_sock):
+            if sock >= 0:
+                loop.add_reader(sock, self._on_readable)
+
+    def _detach(self):
+        if self._loop is not None and not self._loop.is_closed():
+            for sock in (self._sock, self._tcp_sock):
+                if sock >= 0:
+                    self._loop.remove_reader(sock)
+        for handle in (self._timer, self._tick_handle):
+            if handle is not None:
+                handle.cancel()
+        self._loop = None
+        self._sock = self._tcp_sock = -1
+        self._timer = self._timer_at = self._tick_handle = None
+
+    def _on_readable(self):
+        self.resolver.ioevent()
+        self._reschedule()
+
+    # New submits may be answered from cache, those are delivered by
+    # ioevent(), and they need retransmit timer. One tick per loop iteration
+    # serves all submits made in it.
+    def _tick_soon(self):
+        if self._tick_handle is None:
+            self._tick_handle = self._loop.call_soon(self._tick)
+
+    def _tick(self):
+        self._tick_handle = None
+        self.resolver.ioevent()
+        self._reschedule()
+
+    def _on_timer(self):
+        self._timer = self._timer_at = None
+        self._reschedule()
+
+    def _reschedule(self):
+        self.resolver.timeouts(-1)
+        deadline = self.resolver.next_deadline
+        if deadline is None:
+            if self._timer is not None:
+                self._timer.cancel()
+                self._timer = self._timer_at = None
+            return
+        # loop clock may not be time.monotonic()
+        at = self._loop.time() + max(0., deadline - time.monotonic())
+        if self._timer is not None:
+            # early timer only reschedules, replace it when deadline is sooner
+            if self._timer_at <= at:
+                return
+            self._timer.cancel()
+        self._timer_at = at
+        self._timer = self._loop.call_at(at, self._on_timer)
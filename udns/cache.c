@@ -0,0 +1,610 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <udns.h>
+
+#include "cache.h"
+
+#define CACHE_MIN_BUCKETS 64
+
+#define SNAP_MAGIC     "PYUDNSC"
+#define SNAP_VERSION   1
+#define SNAP_BOM       0x01020304u
+#define SNAP_MIN_SLOTS 16
+#define SNAP_ALIGN(n)  (((n) + 7) & ~(uint64_t)7)
+
+
+// Snapshot file: header, table of record offsets (0 is empty slot, linear
+// probing from cache_hash() of name and qtype), then records aligned to
+// 8 bytes. Host byte order and struct layout; `bom` and `record_size`
+// reject files written on a different platform.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t bom;
+    uint32_t record_size;
+    uint32_t nslots;
+    uint32_t count;
+    uint32_t reserved;
+} snap_header;
+
+// Followed by normalized name with '\0', then `dlen` bytes of data.
+typedef struct {
+    int64_t expires; // absolute
+    uint32_t ttl;
+    int32_t qtype;
+    int32_t status;
+    int32_t nrr;
+    uint32_t dlen;
+    uint32_t hash;
+    uint32_t namelen;
+    uint32_t reserved;
+} snap_record;
+
+// Entry to be written by cache_save(), from cache or from mapped snapshot.
+typedef struct {
+    const char *name;
+    uint32_t namelen;
+    uint32_t hash;
+    int qtype;
+    int status;
+    int nrr;
+    unsigned ttl;
+    time_t expires;
+    const void *data;
+    size_t dlen;
+} snap_item;
+
+static cache_entry *snap_promote(dns_cache *c, const char *name, int qtype, unsigned hash, time_t now);
+
+
+int
+cache_normalize (const char *qname, char *buf) {
+    size_t i, len = strlen(qname);
+
+    if (len > 0 && '.' == qname[len - 1]) {
+        len--;
+    }
+    if (len >= CACHE_MAXNAME) {
+        return -1;
+    }
+    for (i = 0; i < len; i++) {
+        char ch = qname[i];
+        buf[i] = (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+    }
+    buf[len] = '\0';
+    return (int)len;
+}
+
+// FNV-1a
+unsigned
+cache_hash (const char *name, int qtype) {
+    unsigned h = 2166136261u;
+
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return (h ^ (unsigned)qtype) * 16777619u;
+}
+
+static void
+lru_unlink (dns_cache *c, cache_entry *e) {
+    if (NULL != e->prev) { e->prev->next = e->next; } else { c->head = e->next; }
+    if (NULL != e->next) { e->next->prev = e->prev; } else { c->tail = e->prev; }
+    e->prev = e->next = NULL;
+}
+
+static void
+lru_push_front (dns_cache *c, cache_entry *e) {
+    e->prev = NULL;
+    e->next = c->head;
+    if (NULL != c->head) { c->head->prev = e; } else { c->tail = e; }
+    c->head = e;
+}
+
+static void
+cache_remove (dns_cache *c, cache_entry *e) {
+    cache_entry **pp = &c->buckets[e->hash & (c->nbuckets - 1)];
+
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    lru_unlink(c, e);
+    c->count--;
+    c->bytes -= e->size;
+    free(e);
+}
+
+static void
+cache_evict (dns_cache *c, size_t max_bytes) {
+    while (c->bytes > max_bytes && NULL != c->tail) {
+        cache_remove(c, c->tail);
+        c->evictions++;
+    }
+}
+
+static int
+cache_grow (dns_cache *c) {
+    size_t i, n = c->nbuckets ? c->nbuckets * 2 : CACHE_MIN_BUCKETS;
+    cache_entry **buckets, *e, *next;
+
+    buckets = calloc(n, sizeof(cache_entry*));
+    if (NULL == buckets) {
+        return -1;
+    }
+    for (i = 0; i < c->nbuckets; i++) {
+        for (e = c->buckets[i]; NULL != e; e = next) {
+            next = e->hnext;
+            e->hnext = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = n;
+    return 0;
+}
+
+static cache_entry*
+cache_find (dns_cache *c, const char *name, int qtype, unsigned hash) {
+    cache_entry *e;
+
+    if (0 == c->nbuckets) {
+        return NULL;
+    }
+    for (e = c->buckets[hash & (c->nbuckets - 1)]; NULL != e; e = e->hnext) {
+        if (e->hash == hash && e->qtype == qtype && 0 == strcmp(e->qname, name)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Bytes of one cached record of `qtype`, 0 if such answers are not cached.
+static uint64_t
+snap_rr_size (int qtype) {
+    switch (qtype) {
+    case DNS_T_A:
+        return 4;
+    case DNS_T_AAAA:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+// Returns record at offset `off` of mapped snapshot, NULL if it does not fit
+// or is not what cache_save() writes.
+static const snap_record*
+snap_record_at (dns_cache *c, uint32_t off) {
+    const snap_record *r;
+    const char *name;
+
+    if (0 != off % 8 || (uint64_t)off + sizeof(snap_record) > c->snap_size) {
+        return NULL;
+    }
+    r = (const snap_record*)(c->snap + off);
+    name = (const char*)(r + 1);
+    if (r->namelen >= CACHE_MAXNAME ||
+        (uint64_t)off + sizeof(snap_record) + r->namelen + 1 + r->dlen > c->snap_size ||
+        memchr(name, '\0', r->namelen + 1) != name + r->namelen) {
+        return NULL;
+    }
+    // negative answers have no data, positive ones nrr fixed size records
+    if (0 != r->status ? 0 != r->nrr || 0 != r->dlen
+                       : r->nrr < 0 || 0 == snap_rr_size(r->qtype) ||
+                         (uint64_t)r->nrr * snap_rr_size(r->qtype) != r->dlen) {
+        return NULL;
+    }
+    return r;
+}
+
+static const snap_record*
+snap_find (dns_cache *c, const char *name, int qtype, unsigned hash) {
+    const uint32_t *slots = (const uint32_t*)(c->snap + sizeof(snap_header));
+    const snap_record *r;
+    uint32_t i, n, mask = c->snap_nslots - 1;
+
+    for (i = hash & mask, n = 0; n < c->snap_nslots && 0 != slots[i]; i = (i + 1) & mask, n++) {
+        r = snap_record_at(c, slots[i]);
+        if (NULL == r) {
+            return NULL;
+        }
+        if (r->hash == hash && r->qtype == qtype && 0 == strcmp(name, (const char*)(r + 1))) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void
+snap_unmap (dns_cache *c) {
+    if (NULL != c->snap) {
+        munmap((void*)c->snap, c->snap_size);
+    }
+    c->snap = NULL;
+    c->snap_size = 0;
+    c->snap_nslots = 0;
+    c->snap_count = 0;
+}
+
+void
+cache_init (dns_cache *c) {
+    memset(c, 0, sizeof(*c));
+    c->prefetch_min_hits = CACHE_PREFETCH_MIN_HITS;
+    c->prefetch_rate = CACHE_PREFETCH_RATE;
+}
+
+void
+cache_clear (dns_cache *c) {
+    while (NULL != c->head) {
+        cache_remove(c, c->head);
+    }
+    snap_unmap(c);
+}
+
+void
+cache_free (dns_cache *c) {
+    cache_clear(c);
+    free(c->buckets);
+    c->buckets = NULL;
+    c->nbuckets = 0;
+}
+
+void
+cache_set_max_bytes (dns_cache *c, size_t max_bytes) {
+    c->max_bytes = max_bytes;
+    cache_evict(c, max_bytes);
+}
+
+cache_entry*
+cache_lookup (dns_cache *c, const char *qname, int qtype, time_t now) {
+    char name[CACHE_MAXNAME];
+    cache_entry *e;
+    unsigned hash;
+
+    if (0 == c->max_bytes || cache_normalize(qname, name) < 0) {
+        return NULL;
+    }
+    hash = cache_hash(name, qtype);
+    e = cache_find(c, name, qtype, hash);
+    if (NULL != e && e->expires <= now) {
+        cache_remove(c, e);
+        e = NULL;
+    }
+    if (NULL == e && NULL != c->snap) {
+        e = snap_promote(c, name, qtype, hash, now);
+    }
+    if (NULL == e) {
+        c->misses++;
+        return NULL;
+    }
+    c->hits++;
+    e->hits++;
+    lru_unlink(c, e);
+    lru_push_front(c, e);
+    return e;
+}
+
+bool
+cache_prefetch_due (dns_cache *c, cache_entry *e, time_t now) {
+    if (c->prefetch_fraction <= 0 || e->refreshing || e->hits < c->prefetch_min_hits) {
+        return false;
+    }
+    if ((double)(now - (e->expires - (time_t)e->ttl)) < c->prefetch_fraction * e->ttl) {
+        return false;
+    }
+    if (now > c->prefetch_refilled) {
+        c->prefetch_tokens += (now - c->prefetch_refilled) * c->prefetch_rate;
+        if (c->prefetch_tokens > (c->prefetch_rate > 1. ? c->prefetch_rate : 1.)) {
+            c->prefetch_tokens = c->prefetch_rate > 1. ? c->prefetch_rate : 1.;
+        }
+        c->prefetch_refilled = now;
+    }
+    if (c->prefetch_tokens < 1.) {
+        // entry stays due, one of next hits gets the budget
+        c->prefetch_throttled++;
+        return false;
+    }
+    c->prefetch_tokens -= 1.;
+    c->prefetches++;
+    e->refreshing = true;
+    return true;
+}
+
+// Adds entry for normalized `name`, replacing existing one.
+// Returns it or NULL if it does not fit or out of memory.
+static cache_entry*
+cache_insert (dns_cache *c, const char *name, int len, unsigned hash, int qtype, int status,
+              unsigned ttl, time_t expires, int nrr, const void *data, size_t dlen) {
+    cache_entry *e;
+    unsigned hits = 0;
+    size_t size;
+
+    size = sizeof(cache_entry) + len + dlen;
+    if (size > c->max_bytes) {
+        return NULL;
+    }
+
+    e = cache_find(c, name, qtype, hash);
+    if (NULL != e) {
+        hits = e->hits;
+        cache_remove(c, e);
+    }
+    if (c->count >= c->nbuckets && cache_grow(c) < 0) {
+        return NULL;
+    }
+    cache_evict(c, c->max_bytes - size);
+
+    e = malloc(size);
+    if (NULL == e) {
+        return NULL;
+    }
+    memcpy(e->qname, name, len + 1);
+    e->data = (unsigned char*)e->qname + len + 1;
+    if (dlen > 0) {
+        memcpy(e->data, data, dlen);
+    }
+    e->dlen = dlen;
+    e->hash = hash;
+    e->qtype = qtype;
+    e->status = status;
+    e->ttl = ttl;
+    e->expires = expires;
+    e->nrr = nrr;
+    e->hits = hits;
+    e->refreshing = false;
+    e->size = size;
+
+    e->hnext = c->buckets[hash & (c->nbuckets - 1)];
+    c->buckets[hash & (c->nbuckets - 1)] = e;
+    lru_push_front(c, e);
+    c->count++;
+    c->bytes += size;
+    return e;
+}
+
+int
+cache_store (dns_cache *c, const char *qname, int qtype, int status,
+             unsigned ttl, int nrr, const void *data, size_t dlen, time_t now) {
+    char name[CACHE_MAXNAME];
+    int len;
+
+    if (0 == c->max_bytes || 0 == ttl) {
+        return -1;
+    }
+    len = cache_normalize(qname, name);
+    if (len < 0) {
+        return -1;
+    }
+    if (NULL == cache_insert(c, name, len, cache_hash(name, qtype), qtype, status,
+                             ttl, now + ttl, nrr, data, dlen)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Copies live snapshot record of normalized `name` into cache.
+static cache_entry*
+snap_promote (dns_cache *c, const char *name, int qtype, unsigned hash, time_t now) {
+    const snap_record *r;
+    cache_entry *e;
+
+    r = snap_find(c, name, qtype, hash);
+    if (NULL == r || r->expires <= now) {
+        return NULL;
+    }
+    e = cache_insert(c, name, r->namelen, hash, qtype, r->status, r->ttl, (time_t)r->expires,
+                     r->nrr, (const char*)(r + 1) + r->namelen + 1, r->dlen);
+    if (NULL != e) {
+        c->snap_hits++;
+    }
+    return e;
+}
+
+static void
+snap_item_add (snap_item *items, size_t *n, const char *name, uint32_t namelen, uint32_t hash,
+               int qtype, int status, int nrr, unsigned ttl, time_t expires,
+               const void *data, size_t dlen) {
+    snap_item *it = &items[(*n)++];
+
+    it->name = name;
+    it->namelen = namelen;
+    it->hash = hash;
+    it->qtype = qtype;
+    it->status = status;
+    it->nrr = nrr;
+    it->ttl = ttl;
+    it->expires = expires;
+    it->data = data;
+    it->dlen = dlen;
+}
+
+long
+cache_save (dns_cache *c, const char *path, time_t now) {
+    static const char pad[8];
+    char tmp[PATH_MAX];
+    snap_header hdr;
+    snap_record rec;
+    snap_item *items;
+    const snap_record *r;
+    const uint32_t *old;
+    uint32_t *slots = NULL, nslots = SNAP_MIN_SLOTS, i, j;
+    uint64_t off, size;
+    size_t n = 0;
+    cache_entry *e;
+    FILE *f = NULL;
+    bool created = false;
+    int fd, saved;
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    items = malloc((c->count + c->snap_count + 1) * sizeof(snap_item));
+    if (NULL == items) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (e = c->head; NULL != e; e = e->next) {
+        if (e->expires > now) {
+            snap_item_add(items, &n, e->qname, strlen(e->qname), e->hash, e->qtype, e->status,
+                          e->nrr, e->ttl, e->expires, e->data, e->dlen);
+        }
+    }
+    // snapshot records never asked for since load are kept too
+    old = NULL != c->snap ? (const uint32_t*)(c->snap + sizeof(snap_header)) : NULL;
+    for (i = 0; i < c->snap_nslots && n < c->count + c->snap_count; i++) {
+        if (0 == old[i] || NULL == (r = snap_record_at(c, old[i])) || r->expires <= now ||
+            NULL != cache_find(c, (const char*)(r + 1), r->qtype, r->hash)) {
+            continue;
+        }
+        snap_item_add(items, &n, (const char*)(r + 1), r->namelen, r->hash, r->qtype, r->status,
+                      r->nrr, r->ttl, r->expires, (const char*)(r + 1) + r->namelen + 1, r->dlen);
+    }
+
+    while (nslots < 2 * n) {
+        nslots <<= 1;
+    }
+    slots = calloc(nslots, sizeof(uint32_t));
+    if (NULL == slots) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    off = sizeof(snap_header) + (uint64_t)nslots * sizeof(uint32_t);
+    for (i = 0; i < n; i++) {
+        if (off > UINT32_MAX) {
+            errno = EFBIG;
+            goto fail;
+        }
+        for (j = items[i].hash & (nslots - 1); 0 != slots[j]; j = (j + 1) & (nslots - 1)) {
+        }
+        slots[j] = (uint32_t)off;
+        off += SNAP_ALIGN(sizeof(snap_record) + items[i].namelen + 1 + items[i].dlen);
+    }
+
+    // unique name, concurrent saves to the same path don't mix their writes
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        goto fail;
+    }
+    created = true;
+    f = fdopen(fd, "wb");
+    if (NULL == f) {
+        saved = errno;
+        close(fd);
+        errno = saved;
+        goto fail;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    hdr.version = SNAP_VERSION;
+    hdr.bom = SNAP_BOM;
+    hdr.record_size = sizeof(snap_record);
+    hdr.nslots = nslots;
+    hdr.count = (uint32_t)n;
+    if (1 != fwrite(&hdr, sizeof(hdr), 1, f) ||
+        nslots != fwrite(slots, sizeof(uint32_t), nslots, f)) {
+        goto fail;
+    }
+    for (i = 0; i < n; i++) {
+        memset(&rec, 0, sizeof(rec));
+        rec.expires = items[i].expires;
+        rec.ttl = items[i].ttl;
+        rec.qtype = items[i].qtype;
+        rec.status = items[i].status;
+        rec.nrr = items[i].nrr;
+        rec.dlen = (uint32_t)items[i].dlen;
+        rec.hash = items[i].hash;
+        rec.namelen = items[i].namelen;
+        size = sizeof(rec) + items[i].namelen + 1 + items[i].dlen;
+        if (1 != fwrite(&rec, sizeof(rec), 1, f) ||
+            1 != fwrite(items[i].name, items[i].namelen + 1, 1, f) ||
+            (items[i].dlen > 0 && 1 != fwrite(items[i].data, items[i].dlen, 1, f)) ||
+            (SNAP_ALIGN(size) > size && 1 != fwrite(pad, SNAP_ALIGN(size) - size, 1, f))) {
+            goto fail;
+        }
+    }
+    if (0 != fclose(f)) {
+        f = NULL;
+        goto fail;
+    }
+    f = NULL;
+    if (rename(tmp, path) < 0) {
+        goto fail;
+    }
+    free(slots);
+    free(items);
+    return (long)n;
+
+fail:
+    saved = errno;
+    if (NULL != f) {
+        fclose(f);
+    }
+    if (created) {
+        (void)unlink(tmp);
+    }
+    free(slots);
+    free(items);
+    errno = saved;
+    return -1;
+}
+
+long
+cache_load (dns_cache *c, const char *path) {
+    const snap_header *h;
+    struct stat st;
+    void *p;
+    int fd, saved;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if ((uint64_t)st.st_size < sizeof(snap_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    saved = errno;
+    close(fd);
+    if (MAP_FAILED == p) {
+        errno = saved;
+        return -1;
+    }
+
+    h = p;
+    if (0 != memcmp(h->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) || SNAP_VERSION != h->version ||
+        SNAP_BOM != h->bom || sizeof(snap_record) != h->record_size ||
+        h->nslots < SNAP_MIN_SLOTS || 0 != (h->nslots & (h->nslots - 1)) ||
+        sizeof(snap_header) + (uint64_t)h->nslots * sizeof(uint32_t) > (uint64_t)st.st_size) {
+        munmap(p, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    // lookups touch random pages, don't read ahead
+    (void)madvise(p, st.st_size, MADV_RANDOM);
+
+    snap_unmap(c);
+    c->snap = p;
+    c->snap_size = st.st_size;
+    c->snap_nslots = h->nslots;
+    c->snap_count = h->count;
+    return (long)h->count;
+}
@@ -0,0 +1,112 @@
+#ifndef udns_cache_h
+#define udns_cache_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define CACHE_MAXNAME 256
+#define CACHE_PREFETCH_MIN_HITS 8   // default hits to count entry as hot
+#define CACHE_PREFETCH_RATE     10. // default refresh queries per second
+
+
+// Answer cache keyed by (qname, qtype). Stores positive answers as packed
+// rdata (fixed size records, e.g. 4 bytes per A record) and negative answers
+// (status DNS_E_NXDOMAIN/DNS_E_NODATA) with no data.
+// Bounded by total memory, least recently used entries are evicted first.
+// Hot entries can be refreshed ahead of expiry, see cache_prefetch_due().
+// Snapshot saved by cache_save() is mapped by cache_load() and read on misses,
+// only entries actually asked for are copied into the cache.
+
+typedef struct cache_entry {
+    struct cache_entry *hnext; // hash chain
+    struct cache_entry *prev;  // LRU list, towards more recently used
+    struct cache_entry *next;  // LRU list, towards less recently used
+    unsigned hash;
+    int qtype;
+    int status;     // 0 for positive answer, DNS_E_* for negative
+    time_t expires; // absolute
+    unsigned ttl;
+    int nrr;
+    unsigned hits;  // since first stored, kept when entry is replaced
+    bool refreshing; // refresh query was sent for this entry
+    size_t size;    // accounted memory
+    size_t dlen;
+    unsigned char *data;
+    char qname[1];  // normalized, data follows
+} cache_entry;
+
+typedef struct {
+    cache_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t bytes;
+    size_t max_bytes; // 0 means cache is disabled
+    cache_entry *head; // most recently used
+    cache_entry *tail; // least recently used
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    // refresh-ahead, disabled while prefetch_fraction is 0
+    double prefetch_fraction; // of TTL elapsed
+    unsigned prefetch_min_hits;
+    double prefetch_rate; // token bucket: refreshes per second and burst size
+    double prefetch_tokens;
+    time_t prefetch_refilled;
+    unsigned long prefetches;
+    unsigned long prefetch_throttled; // due but over rate budget
+    // snapshot mapped by cache_load(), NULL if none
+    const unsigned char *snap;
+    size_t snap_size;
+    uint32_t snap_nslots;
+    uint32_t snap_count;
+    unsigned long snap_hits;
+} dns_cache;
+
+// Key helpers, also used for the in-flight query table.
+// Lowercases qname into buf (CACHE_MAXNAME bytes) and strips trailing dot.
+// Returns length or -1 if name is too long.
+int cache_normalize(const char *qname, char *buf);
+unsigned cache_hash(const char *name, int qtype);
+
+void cache_init(dns_cache *c);
+void cache_free(dns_cache *c);
+// Also unmaps snapshot.
+void cache_clear(dns_cache *c);
+void cache_set_max_bytes(dns_cache *c, size_t max_bytes);
+
+// Returns live entry or NULL, counts hit or miss. Expired entries are dropped.
+// Entry is valid until next cache_store/cache_clear call.
+cache_entry *cache_lookup(dns_cache *c, const char *qname, int qtype, time_t now);
+
+// Returns true if `e`, just returned by cache_lookup(), should be refreshed
+// now: it was hit at least prefetch_min_hits times, prefetch_fraction of its
+// TTL has passed, no refresh was sent yet and rate budget allows one more.
+// Entry is marked as refreshing then, caller must send the query.
+bool cache_prefetch_due(dns_cache *c, cache_entry *e, time_t now);
+
+// Returns 0 on success or -1 if cache is disabled, entry does not fit or
+// out of memory. Replaces existing entry for the same key.
+int cache_store(dns_cache *c, const char *qname, int qtype, int status,
+                unsigned ttl, int nrr, const void *data, size_t dlen, time_t now);
+
+// Writes unexpired entries, including ones still only in mapped snapshot,
+// to `path` atomically (temporary file renamed over it).
+// Returns number of entries or -1 with errno set.
+long cache_save(dns_cache *c, const char *path, time_t now);
+
+// Maps snapshot file instead of the current one, records are not read until
+// looked up. Returns number of records or -1 with errno set, EINVAL if file
+// is not a snapshot of this version and platform.
+long cache_load(dns_cache *c, const char *path);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // udns_cache_h
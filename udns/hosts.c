@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <udns.h>
+
+#include "cache.h"
+#include "hosts.h"
+
+// cache_hash() of names is mixed with this instead of qtype
+#define HOSTS_HASH_KEY 0
+
+
+void
+hosts_init (dns_hosts *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+static void
+hosts_free_index (hosts_entry **buckets, size_t nbuckets) {
+    hosts_entry *e, *next;
+    size_t i;
+
+    for (i = 0; i < nbuckets; i++) {
+        for (e = buckets[i]; NULL != e; e = next) {
+            next = e->hnext;
+            free(e->addr4);
+            free(e->addr6);
+            free(e);
+        }
+    }
+    free(buckets);
+}
+
+void
+hosts_free (dns_hosts *h) {
+    hosts_free_index(h->buckets, h->nbuckets);
+    free(h->path);
+    hosts_init(h);
+}
+
+static hosts_entry*
+hosts_find (hosts_entry **buckets, size_t nbuckets, const char *name, unsigned hash) {
+    hosts_entry *e;
+
+    for (e = buckets[hash & (nbuckets - 1)]; NULL != e; e = e->hnext) {
+        if (hash == e->hash && 0 == strcmp(name, e->name)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Appends address to entry of `name`, creating it. Returns -1 on ENOMEM.
+static int
+hosts_add (hosts_entry **buckets, size_t nbuckets, size_t *count, const char *name, int af, const void *addr) {
+    char qname[CACHE_MAXNAME];
+    hosts_entry *e;
+    unsigned hash;
+    int len, i;
+    void *p;
+
+    len = cache_normalize(name, qname);
+    if (len <= 0) {
+        return 0; // too long to be ever asked, skip
+    }
+    hash = cache_hash(qname, HOSTS_HASH_KEY);
+    e = hosts_find(buckets, nbuckets, qname, hash);
+    if (NULL == e) {
+        e = calloc(1, sizeof(hosts_entry) + len);
+        if (NULL == e) {
+            return -1;
+        }
+        memcpy(e->name, qname, len + 1);
+        e->hash = hash;
+        e->hnext = buckets[hash & (nbuckets - 1)];
+        buckets[hash & (nbuckets - 1)] = e;
+        (*count)++;
+    }
+    if (AF_INET == af) {
+        for (i = 0; i < e->nrr4; i++) {
+            if (0 == memcmp(&e->addr4[i], addr, sizeof(struct in_addr))) {
+                return 0;
+            }
+        }
+        p = realloc(e->addr4, (e->nrr4 + 1) * sizeof(struct in_addr));
+        if (NULL == p) {
+            return -1;
+        }
+        e->addr4 = p;
+        memcpy(&e->addr4[e->nrr4++], addr, sizeof(struct in_addr));
+    } else {
+        for (i = 0; i < e->nrr6; i++) {
+            if (0 == memcmp(&e->addr6[i], addr, sizeof(struct in6_addr))) {
+                return 0;
+            }
+        }
+        p = realloc(e->addr6, (e->nrr6 + 1) * sizeof(struct in6_addr));
+        if (NULL == p) {
+            return -1;
+        }
+        e->addr6 = p;
+        memcpy(&e->addr6[e->nrr6++], addr, sizeof(struct in6_addr));
+    }
+    return 0;
+}
+
+// Builds new index from file and swaps it in. Returns 0 or -1 with errno.
+static int
+hosts_load (dns_hosts *h, const char *path, const struct stat *st) {
+    char line[1024], *p, *name, *save;
+    unsigned char addr[sizeof(struct in6_addr)];
+    hosts_entry **buckets;
+    size_t nbuckets = 64, count = 0;
+    FILE *f;
+    int af;
+
+    // about 64 bytes per line, 2 entries per line on average
+    while (nbuckets < (size_t)st->st_size / 32) {
+        nbuckets <<= 1;
+    }
+    f = fopen(path, "r");
+    if (NULL == f) {
+        return -1;
+    }
+    buckets = calloc(nbuckets, sizeof(hosts_entry*));
+    if (NULL == buckets) {
+        fclose(f);
+        errno = ENOMEM;
+        return -1;
+    }
+    while (NULL != fgets(line, sizeof(line), f)) {
+        p = strchr(line, '#');
+        if (NULL != p) {
+            *p = '\0';
+        }
+        p = strtok_r(line, " \t\r\n", &save);
+        if (NULL == p) {
+            continue;
+        }
+        if (dns_pton(AF_INET, p, addr) > 0) {
+            af = AF_INET;
+        } else if (dns_pton(AF_INET6, p, addr) > 0) {
+            af = AF_INET6;
+        } else {
+            continue;
+        }
+        while (NULL != (name = strtok_r(NULL, " \t\r\n", &save))) {
+            if (hosts_add(buckets, nbuckets, &count, name, af, addr) < 0) {
+                fclose(f);
+                hosts_free_index(buckets, nbuckets);
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+    fclose(f);
+
+    hosts_free_index(h->buckets, h->nbuckets);
+    h->buckets = buckets;
+    h->nbuckets = nbuckets;
+    h->count = count;
+    h->mtime = st->st_mtim;
+    h->size = st->st_size;
+    h->ino = st->st_ino;
+    h->reloads++;
+    return 0;
+}
+
+int
+hosts_set_path (dns_hosts *h, const char *path) {
+    struct stat st;
+    char *copy;
+
+    if (NULL == path) {
+        hosts_free(h);
+        return 0;
+    }
+    copy = strdup(path);
+    if (NULL == copy) {
+        return -1;
+    }
+    if (stat(path, &st) < 0 || hosts_load(h, path, &st) < 0) {
+        free(copy);
+        return -1;
+    }
+    free(h->path);
+    h->path = copy;
+    h->checked = time(NULL);
+    return 0;
+}
+
+hosts_entry*
+hosts_lookup (dns_hosts *h, const char *qname, time_t now) {
+    char name[CACHE_MAXNAME];
+    struct stat st;
+    hosts_entry *e;
+    unsigned hash;
+
+    if (NULL == h->path) {
+        return NULL;
+    }
+    if (now != h->checked) {
+        h->checked = now;
+        if (0 == stat(h->path, &st) &&
+            (st.st_mtim.tv_sec != h->mtime.tv_sec || st.st_mtim.tv_nsec != h->mtime.tv_nsec ||
+             st.st_size != h->size || st.st_ino != h->ino)) {
+            (void)hosts_load(h, h->path, &st);
+        }
+    }
+    if (0 == h->count || cache_normalize(qname, name) < 0) {
+        return NULL;
+    }
+    hash = cache_hash(name, HOSTS_HASH_KEY);
+    e = hosts_find(h->buckets, h->nbuckets, name, hash);
+    if (NULL != e) {
+        h->hits++;
+    }
+    return e;
+}
@@ -0,0 +1,55 @@
+#ifndef udns_hosts_h
+#define udns_hosts_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+
+// Index of hosts(5) file: name or alias -> all its IPv4 and IPv6 addresses
+// in file order. File is stat()ed at most once a second on lookup and
+// reloaded when its mtime, size or inode changes. If it can't be read the
+// previous index stays, e.g. while file is being replaced.
+
+typedef struct hosts_entry {
+    struct hosts_entry *hnext;
+    unsigned hash;
+    int nrr4;
+    int nrr6;
+    struct in_addr *addr4;
+    struct in6_addr *addr6;
+    char name[1]; // normalized
+} hosts_entry;
+
+typedef struct {
+    char *path; // NULL when disabled
+    hosts_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    time_t checked; // last stat()
+    struct timespec mtime;
+    off_t size;
+    ino_t ino;
+    unsigned long hits;
+    unsigned long reloads;
+} dns_hosts;
+
+void hosts_init(dns_hosts *h);
+void hosts_free(dns_hosts *h);
+// Loads `path` and watches it from now on, NULL disables index.
+// Returns 0 or -1 with errno set, index is unchanged on failure.
+int hosts_set_path(dns_hosts *h, const char *path);
+// Returns entry for `qname` or NULL, reloads changed file first.
+// Entry is valid until next hosts_lookup/hosts_set_path call.
+hosts_entry *hosts_lookup(dns_hosts *h, const char *qname, time_t now);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // udns_hosts_h
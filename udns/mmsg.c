@@ -0,0 +1,652 @@
+#ifdef __linux__
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <udns.h>
+
+#include "mmsg.h"
+#include "probes.h"
+
+#define MMSG_QR 0x80 // byte 2 of header
+#define MMSG_TC 0x02
+#define MMSG_RD 0x01
+
+
+#if !defined(__linux__)
+// Same contract as Linux calls, one datagram per syscall.
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+static int
+sendmmsg (int fd, struct mmsghdr *msgs, unsigned int n, int flags) {
+    unsigned int i;
+    ssize_t r;
+
+    for (i = 0; i < n; i++) {
+        r = sendmsg(fd, &msgs[i].msg_hdr, flags);
+        if (r < 0) {
+            return 0 == i ? -1 : (int)i;
+        }
+        msgs[i].msg_len = r;
+    }
+    return (int)n;
+}
+
+static int
+recvmmsg (int fd, struct mmsghdr *msgs, unsigned int n, int flags, struct timespec *timeout) {
+    unsigned int i;
+    ssize_t r;
+
+    for (i = 0; i < n; i++) {
+        r = recvmsg(fd, &msgs[i].msg_hdr, flags);
+        if (r < 0) {
+            return 0 == i ? -1 : (int)i;
+        }
+        msgs[i].msg_len = r;
+    }
+    return (int)n;
+}
+
+#define MSG_DONTWAIT 0 // socket is non-blocking anyway
+#endif
+
+// Syscall argument arrays, set up once on open. Only fields the kernel
+// overwrites are reset before reuse.
+typedef struct {
+    struct mmsghdr tx[MMSG_BATCH];
+    struct iovec txiov[MMSG_BATCH];
+    struct mmsghdr rx[MMSG_BATCH];
+    struct iovec rxiov[MMSG_BATCH];
+    struct sockaddr_storage from[MMSG_BATCH];
+    unsigned char buf[MMSG_BATCH][MMSG_PKTSIZ];
+} mmsg_io;
+
+
+void
+mmsg_init (dns_mmsg *t) {
+    memset(t, 0, sizeof(*t));
+    t->fd = -1;
+}
+
+void
+mmsg_free (dns_mmsg *t) {
+    mmsg_query *q, *next;
+
+    for (q = t->thead; NULL != q; q = next) {
+        next = q->tnext;
+        free(q);
+    }
+    for (q = t->shead; NULL != q; q = next) {
+        next = q->snext;
+        free(q);
+    }
+    t->thead = t->ttail = t->shead = t->stail = NULL;
+    t->active = 0;
+    mmsg_close(t);
+}
+
+static int
+mmsg_parse_serv (const char *addr, struct sockaddr_storage *ss, socklen_t *len) {
+    struct sockaddr_in *sin = (struct sockaddr_in*)ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)ss;
+
+    memset(ss, 0, sizeof(*ss));
+    if (dns_pton(AF_INET, addr, &sin->sin_addr) > 0) {
+        sin->sin_family = AF_INET;
+        *len = sizeof(*sin);
+        return 0;
+    }
+    if (dns_pton(AF_INET6, addr, &sin6->sin6_addr) > 0) {
+        sin6->sin6_family = AF_INET6;
+        *len = sizeof(*sin6);
+        return 0;
+    }
+    return -1;
+}
+
+int
+mmsg_add_serv (dns_mmsg *t, const char *addr) {
+    t->servs_set = true;
+    if (NULL == addr) {
+        t->nservs = 0;
+        return 0;
+    }
+    if (t->nservs >= MMSG_MAXSERV ||
+        mmsg_parse_serv(addr, &t->servs[t->nservs], &t->servlens[t->nservs]) < 0) {
+        return -1;
+    }
+    return ++t->nservs;
+}
+
+static void
+mmsg_read_conf (dns_mmsg *t) {
+    char line[512], addr[64];
+    FILE *f;
+
+    f = fopen("/etc/resolv.conf", "r");
+    if (NULL == f) {
+        return;
+    }
+    while (t->nservs < MMSG_MAXSERV && NULL != fgets(line, sizeof(line), f)) {
+        if (1 == sscanf(line, " nameserver %63s", addr) &&
+            0 == mmsg_parse_serv(addr, &t->servs[t->nservs], &t->servlens[t->nservs])) {
+            t->nservs++;
+        }
+    }
+    fclose(f);
+}
+
+static unsigned
+mmsg_random (dns_mmsg *t) {
+    // xorshift32, seeded from /dev/urandom on open
+    unsigned x = t->qid_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    t->qid_state = x;
+    return x;
+}
+
+int
+mmsg_open (dns_mmsg *t, int port, int timeout, int ntries) {
+    struct sockaddr_in *sin;
+    mmsg_io *io;
+    int fd, i, n, family;
+    FILE *f;
+
+    if (!t->servs_set && 0 == t->nservs) {
+        mmsg_read_conf(t);
+    }
+    if (0 == t->nservs) {
+        mmsg_add_serv(t, "127.0.0.1");
+    }
+    // one socket, servers of other address family are dropped
+    family = t->servs[0].ss_family;
+    for (i = n = 0; i < t->nservs; i++) {
+        if (family == t->servs[i].ss_family) {
+            t->servs[n] = t->servs[i];
+            t->servlens[n] = t->servlens[i];
+            sin = (struct sockaddr_in*)&t->servs[n];
+            // sin_port and sin6_port share offset
+            sin->sin_port = htons(port);
+            n++;
+        }
+    }
+    t->nservs = n;
+    memset(t->stats, 0, sizeof(t->stats));
+    t->port = port;
+    t->timeout = timeout > 0 ? timeout : 1;
+    t->ntries = ntries > 0 ? ntries : 1;
+
+    if (NULL == t->buckets) {
+        t->buckets = calloc(MMSG_NBUCKETS, sizeof(mmsg_query*));
+        t->io = calloc(1, sizeof(mmsg_io));
+        if (NULL == t->buckets || NULL == t->io) {
+            free(t->buckets);
+            free(t->io);
+            t->buckets = NULL;
+            t->io = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+        io = t->io;
+        for (i = 0; i < MMSG_BATCH; i++) {
+            io->tx[i].msg_hdr.msg_iov = &io->txiov[i];
+            io->tx[i].msg_hdr.msg_iovlen = 1;
+            io->rxiov[i].iov_base = io->buf[i];
+            io->rxiov[i].iov_len = MMSG_PKTSIZ;
+            io->rx[i].msg_hdr.msg_name = &io->from[i];
+            io->rx[i].msg_hdr.msg_iov = &io->rxiov[i];
+            io->rx[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+    f = fopen("/dev/urandom", "rb");
+    if (NULL == f || 1 != fread(&t->qid_state, sizeof(t->qid_state), 1, f)) {
+        t->qid_state = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+    }
+    if (NULL != f) {
+        fclose(f);
+    }
+    t->qid_state |= 1; // xorshift state must not be 0
+
+    fd = socket(family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        close(fd);
+        return -1;
+    }
+    t->fd = fd;
+    return fd;
+}
+
+void
+mmsg_close (dns_mmsg *t) {
+    if (t->fd >= 0) {
+        close(t->fd);
+        t->fd = -1;
+    }
+    free(t->buckets);
+    free(t->io);
+    t->buckets = NULL;
+    t->io = NULL;
+}
+
+static long long
+mmsg_now_us (void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Expected latency of asking server first, in microseconds.
+static double
+mmsg_cost (const dns_mmsg *t, const mmsg_serv_stats *s) {
+    return s->srtt + s->fail * t->timeout * 1e6;
+}
+
+int
+mmsg_best_serv (const dns_mmsg *t) {
+    const mmsg_serv_stats *a, *b;
+    int i, best = 0;
+
+    for (i = 1; i < t->nservs; i++) {
+        a = &t->stats[i];
+        b = &t->stats[best];
+        // healthy beats degraded, then lower cost, then configured order
+        if ((a->fail < MMSG_DEGRADED) != (b->fail < MMSG_DEGRADED)
+            ? a->fail < MMSG_DEGRADED
+            : mmsg_cost(t, a) < mmsg_cost(t, b)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// First server of new query: degraded one whose probe is due, or the best.
+static int
+mmsg_pick_serv (dns_mmsg *t, time_t now) {
+    mmsg_serv_stats *s;
+    int i;
+
+    for (i = 0; i < t->nservs; i++) {
+        s = &t->stats[i];
+        if (s->fail >= MMSG_DEGRADED && now - s->probed >= MMSG_PROBE_EVERY) {
+            s->probed = now;
+            s->probes++;
+            return i;
+        }
+    }
+    return mmsg_best_serv(t);
+}
+
+static void
+mmsg_serv_failed (dns_mmsg *t, int serv, time_t now) {
+    mmsg_serv_stats *s = &t->stats[serv];
+
+    if (s->fail < MMSG_DEGRADED) {
+        s->probed = now; // first probe one interval after degrading
+    }
+    s->fail += (1.0 - s->fail) * MMSG_FAIL_GAIN;
+}
+
+static void
+mmsg_serv_replied (dns_mmsg *t, int serv, mmsg_query *q, long long now_us) {
+    mmsg_serv_stats *s = &t->stats[serv];
+    double rtt;
+
+    s->replies++;
+    s->fail -= s->fail * MMSG_FAIL_GAIN;
+    // Karn: only samples that can not be a reply to an earlier datagram
+    if (serv == q->serv && q->sends <= t->nservs) {
+        rtt = (double)(now_us - q->sent_us);
+        s->srtt = 0 == s->srtt ? rtt : s->srtt + (rtt - s->srtt) * MMSG_RTT_GAIN;
+    }
+}
+
+static mmsg_query**
+mmsg_bucket (dns_mmsg *t, unsigned qid) {
+    return &t->buckets[qid & (MMSG_NBUCKETS - 1)];
+}
+
+static mmsg_query*
+mmsg_find (dns_mmsg *t, unsigned qid) {
+    mmsg_query *q;
+
+    for (q = *mmsg_bucket(t, qid); NULL != q; q = q->hnext) {
+        if (qid == q->qid) {
+            return q;
+        }
+    }
+    return NULL;
+}
+
+static void
+mmsg_unhash (dns_mmsg *t, mmsg_query *q) {
+    mmsg_query **p;
+
+    for (p = mmsg_bucket(t, q->qid); *p != q; p = &(*p)->hnext) {
+    }
+    *p = q->hnext;
+}
+
+static void
+mmsg_timer_remove (dns_mmsg *t, mmsg_query *q) {
+    if (NULL != q->tprev) {
+        q->tprev->tnext = q->tnext;
+    } else if (t->thead == q) {
+        t->thead = q->tnext;
+    } else {
+        return; // not in list
+    }
+    if (NULL != q->tnext) {
+        q->tnext->tprev = q->tprev;
+    } else {
+        t->ttail = q->tprev;
+    }
+    q->tprev = q->tnext = NULL;
+}
+
+// Deadlines are mostly appended, first send of every query has the same timeout.
+static void
+mmsg_timer_insert (dns_mmsg *t, mmsg_query *q) {
+    mmsg_query *after = t->ttail;
+
+    while (NULL != after && after->deadline > q->deadline) {
+        after = after->tprev;
+    }
+    q->tprev = after;
+    q->tnext = NULL == after ? t->thead : after->tnext;
+    if (NULL == after) {
+        t->thead = q;
+    } else {
+        after->tnext = q;
+    }
+    if (NULL == q->tnext) {
+        t->ttail = q;
+    } else {
+        q->tnext->tprev = q;
+    }
+}
+
+static void
+mmsg_queue (dns_mmsg *t, mmsg_query *q) {
+    mmsg_timer_remove(t, q);
+    q->queued = true;
+    q->snext = NULL;
+    if (NULL == t->stail) {
+        t->shead = q;
+    } else {
+        t->stail->snext = q;
+    }
+    t->stail = q;
+}
+
+// Removes q from every list, it is not reachable from transport after that.
+static void
+mmsg_detach (dns_mmsg *t, mmsg_query *q) {
+    mmsg_query **p, *prev = NULL;
+
+    mmsg_unhash(t, q);
+    mmsg_timer_remove(t, q);
+    if (q->queued) {
+        for (p = &t->shead; *p != q; p = &(*p)->snext) {
+            prev = *p;
+        }
+        *p = q->snext;
+        if (t->stail == q) {
+            t->stail = prev;
+        }
+    }
+    t->active--;
+}
+
+static void
+mmsg_finish (dns_mmsg *t, mmsg_query *q, int serv, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status) {
+    mmsg_detach(t, q);
+    q->done(q->data, serv, q->pkt + DNS_HSIZE, pkt, cur, end, status);
+    free(q);
+}
+
+mmsg_query*
+mmsg_submit (dns_mmsg *t, dnscc_t *dn, int qcls, int qtyp, int flags, mmsg_done_fn *done, void *data) {
+    mmsg_query *q, **bucket;
+    dnsc_t *p;
+    unsigned dnlen = dns_dnlen(dn);
+
+    if (t->fd < 0 || 0 == t->nservs) {
+        t->status = DNS_E_TEMPFAIL;
+        return NULL;
+    }
+    if (t->active >= 0xffff) {
+        t->status = DNS_E_TEMPFAIL; // out of query ids
+        return NULL;
+    }
+    q = malloc(sizeof(*q));
+    if (NULL == q) {
+        t->status = DNS_E_NOMEM;
+        return NULL;
+    }
+    memset(q, 0, offsetof(mmsg_query, pkt));
+    do {
+        q->qid = mmsg_random(t) & 0xffff;
+    } while (NULL != mmsg_find(t, q->qid));
+    q->done = done;
+    q->data = data;
+
+    p = q->pkt;
+    memset(p, 0, DNS_HSIZE);
+    p[0] = q->qid >> 8;
+    p[1] = q->qid & 0xff;
+    p[2] = (flags & DNS_NORD) ? 0 : MMSG_RD;
+    p[5] = 1; // qdcount
+    memcpy(p + DNS_HSIZE, dn, dnlen);
+    p = dns_put16(p + DNS_HSIZE + dnlen, qtyp);
+    p = dns_put16(p, qcls);
+    q->plen = p - q->pkt;
+
+    bucket = mmsg_bucket(t, q->qid);
+    q->hnext = *bucket;
+    *bucket = q;
+    t->active++;
+    mmsg_queue(t, q);
+    return q;
+}
+
+void
+mmsg_cancel (dns_mmsg *t, mmsg_query *q) {
+    mmsg_detach(t, q);
+    free(q);
+}
+
+void
+mmsg_flush (dns_mmsg *t, time_t now) {
+    mmsg_io *io = t->io;
+    mmsg_query *q;
+    long long now_us;
+    int n, serv;
+
+    if (NULL == t->shead) {
+        return;
+    }
+    if (0 == now) {
+        now = time(NULL);
+    }
+    now_us = mmsg_now_us();
+    while (NULL != t->shead) {
+        for (n = 0; n < MMSG_BATCH && NULL != (q = t->shead); n++) {
+            t->shead = q->snext;
+            q->queued = false;
+            if (0 == q->sends) {
+                q->first = mmsg_pick_serv(t, now);
+            }
+            serv = (q->first + q->sends) % t->nservs;
+            q->serv = serv;
+            q->sent_us = now_us;
+            t->stats[serv].sent++;
+            q->deadline = now + ((time_t)t->timeout << (q->sends / t->nservs));
+            q->sends++;
+            mmsg_timer_insert(t, q);
+            io->txiov[n].iov_base = q->pkt;
+            io->txiov[n].iov_len = q->plen;
+            io->tx[n].msg_hdr.msg_name = &t->servs[serv];
+            io->tx[n].msg_hdr.msg_namelen = t->servlens[serv];
+        }
+        if (NULL == t->shead) {
+            t->stail = NULL;
+        }
+        // datagrams after a failed one are not retried here, like lost ones
+        // they are resent when their deadline passes
+        (void)sendmmsg(t->fd, io->tx, n, 0);
+    }
+}
+
+// Index of server reply came from, -1 if query could not be sent there.
+static int
+mmsg_from_serv (dns_mmsg *t, const struct sockaddr_storage *from, socklen_t fromlen) {
+    int i;
+
+    for (i = 0; i < t->nservs; i++) {
+        if (fromlen == t->servlens[i] && 0 == memcmp(from, &t->servs[i], fromlen)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void
+mmsg_reply (dns_mmsg *t, int serv, dnscc_t *pkt, unsigned len, time_t now, long long now_us) {
+    dnscc_t *end = pkt + len, *cur, *qcur;
+    mmsg_query *q;
+    dnsc_t dn[DNS_MAXDN];
+    unsigned qlen;
+
+    if (len < DNS_HSIZE || !(pkt[2] & MMSG_QR)) {
+        return;
+    }
+    q = mmsg_find(t, dns_get16(pkt));
+    if (NULL == q) {
+        return; // late reply to finished or cancelled query
+    }
+    // question must be the one asked, name compared case-insensitively
+    cur = pkt + DNS_HSIZE;
+    qcur = q->pkt + DNS_HSIZE;
+    qlen = dns_dnlen(qcur);
+    if (1 != dns_get16(pkt + 4) ||
+        dns_getdn(pkt, &cur, end, dn, sizeof(dn)) <= 0 ||
+        cur + 4 > end ||
+        !dns_dnequal(dn, qcur) ||
+        0 != memcmp(cur, qcur + qlen, 4)) {
+        return;
+    }
+
+    switch (pkt[3] & 0x0f) {
+    case 0:
+    case 3:
+        mmsg_serv_replied(t, serv, q, now_us);
+        break;
+    default:
+        mmsg_serv_failed(t, serv, now);
+    }
+    if (pkt[2] & MMSG_TC) {
+        mmsg_finish(t, q, serv, NULL, NULL, NULL, DNS_E_PROTOCOL);
+        return;
+    }
+    switch (pkt[3] & 0x0f) {
+    case 0: // NOERROR
+        mmsg_finish(t, q, serv, pkt, cur, end, 0);
+        return;
+    case 3: // NXDOMAIN
+        mmsg_finish(t, q, serv, NULL, NULL, NULL, DNS_E_NXDOMAIN);
+        return;
+    default:
+        // SERVFAIL, REFUSED and friends: ask next server right away
+        if (q->sends >= t->ntries * t->nservs) {
+            mmsg_finish(t, q, serv, NULL, NULL, NULL, DNS_E_TEMPFAIL);
+        } else {
+            mmsg_queue(t, q);
+        }
+    }
+}
+
+void
+mmsg_ioevent (dns_mmsg *t, time_t now) {
+    mmsg_io *io = t->io;
+    long long now_us;
+    int i, n, serv;
+
+    // callback calling ioevent() again would overwrite receive buffers
+    if (t->fd < 0 || t->in_ioevent) {
+        return;
+    }
+    if (0 == now) {
+        now = time(NULL);
+    }
+    t->in_ioevent = true;
+    do {
+        for (i = 0; i < MMSG_BATCH; i++) {
+            io->rx[i].msg_hdr.msg_namelen = sizeof(io->from[i]);
+        }
+        n = recvmmsg(t->fd, io->rx, MMSG_BATCH, MSG_DONTWAIT, NULL);
+        now_us = mmsg_now_us();
+        for (i = 0; i < n; i++) {
+            if (io->rx[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                continue; // larger than any reply to query without EDNS0
+            }
+            serv = mmsg_from_serv(t, &io->from[i], io->rx[i].msg_hdr.msg_namelen);
+            if (serv >= 0) {
+                mmsg_reply(t, serv, io->buf[i], io->rx[i].msg_len, now, now_us);
+            }
+        }
+        // short batch means socket is drained, save the EAGAIN call
+    } while (MMSG_BATCH == n && t->fd >= 0);
+    t->in_ioevent = false;
+    mmsg_flush(t, now);
+}
+
+int
+mmsg_timeouts (dns_mmsg *t, int maxwait, time_t now) {
+    mmsg_query *q;
+    int wait;
+
+    if (0 == now) {
+        now = time(NULL);
+    }
+    while (NULL != (q = t->thead) && q->deadline <= now) {
+        t->stats[q->serv].timeouts++;
+        mmsg_serv_failed(t, q->serv, now);
+        if (q->sends >= t->ntries * t->nservs) {
+            mmsg_finish(t, q, -1, NULL, NULL, NULL, DNS_E_TEMPFAIL);
+        } else {
+            PYUDNS_PROBE5(mmsg_retry, q->data, dns_get16(q->pkt + DNS_HSIZE + dns_dnlen(q->pkt + DNS_HSIZE)),
+                          q->serv, q->sends, mmsg_now_us());
+            mmsg_queue(t, q);
+        }
+    }
+    mmsg_flush(t, now);
+
+    if (NULL == t->thead) {
+        return maxwait;
+    }
+    wait = (int)(t->thead->deadline - now);
+    if (maxwait >= 0 && wait > maxwait) {
+        wait = maxwait;
+    }
+    return wait;
+}
@@ -0,0 +1,124 @@
+#ifndef udns_mmsg_h
+#define udns_mmsg_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <udns.h>
+
+#define MMSG_BATCH    64   // datagrams per sendmmsg()/recvmmsg() call
+#define MMSG_PKTSIZ   1232 // receive buffer per datagram
+#define MMSG_MAXSERV  6
+#define MMSG_NBUCKETS 1024 // qid hash, power of 2
+#define MMSG_QSIZ     (DNS_HSIZE + DNS_MAXDN + 4) // largest query packet
+#define MMSG_RTT_GAIN    0.125 // smoothed RTT weight of new sample, as TCP
+#define MMSG_FAIL_GAIN   0.25  // failure rate weight of new outcome
+#define MMSG_DEGRADED    0.5   // failure rate from which server is avoided
+#define MMSG_PROBE_EVERY 2     // seconds between probes of degraded server
+
+
+// Batched UDP transport used instead of udns socket I/O when enabled.
+// Queries are queued by mmsg_submit() and sent together by mmsg_flush()
+// with one sendmmsg(), replies are drained with recvmmsg() by mmsg_ioevent().
+// Servers are tried in turn like udns does, `ntries` rounds over all of them,
+// timeout doubles every round. Names are absolute, search list is not used.
+//
+// Round of a new query starts at the healthy server with the lowest expected
+// latency: smoothed RTT plus failure rate times timeout. Servers with failure
+// rate at MMSG_DEGRADED or above are only asked first by one query every
+// MMSG_PROBE_EVERY seconds, its retries move on to the next server.
+
+typedef struct mmsg_query mmsg_query;
+
+// Called exactly once per query unless cancelled. On success `status` is 0,
+// `pkt`..`end` is the reply and `cur` points to qtype of its question,
+// `qdn` is the query name for dns_parse_*(). Otherwise pkt is NULL and status
+// is DNS_E_NXDOMAIN, DNS_E_TEMPFAIL (no usable reply in all attempts) or
+// DNS_E_PROTOCOL (truncated reply). `serv` is index of server whose reply
+// ended the query, -1 after timeout. Query is freed after callback returns.
+typedef void mmsg_done_fn(void *data, int serv, dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status);
+
+struct mmsg_query {
+    mmsg_query *hnext; // qid hash chain
+    mmsg_query *tprev; // deadline list, ascending
+    mmsg_query *tnext;
+    mmsg_query *snext; // send queue
+    bool queued;
+    unsigned qid;
+    int sends; // datagrams sent so far
+    int first; // server of first send
+    int serv; // server of last send
+    long long sent_us; // monotonic time of last send
+    time_t deadline;
+    mmsg_done_fn *done;
+    void *data;
+    unsigned plen;
+    dnsc_t pkt[MMSG_QSIZ];
+};
+
+typedef struct {
+    double srtt; // smoothed RTT in microseconds, 0 until first sample
+    double fail; // smoothed rate of timeouts and SERVFAIL/REFUSED replies, 0..1
+    unsigned long sent; // datagrams
+    unsigned long replies;
+    unsigned long timeouts;
+    unsigned long probes;
+    time_t probed; // last probe, or when server became degraded
+} mmsg_serv_stats;
+
+typedef struct {
+    int fd; // -1 when transport is not open
+    struct sockaddr_storage servs[MMSG_MAXSERV];
+    socklen_t servlens[MMSG_MAXSERV];
+    mmsg_serv_stats stats[MMSG_MAXSERV]; // reset by open
+    int nservs;
+    bool servs_set; // mmsg_add_serv() was called, /etc/resolv.conf is not read
+    int port;
+    int timeout; // seconds
+    int ntries;
+    int status; // DNS_E_* of failed mmsg_submit()
+    int active;
+    bool in_ioevent;
+    unsigned qid_state;
+    mmsg_query **buckets;
+    mmsg_query *thead;
+    mmsg_query *ttail;
+    mmsg_query *shead;
+    mmsg_query *stail;
+    void *io; // syscall arrays and receive buffers, allocated by open
+} dns_mmsg;
+
+void mmsg_init(dns_mmsg *t);
+// Frees active queries without calling their callbacks.
+void mmsg_free(dns_mmsg *t);
+// Records nameserver IP address, NULL clears the list. Returns number of
+// servers or -1 if `addr` is not an IP address or there are too many.
+int mmsg_add_serv(dns_mmsg *t, const char *addr);
+// Opens socket, reads /etc/resolv.conf if no servers were added.
+// Returns fd or -1 with errno set.
+int mmsg_open(dns_mmsg *t, int port, int timeout, int ntries);
+// Server new queries currently start at, probes aside.
+int mmsg_best_serv(const dns_mmsg *t);
+// Closes socket, only allowed without active queries.
+void mmsg_close(dns_mmsg *t);
+// Queues query for next mmsg_flush(). Returns NULL and sets `status` on failure.
+/*@null@*/ mmsg_query *mmsg_submit(dns_mmsg *t, dnscc_t *dn, int qcls, int qtyp, int flags,
+                                   mmsg_done_fn *done, void *data);
+void mmsg_cancel(dns_mmsg *t, mmsg_query *q);
+// Sends queued queries. Datagrams the socket does not take are treated as lost.
+void mmsg_flush(dns_mmsg *t, time_t now);
+// Processes all replies waiting in socket, then flushes.
+void mmsg_ioevent(dns_mmsg *t, time_t now);
+// Retries or fails expired queries, flushes. Same contract as dns_timeouts().
+int mmsg_timeouts(dns_mmsg *t, int maxwait, time_t now);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // udns_mmsg_h
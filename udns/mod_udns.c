@@ -1,37 +1,60 @@
 #include <Python.h>
 #include <ev.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include "structmember.h"
 #include <udns.h>
 
 #include "mod_udns.h"
 
-static PyObject *module;
-
 // fwd decl
 static PyTypeObject QueryType;
 static PyTypeObject RRWrapType;
+static Query *Query_create(PyObject *resolver, PyObject *callback, PyObject *data, int flags);
+static void Query_do_cancel(Query *self);
+static PyObject *RRWrap_create(PyObject *resolver, RawRR *rr);
+static void resolver_drain_deferred(Resolver *self);
+static int resolver_pending(Resolver *self);
+static int lookup_submit(Resolver *self, Lookup *lookup, const char *name, int qclass, int qtype);
+static void resolver_release_queue(Resolver *self);
+static void queue_remove(Resolver *self, Lookup *lookup);
+static void query_addr_answered(Resolver *self, Query *query);
+static void resolver_addr_expire(Resolver *self);
+static int64_t resolver_addr_wait(Resolver *self);
+static void on_dns_utm(struct dns_ctx *ctx, int timeout, void *data);
+static void inflight_cancel_all(Resolver *self);
+static void inflight_fail_closed(Resolver *self);
+static void on_dns_dbg(int code, const struct sockaddr *sa, unsigned salen,
+                       dnscc_t *pkt, int plen, const struct dns_query *q, void *data);
+
+#if PYUDNS_USDT
+PYUDNS_PROBE_SEMAPHORE(submit);
+PYUDNS_PROBE_SEMAPHORE(queue);
+PYUDNS_PROBE_SEMAPHORE(reply);
+PYUDNS_PROBE_SEMAPHORE(retry);
+PYUDNS_PROBE_SEMAPHORE(mmsg_retry);
+PYUDNS_PROBE_SEMAPHORE(callback__entry);
+PYUDNS_PROBE_SEMAPHORE(callback__return);
+PYUDNS_PROBE_SEMAPHORE(cancel);
+#endif
 
 
 // *************************************
-// Python backwards compat begins
+// Python version check begins
 // *************************************
 
-#ifndef PyVarObject_HEAD_INIT
-#define PyVarObject_HEAD_INIT(p, s) PyObject_HEAD_INIT(p) s,
-#endif
-
-#ifndef Py_TYPE
-#define Py_TYPE(obj) obj->ob_type
-#endif
-
-#ifndef PyModule_AddIntMacro
-#define PyModule_AddIntMacro(m, macro) PyModule_AddIntConstant(m, #macro, macro)
+// PyObject_Vectorcall, PyModule_AddType
+#if PY_VERSION_HEX < 0x03090000
+#error "pyudns requires Python 3.9 or newer."
 #endif
 
 // *************************************
-// Python backwards compat ends
+// Python version check ends
 // *************************************
 
 
@@ -52,6 +75,165 @@ static PyTypeObject RRWrapType;
 #define DPRINT2(s, arg0, arg1)
 #endif
 
+// Parses METH_FASTCALL positional arguments like PyArg_ParseTuple does, for
+// format units "s" (const char*), "i" (int), "l" (long), "O" (borrowed
+// PyObject*) and "|" before optional ones. Sets TypeError `usage` on mismatch.
+static int
+fastcall_parse (PyObject *const *args, Py_ssize_t nargs, const char *format, const char *usage, ...) {
+    va_list va;
+    Py_ssize_t i = 0, len;
+    const char *f, *str;
+    bool optional = false;
+    long v;
+
+    va_start(va, usage);
+    for (f = format; '\0' != *f; f++) {
+        if ('|' == *f) {
+            optional = true;
+            continue;
+        }
+        if (i >= nargs) {
+            if (!optional) {
+                goto fail;
+            }
+            break;
+        }
+        switch (*f) {
+        case 's':
+            str = PyUnicode_Check(args[i]) ? PyUnicode_AsUTF8AndSize(args[i], &len) : NULL;
+            if (NULL == str || strlen(str) != (size_t)len) {
+                goto fail;
+            }
+            *va_arg(va, const char**) = str;
+            break;
+        case 'i':
+        case 'l':
+            v = PyLong_AsLong(args[i]);
+            if ((-1 == v && PyErr_Occurred()) || ('i' == *f && (v < INT_MIN || v > INT_MAX))) {
+                goto fail;
+            }
+            if ('i' == *f) {
+                *va_arg(va, int*) = (int)v;
+            } else {
+                *va_arg(va, long*) = v;
+            }
+            break;
+        case 'O':
+            *va_arg(va, PyObject**) = args[i];
+            break;
+        default:
+            goto fail;
+        }
+        i++;
+    }
+    va_end(va);
+    if (i < nargs) {
+        PyErr_SetString(PyExc_TypeError, usage);
+        return -1;
+    }
+    return 0;
+
+fail:
+    va_end(va);
+    PyErr_SetString(PyExc_TypeError, usage);
+    return -1;
+}
+
+// Queues completion of callback-less query for drain().
+// Steals `query` and `value` references, unless it returns DNS_E_NOMEM.
+static int
+completion_push (CompletionRing *ring, Query *query, PyObject *value) {
+    Completion *items;
+    size_t i, cap;
+
+    if (ring->count == ring->cap) {
+        cap = ring->cap > 0 ? ring->cap * 2 : 64;
+        items = PyMem_New(Completion, cap);
+        if (NULL == items) {
+            return DNS_E_NOMEM;
+        }
+        for (i = 0; i < ring->count; i++) {
+            items[i] = ring->items[(ring->head + i) % ring->cap];
+        }
+        PyMem_Free(ring->items);
+        ring->items = items;
+        ring->cap = cap;
+        ring->head = 0;
+    }
+    i = (ring->head + ring->count) % ring->cap;
+    ring->items[i].query = (PyObject*)query;
+    ring->items[i].value = value;
+    ring->count++;
+    return 0;
+}
+
+// Completion which did not fit into ring, query.status tells caller
+// polling is_completed what happened. Steals `query` and `value` references.
+static void
+completion_lost (Query *query, PyObject *value) {
+    query->status = DNS_E_NOMEM;
+    Py_DECREF(value);
+    Py_DECREF(query);
+}
+
+// Moves up to `max` (all if < 0) queued completions to `list` as
+// (query, result) tuples. Returns number moved or -1 on error.
+static Py_ssize_t
+completion_drain (CompletionRing *ring, Py_ssize_t max, PyObject *list) {
+    Completion *c;
+    PyObject *item;
+    Py_ssize_t i, n = (Py_ssize_t)ring->count;
+
+    if (max >= 0 && max < n) {
+        n = max;
+    }
+    for (i = 0; i < n; i++) {
+        c = &ring->items[ring->head];
+        item = PyTuple_New(2);
+        if (NULL == item || PyList_Append(list, item) < 0) {
+            Py_XDECREF(item);
+            return -1;
+        }
+        // tuple takes over references held by ring
+        PyTuple_SET_ITEM(item, 0, c->query);
+        PyTuple_SET_ITEM(item, 1, c->value);
+        Py_DECREF(item);
+        ring->head = (ring->head + 1) % ring->cap;
+        ring->count--;
+    }
+    return n;
+}
+
+// Ring is emptied before references are dropped, query finalizers may
+// touch its owner.
+static void
+completion_clear (CompletionRing *ring) {
+    CompletionRing old = *ring;
+
+    memset(ring, 0, sizeof(*ring));
+    while (old.count > 0) {
+        Py_DECREF(old.items[old.head].query);
+        Py_DECREF(old.items[old.head].value);
+        old.head = (old.head + 1) % old.cap;
+        old.count--;
+    }
+    PyMem_Free(old.items);
+}
+
+// Queued queries point back at ring owner, it must be visited by GC.
+static int
+completion_traverse (CompletionRing *ring, visitproc visit, void *arg) {
+    Completion *c;
+    size_t i;
+
+    for (i = 0; i < ring->count; i++) {
+        c = &ring->items[(ring->head + i) % ring->cap];
+        Py_VISIT(c->query);
+        Py_VISIT(c->value);
+    }
+    return 0;
+}
+
 // *************************************
 // common ends
 // *************************************
@@ -84,13 +266,15 @@ Resolver_init(Resolver *self, PyObject *args) {
         return -1;
     }
 
-    //FIXME
-    if (0 == do_open) {
-        PyErr_SetString(PyExc_NotImplementedError, "Resolver() do_open=False not yet implemented. Pass True for now. Sorry.");
-        return -1;
-    }
-
     self->ctx = NULL;
+    self->fd = -1;
+    cache_init(&self->cache);
+    self->negative_ttl = PYUDNS_NEGATIVE_TTL;
+    self->addr_delay = PYUDNS_RESOLUTION_DELAY;
+    stats_init(&self->stats);
+    mmsg_init(&self->mmsg);
+    tcp_init(&self->tcp, 0);
+    hosts_init(&self->hosts);
 
     if (1 == create_new) {
         self->ctx = dns_new(NULL);
@@ -105,6 +289,9 @@ Resolver_init(Resolver *self, PyObject *args) {
         PyErr_SetString(PyExc_Exception, "Resolver() failed to init udns context.");
         return -1;
     }
+    self->tcp.timeout = dns_set_opt(self->ctx, DNS_OPT_TIMEOUT, -1);
+    // watches replies for truncated ones, see on_dns_dbg()
+    dns_set_dbgfn(self->ctx, on_dns_dbg);
 
     if (1 == do_open) {
         self->fd = dns_open(self->ctx);
@@ -117,13 +304,39 @@ Resolver_init(Resolver *self, PyObject *args) {
     return 0;
 }
 
+static int
+Resolver_traverse (Resolver *self, visitproc visit, void *arg) {
+    Py_VISIT(self->__dict__);
+    return completion_traverse(&self->completed, visit, arg);
+}
+
+static int
+Resolver_clear (Resolver *self) {
+    Py_CLEAR(self->__dict__);
+    completion_clear(&self->completed);
+    return 0;
+}
+
 static void
 Resolver_dealloc(Resolver *self) {
+    PyObject_GC_UnTrack(self);
+    if (NULL != self->loop) {
+        ev_loop_destroy(self->loop);
+        self->loop = NULL;
+    }
+    inflight_cancel_all(self);
     if (NULL != self->ctx) {
         dns_free(self->ctx);
         self->ctx = NULL;
     }
-    self->ob_type->tp_free((PyObject*)self);
+    cache_free(&self->cache);
+    mmsg_free(&self->mmsg);
+    tcp_free(&self->tcp);
+    hosts_free(&self->hosts);
+    Resolver_clear(self);
+    PyMem_Free(self->inflight);
+    PyMem_Free(self->queue); // queued lookups were freed with in-flight ones
+    Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
 // Resolver.cancel(query) -> None
@@ -133,28 +346,246 @@ TODO\n\
 
 /*@null@*/
 static PyObject*
-Resolver_cancel(Resolver *self, PyObject *args) {
+Resolver_cancel(Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
     Query *query = NULL;
 
-    if (!PyArg_ParseTuple(args, "O", &query) || NULL == query) {
+    if (fastcall_parse(args, nargs, "O", "Resolver.cancel(query) wrong arguments. Pass Query returned by submit_* methods.", &query) < 0 ||
+        !PyObject_TypeCheck(query, &QueryType)) {
         PyErr_SetString(PyExc_TypeError, "Resolver.cancel(query) wrong arguments. Pass Query returned by submit_* methods.");
         return NULL;
     }
 
-    if (NULL != query->q) {
-        dns_cancel(self->ctx, query->q);
-        // q is invalid pointer afterwards, so we forget it
-        query->q = NULL;
+    Query_do_cancel(query);
+
+    Py_RETURN_NONE;
+}
+
+// Resolver.add_serv(addr) -> int
+PyDoc_STRVAR(Resolver_add_serv_doc, "\
+add_serv(addr) -> int\n\
+\n\
+Adds nameserver IP address `addr`, None clears the list read from\n\
+/etc/resolv.conf. Returns number of nameservers.\n\
+Only allowed before socket is open, see Resolver(do_open=False).\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_add_serv (Resolver *self, PyObject *args) {
+    const char *addr = NULL;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "z", &addr)) {
+        PyErr_SetString(PyExc_TypeError, "Resolver.add_serv(addr) takes 1 argument: IP address str or None.");
+        return NULL;
+    }
+    if (dns_sock(self->ctx) >= 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Resolver.add_serv() called after socket is open.");
+        return NULL;
+    }
+
+    r = dns_add_serv(self->ctx, addr);
+    if (r < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    // kept for TRANSPORT_MMSG, udns has no way to read its list back
+    mmsg_add_serv(&self->mmsg, addr);
+
+    return Py_BuildValue("i", r);
+}
+
+// Resolver.set_opts(opts) -> None
+PyDoc_STRVAR(Resolver_set_opts_doc, "\
+set_opts(opts)\n\
+\n\
+Sets udns options from resolv.conf style str, e.g. \"timeout:2 attempts:1 port:5353\".\n\
+Only allowed before socket is open, see Resolver(do_open=False).\n\
+Raises ValueError if some option is not recognized.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_set_opts (Resolver *self, PyObject *args) {
+    const char *opts;
+
+    if (!PyArg_ParseTuple(args, "s", &opts)) {
+        PyErr_SetString(PyExc_TypeError, "Resolver.set_opts(opts) takes 1 str argument.");
+        return NULL;
+    }
+    if (dns_sock(self->ctx) >= 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Resolver.set_opts() called after socket is open.");
+        return NULL;
+    }
+
+    if (0 != dns_set_opts(self->ctx, opts)) {
+        PyErr_SetString(PyExc_ValueError, "Resolver.set_opts() got unknown option.");
+        return NULL;
     }
+    self->tcp.timeout = dns_set_opt(self->ctx, DNS_OPT_TIMEOUT, -1);
 
     Py_RETURN_NONE;
 }
 
+// Socket of current transport.
+static int
+resolver_sock (Resolver *self) {
+    return self->mmsg.fd >= 0 ? self->mmsg.fd : dns_sock(self->ctx);
+}
+
+// Resolver whose dns_ioevent() is running, on_dns_dbg() gets no context.
+static Resolver *dbg_resolver = NULL;
+
+static void
+resolver_dns_ioevent (Resolver *self, time_t now) {
+    Resolver *outer = dbg_resolver;
+
+    dbg_resolver = self;
+    dns_ioevent(self->ctx, now);
+    dbg_resolver = outer;
+}
+
+// Delivers deferred completions and processes replies waiting in sockets.
+static void
+resolver_ioevent (Resolver *self, time_t now) {
+    resolver_drain_deferred(self);
+    if (self->mmsg.fd >= 0) {
+        mmsg_ioevent(&self->mmsg, now);
+    } else {
+        resolver_dns_ioevent(self, now);
+    }
+    // also sends TCP retries of answers truncated above
+    tcp_ioevent(&self->tcp, now);
+    resolver_addr_expire(self);
+}
+
+static int
+resolver_timeouts (Resolver *self, int maxwait, time_t now) {
+    int wait, tcp_wait, addr_wait;
+    int64_t addr_us;
+
+    if (self->mmsg.fd >= 0) {
+        wait = mmsg_timeouts(&self->mmsg, maxwait, now);
+    } else {
+        wait = dns_timeouts(self->ctx, maxwait, now);
+    }
+    tcp_wait = tcp_timeouts(&self->tcp, maxwait, now);
+    if (wait < 0 || (tcp_wait >= 0 && tcp_wait < wait)) {
+        wait = tcp_wait;
+    }
+    self->timeouts_deadline = wait < 0 ? 0 : stats_now() + (uint64_t)wait * 1000000u;
+    resolver_addr_expire(self);
+    addr_us = resolver_addr_wait(self);
+    if (addr_us >= 0) {
+        // rounded up, whole seconds like udns deadlines
+        addr_wait = (int)((addr_us + 999999) / 1000000);
+        if (maxwait >= 0 && addr_wait > maxwait) {
+            addr_wait = maxwait;
+        }
+        if (wait < 0 || addr_wait < wait) {
+            wait = addr_wait;
+        }
+    }
+    return wait;
+}
+
+// Resolver.set_transport(transport) -> sock
+PyDoc_STRVAR(Resolver_set_transport_doc, "\
+set_transport(transport) -> sock\n\
+\n\
+Switches socket I/O of submit_* lookups, only allowed while resolver is idle.\n\
+TRANSPORT_UDNS (default) lets udns send and receive one datagram per syscall.\n\
+TRANSPORT_MMSG opens own socket: queries submitted between ioevent()/\n\
+timeouts() calls are sent with one sendmmsg(), replies are read in batches\n\
+with recvmmsg(). It uses servers from add_serv() or /etc/resolv.conf and\n\
+port, timeout and attempts options, names are not looked up in search list.\n\
+resolve_many() always uses udns. Returns fd to watch, same as `sock`.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_set_transport (Resolver *self, PyObject *args) {
+    int transport;
+
+    if (!PyArg_ParseTuple(args, "i", &transport)) {
+        PyErr_SetString(PyExc_TypeError, "Resolver.set_transport(transport) takes 1 int argument: TRANSPORT_UDNS or TRANSPORT_MMSG.");
+        return NULL;
+    }
+    if (PYUDNS_TRANSPORT_UDNS != transport && PYUDNS_TRANSPORT_MMSG != transport) {
+        PyErr_SetString(PyExc_ValueError, "Resolver.set_transport() transport must be TRANSPORT_UDNS or TRANSPORT_MMSG.");
+        return NULL;
+    }
+    if (0 != resolver_pending(self) || self->mmsg.in_ioevent) {
+        PyErr_SetString(PyExc_RuntimeError, "Resolver.set_transport() called with queries in flight.");
+        return NULL;
+    }
+
+    mmsg_close(&self->mmsg);
+    if (PYUDNS_TRANSPORT_MMSG == transport &&
+        mmsg_open(&self->mmsg, dns_set_opt(self->ctx, DNS_OPT_PORT, -1),
+                  dns_set_opt(self->ctx, DNS_OPT_TIMEOUT, -1),
+                  dns_set_opt(self->ctx, DNS_OPT_NTRIES, -1)) < 0) {
+        mmsg_close(&self->mmsg);
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+
+    return Py_BuildValue("i", resolver_sock(self));
+}
+
+// Resolver.open() -> sock
+PyDoc_STRVAR(Resolver_open_doc, "\
+open() -> sock\n\
+\n\
+Opens UDP socket of resolver created with do_open=False, returns its fd.\n\
+Raises IOError on failure.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_open (Resolver *self, PyObject *args) {
+    self->fd = dns_open(self->ctx);
+    if (self->fd < 0) {
+        PyErr_SetString(PyExc_IOError, "Resolver.open() failed to open udns socket.");
+        return NULL;
+    }
+
+    return Py_BuildValue("i", self->fd);
+}
+
 // Resolver.close() -> None
 PyDoc_STRVAR(Resolver_close_doc, "\
-TODO\n\
+close()\n\
+\n\
+Closes udns socket, TRANSPORT_MMSG one and TCP connections with tcp_sock.\n\
+Lookups sent through TRANSPORT_MMSG or TCP fail with E_TEMPFAIL on next\n\
+ioevent()/run() tick. Completions not drained yet are dropped.\n\
 ");
 
+// Closes sockets of resolver, also of ResolverPool members.
+// Returns 0 or -1 with exception set.
+static int
+resolver_close (Resolver *self) {
+    if (self->mmsg.in_ioevent || self->tcp.in_ioevent) {
+        PyErr_SetString(PyExc_RuntimeError, "Resolver.close() called from callback of TRANSPORT_MMSG or TCP lookup.");
+        return -1;
+    }
+
+    if (NULL != self->loop && ev_is_active(&self->io_watcher)) {
+        // run() is watching sockets closed below
+        ev_io_stop(self->loop, &self->io_watcher);
+        ev_io_stop(self->loop, &self->tcp_watcher);
+        ev_timer_stop(self->loop, &self->tcp_timer);
+        ev_break(self->loop, EVBREAK_ALL);
+    }
+    inflight_fail_closed(self);
+    mmsg_close(&self->mmsg);
+    tcp_free(&self->tcp);
+    completion_clear(&self->completed);
+    dns_close(self->ctx);
+    return 0;
+}
+
 /*@null@*/
 static PyObject*
 Resolver_close(Resolver *self, PyObject *args) {
@@ -162,8 +593,9 @@ Resolver_close(Resolver *self, PyObject *args) {
         PyErr_SetString(PyExc_TypeError, "Resolver.close() takes no arguments.");
         return NULL;
     }
-
-    dns_close(self->ctx);
+    if (resolver_close(self) < 0) {
+        return NULL;
+    }
 
     Py_RETURN_NONE;
 }
@@ -173,19 +605,22 @@ PyDoc_STRVAR(Resolver_ioevent_doc, "\
 ioevent(now=0)\n\
 \n\
 `now` is current timestamp. If it is 0 udns will find current time on it's own.\n\
+Also delivers completions queued since previous call, e.g. cache hits.\n\
+With TRANSPORT_MMSG also sends queries submitted since previous call.\n\
+Reads TCP connections too, see tcp_sock.\n\
 ");
 
 /*@null@*/
 static PyObject*
-Resolver_ioevent (Resolver *self, PyObject *args) {
-    time_t now = 0;
+Resolver_ioevent (Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    long now = 0;
 
-    if (!PyArg_ParseTuple(args, "|l", &now)) {
+    if (fastcall_parse(args, nargs, "|l", "Resolver.ioevent(now=0) wrong arguments.", &now) < 0) {
         PyErr_SetString(PyExc_TypeError, "Resolver.ioevent(now=0) wrong arguments.");
         return NULL;
     }
 
-    dns_ioevent(self->ctx, now);
+    resolver_ioevent(self, now);
 
     Py_RETURN_NONE;
 }
@@ -197,145 +632,4027 @@ TODO\n\
 
 /*@null@*/
 static PyObject*
-Resolver_timeouts (Resolver *self, PyObject *args) {
-    time_t now = 0;
+Resolver_timeouts (Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    long now = 0;
     int wait = 0, maxwait = 0;
 
-    if (!PyArg_ParseTuple(args, "i|l", &maxwait, &now)) {
-        PyErr_SetString(PyExc_TypeError, "Resolver.timeouts(maxwait, now=0) takes 2 int arguments: maxwait and current timestamp.");
+    if (fastcall_parse(args, nargs, "i|l", "Resolver.timeouts(maxwait, now=0) takes 2 int arguments: maxwait and current timestamp.",
+                       &maxwait, &now) < 0) {
         return NULL;
     }
 
-    wait = dns_timeouts(self->ctx, maxwait, now);
+    wait = resolver_timeouts(self, maxwait, now);
 
-    return Py_BuildValue("i", wait);
+    return PyLong_FromLong(wait);
 }
 
-static void
-on_dns_resolve_a4 (struct dns_ctx *ctx, struct dns_rr_a4 *result, void *data) {
+// Builds tuple of address strings from `nrr` addresses of family `af`.
+/*@null@*/
+static PyObject*
+addrs_to_tuple (int af, const void *addrs, int nrr) {
     int i;
-    PyObject *list, *item, *r;
-    Query *query = data;
-    char buf[17];
+    PyObject *list, *item;
+    char buf[INET6_ADDRSTRLEN + 1];
     const char *ntop_r;
+    size_t size = AF_INET6 == af ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+
+    list = PyTuple_New(nrr);
+    if (NULL == list) {
+        return NULL;
+    }
+    for (i = 0; i < nrr; i++) {
+        memset(buf, 0, sizeof(buf));
+        ntop_r = dns_ntop(af, (const char*)addrs + i * size, buf, INET6_ADDRSTRLEN);
+        if (NULL == ntop_r) {
+            // TODO: handle error
+        }
+        item = Py_BuildValue("s", buf);
+        PyTuple_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+// Builds Python value for A or AAAA addresses according to PYUDNS_* flags:
+// packed bytes of raw addresses in network order, or tuple of strings.
+/*@null@*/
+static PyObject*
+addrs_build (int qtype, const void *addrs, int nrr, int flags) {
+    int af = DNS_T_AAAA == qtype ? AF_INET6 : AF_INET;
+
+    if (flags & PYUDNS_RESULT_PACKED) {
+        return PyBytes_FromStringAndSize((const char*)addrs,
+            nrr * (AF_INET6 == af ? sizeof(struct in6_addr) : sizeof(struct in_addr)));
+    }
+    return addrs_to_tuple(af, addrs, nrr);
+}
+
+// Merges submit_addr() results into one tuple, addresses of both families
+// interleaved starting with the first slot, IPv6 (RFC 8305 section 4).
+// Returns None and sets `status` when neither family has addresses.
+static PyObject*
+addrs_merge (Query *query, int *status) {
+    PyObject *lists[2] = {NULL, NULL}, *item, *value;
+    Py_ssize_t i, j, k = 0, n[2] = {0, 0};
+    int err = 0;
+
+    for (i = 0; i < query->nslots && i < 2; i++) {
+        item = PyTuple_GET_ITEM(query->results, i);
+        if (PyTuple_Check(item)) {
+            lists[i] = item;
+            n[i] = PyTuple_GET_SIZE(item);
+        } else if (PyLong_Check(item) && (0 == err || DNS_E_NODATA == err)) {
+            // NXDOMAIN or failure of one family tells more than NODATA of other
+            err = (int)PyLong_AsLong(item);
+        }
+    }
+    *status = 0;
+    if (0 == n[0] + n[1]) {
+        *status = 0 != err ? err : DNS_E_NODATA;
+        Py_RETURN_NONE;
+    }
+    value = PyTuple_New(n[0] + n[1]);
+    if (NULL == value) {
+        PyErr_Clear();
+        *status = DNS_E_NOMEM;
+        Py_RETURN_NONE;
+    }
+    for (j = 0; j < n[0] || j < n[1]; j++) {
+        for (i = 0; i < 2; i++) {
+            if (j < n[i]) {
+                item = PyTuple_GET_ITEM(lists[i], j);
+                Py_INCREF(item);
+                PyTuple_SET_ITEM(value, k++, item);
+            }
+        }
+    }
+    return value;
+}
+
+// Takes submit_addr() query off Resolver.addr_head list.
+static void
+addr_unlink (Query *query) {
+    Resolver *self = query->slots[0].resolver;
+
+    if (NULL != query->addr_prev) {
+        query->addr_prev->addr_next = query->addr_next;
+    } else {
+        self->addr_head = query->addr_next;
+    }
+    if (NULL != query->addr_next) {
+        query->addr_next->addr_prev = query->addr_prev;
+    } else {
+        self->addr_tail = query->addr_prev;
+    }
+    query->addr_prev = query->addr_next = NULL;
+    query->addr_deadline = 0;
+}
+
+// Fires batch callback once, or queues it when query has no callback.
+// submit_addr() query gets merged addresses instead of results tuple.
+// Steals the pending reference to query.
+static void
+query_batch_complete (Resolver *resolver, Query *query) {
+    PyObject *value = query->results, *args[2], *r;
 
     query->is_completed = true;
-    if (NULL == result) {
-        r = PyObject_CallFunction(query->callback, "OO", Py_None, query->data);
-        if (NULL == r) {
+    if (query->addrs) {
+        if (0 != query->addr_deadline) {
+            addr_unlink(query);
         }
+        value = addrs_merge(query, &query->status);
     } else {
-        list = PyTuple_New(result->dnsa4_nrr);
-        for (i = 0; i < result->dnsa4_nrr; i++) {
-            memset(buf, 0, sizeof(buf));
-            ntop_r = dns_ntop(AF_INET, &(result->dnsa4_addr[i]), buf, 16);
-            if (NULL == ntop_r) {
-                // TODO: handle error
-            }
-            item = Py_BuildValue("s", buf);
-            PyTuple_SET_ITEM(list, i, item);
+        Py_INCREF(value);
+    }
+    if (Py_None == query->callback) {
+        if (0 != completion_push(&resolver->completed, query, value)) {
+            completion_lost(query, value);
         }
-        free(result); // man 3 udns: it's the application who is responsible for freeing result memory
-        r = PyObject_CallFunction(query->callback, "NO", list, query->data);
+        return;
     }
+    args[0] = value;
+    args[1] = query->data;
+    r = PyObject_Vectorcall(query->callback, args, 2, NULL);
+    Py_DECREF(value);
     Py_XDECREF(r);
-    query->q = NULL;
     Py_DECREF(query);
 }
 
-// Resolver.submit_a4() -> None
-PyDoc_STRVAR(Resolver_submit_a4_doc, "\
-TODO\n\
-");
+// Marks slot as submitted to `self`, for stats.
+static void
+slot_start (Resolver *self, QuerySlot *slot) {
+    slot->resolver = self;
+    slot->submitted = stats_now();
+    stats_submit(&self->stats);
+}
 
-/*@null@*/
-static PyObject*
-Resolver_submit_a4 (Resolver *self, PyObject *args) {
-    const char *domain;
-    PyObject *cb, *cb_data = Py_None;
-    Query *query;
-    int flags = 0;
+// Delivers result of one name. `value` is stolen, NULL means error `status`.
+// Single query gets callback(value or None, data) right away,
+// batch query collects value or status until all names are done.
+static void
+slot_complete (QuerySlot *slot, PyObject *value, int status) {
+    Query *query = (Query*)slot->query;
+    PyObject *args[2], *r;
+
+    slot->lookup = NULL;
+    slot->deferred = NULL;
+    stats_complete(&slot->resolver->stats, status, stats_now() - slot->submitted);
+    if (slot->index < 0) {
+        if (NULL == value) {
+            Py_INCREF(Py_None);
+            value = Py_None;
+        }
+        query->is_completed = true;
+        query->status = status;
+        query->npending = 0;
+        if (Py_None == query->callback) {
+            if (0 != completion_push(&slot->resolver->completed, query, value)) {
+                completion_lost(query, value);
+            }
+            return;
+        }
+        args[0] = value;
+        args[1] = query->data;
+        r = PyObject_Vectorcall(query->callback, args, 2, NULL);
+        Py_DECREF(value);
+        Py_XDECREF(r);
+        Py_DECREF(query);
+        return;
+    }
+
+    if (NULL == value) {
+        value = PyLong_FromLong(status);
+    }
+    if (NULL != value) {
+        Py_DECREF(PyTuple_GET_ITEM(query->results, slot->index));
+        PyTuple_SET_ITEM(query->results, slot->index, value);
+    }
+    if (0 == --query->npending) {
+        query_batch_complete(slot->resolver, query);
+    } else if (query->addrs && 0 == status) {
+        query_addr_answered(slot->resolver, query);
+    }
+}
+
+// Queues completion of slot for next ioevent()/run() tick. Steals `value`.
+// Returns 0 or DNS_E_NOMEM.
+static int
+resolver_defer (Resolver *self, QuerySlot *slot, PyObject *value, int status) {
+    Deferred *d;
+
+    d = PyMem_New(Deferred, 1);
+    if (NULL == d) {
+        Py_XDECREF(value);
+        return DNS_E_NOMEM;
+    }
+    d->next = NULL;
+    d->resolver = (PyObject*)self;
+    d->slot = slot;
+    d->value = value;
+    d->status = status;
+    if (NULL == self->deferred_tail) {
+        self->deferred_head = d;
+    } else {
+        self->deferred_tail->next = d;
+    }
+    self->deferred_tail = d;
+    self->ndeferred++;
+    slot->deferred = d;
+    return 0;
+}
+
+// Delivers completions queued so far. Ones queued by callbacks wait for next tick.
+static void
+resolver_drain_deferred (Resolver *self) {
+    Deferred *d, *next;
+
+    d = self->deferred_head;
+    self->deferred_head = self->deferred_tail = NULL;
+    for (; NULL != d; d = next) {
+        next = d->next;
+        if (NULL != d->slot) {
+            self->ndeferred--;
+            slot_complete(d->slot, d->value, d->status);
+        }
+        PyMem_Free(d);
+    }
+}
+
+// Number of completions still to come from udns or deferred queue.
+static int
+resolver_pending (Resolver *self) {
+    return dns_active(self->ctx) + self->mmsg.active + self->tcp.active +
+           (int)self->queue_len + (int)self->ndeferred;
+}
+
+static void
+resolver_loop_release (struct ev_loop *loop) {
+    Resolver *self = ev_userdata(loop);
+
+    self->thread_state = PyEval_SaveThread();
+}
+
+static void
+resolver_loop_acquire (struct ev_loop *loop) {
+    Resolver *self = ev_userdata(loop);
+
+    PyEval_RestoreThread(self->thread_state);
+    self->thread_state = NULL;
+}
+
+// Stops loop when nothing is left to wait for or a callback raised.
+static void
+resolver_loop_check (Resolver *self) {
+    if (PyErr_Occurred() || 0 == resolver_pending(self)) {
+        ev_break(self->loop, EVBREAK_ONE);
+    }
+}
+
+static void
+on_resolver_io (struct ev_loop *loop, ev_io *w, int revents) {
+    Resolver *self = w->data;
+
+    if (self->mmsg.fd >= 0) {
+        mmsg_ioevent(&self->mmsg, 0);
+    } else {
+        resolver_dns_ioevent(self, 0);
+    }
+    tcp_flush(&self->tcp);
+    resolver_loop_check(self);
+}
+
+static void
+on_resolver_tcp_io (struct ev_loop *loop, ev_io *w, int revents) {
+    Resolver *self = w->data;
+
+    tcp_ioevent(&self->tcp, 0);
+    resolver_loop_check(self);
+}
+
+static void
+on_resolver_tcp_timer (struct ev_loop *loop, ev_timer *w, int revents) {
+    Resolver *self = w->data;
+
+    // re-armed by on_resolver_deferred
+    tcp_timeouts(&self->tcp, -1, 0);
+    resolver_loop_check(self);
+}
+
+static void
+on_resolver_retry (struct ev_loop *loop, ev_timer *w, int revents) {
+    Resolver *self = w->data;
+
+    // udns re-arms retry_watcher through on_dns_utm, mmsg before next poll
+    if (self->mmsg.fd >= 0) {
+        mmsg_timeouts(&self->mmsg, -1, 0);
+    } else {
+        dns_timeouts(self->ctx, -1, 0);
+    }
+    tcp_flush(&self->tcp);
+    resolver_loop_check(self);
+}
+
+static void
+on_resolver_addr_timer (struct ev_loop *loop, ev_timer *w, int revents) {
+    Resolver *self = w->data;
+
+    // re-armed by on_resolver_deferred
+    resolver_addr_expire(self);
+    resolver_loop_check(self);
+}
+
+static void
+on_resolver_deadline (struct ev_loop *loop, ev_timer *w, int revents) {
+    Resolver *self = w->data;
+
+    self->run_expired = true;
+    ev_break(loop, EVBREAK_ONE);
+}
+
+static void
+on_resolver_deferred (struct ev_loop *loop, ev_prepare *w, int revents) {
+    Resolver *self = w->data;
+
+    resolver_drain_deferred(self);
+    if (self->ndeferred > 0) {
+        ev_idle_start(loop, &self->deferred_idle);
+    } else {
+        ev_idle_stop(loop, &self->deferred_idle);
+    }
+    if (self->mmsg.fd >= 0) {
+        // sends what callbacks submitted in this iteration; deadlines of new
+        // queries are not earlier than armed one, so timer is only set when idle
+        mmsg_flush(&self->mmsg, 0);
+        if (!ev_is_active(&self->retry_watcher)) {
+            on_dns_utm(self->ctx, mmsg_timeouts(&self->mmsg, -1, 0), self);
+        }
+    }
+    // same for TCP, its deadlines do not come earlier either
+    tcp_flush(&self->tcp);
+    if (self->tcp.active > 0 && !ev_is_active(&self->tcp_timer)) {
+        ev_timer_set(&self->tcp_timer, (ev_tstamp)tcp_timeouts(&self->tcp, -1, 0), 0.);
+        ev_timer_start(loop, &self->tcp_timer);
+    }
+    // resolution delays end off the second grid, so not left to retry_watcher
+    resolver_addr_expire(self);
+    ev_timer_stop(loop, &self->addr_timer);
+    if (NULL != self->addr_head) {
+        ev_timer_set(&self->addr_timer, resolver_addr_wait(self) / 1e6, 0.);
+        ev_timer_start(loop, &self->addr_timer);
+    }
+    resolver_loop_check(self);
+}
+
+static void
+on_resolver_deferred_idle (struct ev_loop *loop, ev_idle *w, int revents) {
+    // nothing, on_resolver_deferred does the work before next poll
+}
+
+static void
+on_resolver_signal_check (struct ev_loop *loop, ev_check *w, int revents) {
+    if (PyErr_CheckSignals() < 0) {
+        ev_break(loop, EVBREAK_ONE);
+    }
+}
+
+// udns timer callback: timeout < 0 means no timer needed,
+// otherwise udns wants dns_timeouts() called in `timeout` seconds.
+static void
+on_dns_utm (struct dns_ctx *ctx, int timeout, void *data) {
+    Resolver *self = data;
+
+    ev_timer_stop(self->loop, &self->retry_watcher);
+    if (timeout >= 0) {
+        ev_timer_set(&self->retry_watcher, (ev_tstamp)timeout, 0.);
+        ev_timer_start(self->loop, &self->retry_watcher);
+    }
+}
+
+/*@null@*/
+static struct ev_loop*
+resolver_loop (Resolver *self) {
+    if (NULL != self->loop) {
+        return self->loop;
+    }
+
+    self->loop = ev_loop_new(EVFLAG_AUTO);
+    if (NULL == self->loop) {
+        return NULL;
+    }
+    ev_set_userdata(self->loop, self);
+    ev_set_loop_release_cb(self->loop, resolver_loop_release, resolver_loop_acquire);
+
+    ev_init(&self->io_watcher, on_resolver_io);
+    self->io_watcher.data = self;
+    ev_init(&self->retry_watcher, on_resolver_retry);
+    self->retry_watcher.data = self;
+    ev_init(&self->deadline_watcher, on_resolver_deadline);
+    self->deadline_watcher.data = self;
+    ev_check_init(&self->signal_watcher, on_resolver_signal_check);
+    self->signal_watcher.data = self;
+    ev_prepare_init(&self->deferred_watcher, on_resolver_deferred);
+    self->deferred_watcher.data = self;
+    ev_idle_init(&self->deferred_idle, on_resolver_deferred_idle);
+    self->deferred_idle.data = self;
+    ev_init(&self->tcp_watcher, on_resolver_tcp_io);
+    self->tcp_watcher.data = self;
+    ev_init(&self->tcp_timer, on_resolver_tcp_timer);
+    self->tcp_timer.data = self;
+    ev_init(&self->addr_timer, on_resolver_addr_timer);
+    self->addr_timer.data = self;
+
+    return self->loop;
+}
+
+// Runs loop until no queries are active or `timeout` seconds passed
+// (timeout < 0 means forever). Returns 1 when idle, 0 on timeout, -1 on error.
+static int
+resolver_run (Resolver *self, double timeout) {
+    struct ev_loop *loop;
+    int sock;
+
+    if (0 == resolver_pending(self)) {
+        return 1;
+    }
+    sock = resolver_sock(self);
+    if (sock < 0) {
+        PyErr_SetString(PyExc_IOError, "Resolver socket is not open.");
+        return -1;
+    }
+    loop = resolver_loop(self);
+    if (NULL == loop) {
+        PyErr_SetString(PyExc_MemoryError, "Can't create event loop.");
+        return -1;
+    }
+
+    self->run_expired = false;
+    ev_io_set(&self->io_watcher, sock, EV_READ);
+    ev_io_start(loop, &self->io_watcher);
+    ev_check_start(loop, &self->signal_watcher);
+    ev_prepare_start(loop, &self->deferred_watcher);
+    // truncated answers may need TCP while loop runs
+    if (tcp_open(&self->tcp) >= 0) {
+        ev_io_set(&self->tcp_watcher, self->tcp.fd, EV_READ);
+        ev_io_start(loop, &self->tcp_watcher);
+    }
+    if (timeout >= 0) {
+        ev_timer_set(&self->deadline_watcher, timeout, 0.);
+        ev_timer_start(loop, &self->deadline_watcher);
+    }
+    dns_set_tmcbck(self->ctx, on_dns_utm, self);
+
+    ev_run(loop, 0);
+
+    dns_set_tmcbck(self->ctx, NULL, NULL);
+    ev_timer_stop(loop, &self->retry_watcher);
+    ev_timer_stop(loop, &self->deadline_watcher);
+    ev_check_stop(loop, &self->signal_watcher);
+    ev_prepare_stop(loop, &self->deferred_watcher);
+    ev_idle_stop(loop, &self->deferred_idle);
+    ev_io_stop(loop, &self->io_watcher);
+    ev_io_stop(loop, &self->tcp_watcher);
+    ev_timer_stop(loop, &self->tcp_timer);
+    ev_timer_stop(loop, &self->addr_timer);
+
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+    return self->run_expired ? 0 : 1;
+}
+
+// Converts `timeout` argument, None is -1 (forever). Returns -1 on error.
+static int
+timeout_from_object (PyObject *obj, double *timeout) {
+    if (Py_None == obj) {
+        *timeout = -1.0;
+        return 0;
+    }
+    *timeout = PyFloat_AsDouble(obj);
+    if (-1.0 == *timeout && PyErr_Occurred()) {
+        return -1;
+    }
+    if (*timeout < 0 || isnan(*timeout)) {
+        PyErr_SetString(PyExc_ValueError, "'timeout' must be non-negative number or None.");
+        return -1;
+    }
+    return 0;
+}
+
+// Resolver.run(timeout=None) -> bool
+PyDoc_STRVAR(Resolver_run_doc, "\
+run(timeout=None) -> bool\n\
+\n\
+Drives resolver with libev until all submitted queries are completed.\n\
+Wakes up only when a reply arrives or udns retry deadline passes,\n\
+GIL is released while waiting. Callbacks are called from inside run().\n\
+Returns True when resolver is idle, False if `timeout` seconds passed first.\n\
+Exception raised by a callback stops the loop and is propagated.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_run (Resolver *self, PyObject *args) {
+    PyObject *timeout_obj = Py_None;
+    double timeout = -1.0;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "|O", &timeout_obj)) {
+        PyErr_SetString(PyExc_TypeError, "Resolver.run(timeout=None) wrong arguments.");
+        return NULL;
+    }
+    if (timeout_from_object(timeout_obj, &timeout) < 0) {
+        return NULL;
+    }
+
+    r = resolver_run(self, timeout);
+    if (r < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong(r);
+}
+
+// Resolver.run_until_idle() -> None
+PyDoc_STRVAR(Resolver_run_until_idle_doc, "\
+run_until_idle()\n\
+\n\
+Same as run() without timeout.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_run_until_idle (Resolver *self, PyObject *args) {
+    if (resolver_run(self, -1.0) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static void
+resolve_item_done (struct dns_ctx *ctx, ResolveItem *item, void *rr) {
+    item->completed = stats_now();
+    item->rr = rr;
+    item->status = NULL == rr ? dns_status(ctx) : 0;
+    (*item->npending)--;
+}
+
+static void
+on_resolve_many_a4 (struct dns_ctx *ctx, struct dns_rr_a4 *result, void *data) {
+    resolve_item_done(ctx, data, result);
+}
+
+static void
+on_resolve_many_a6 (struct dns_ctx *ctx, struct dns_rr_a6 *result, void *data) {
+    resolve_item_done(ctx, data, result);
+}
+
+// Submits pending `items` to private `ctx` and polls its socket until all
+// are done or `timeout` seconds passed. Runs without GIL, touches no Python objects.
+static void
+resolve_many_loop (struct dns_ctx *ctx, ResolveItem *items, Py_ssize_t n,
+                   int qtype, int flags, double timeout) {
+    struct dns_query *q;
+    struct pollfd pfd;
+    Py_ssize_t i, npending = 0;
+    double now, deadline = -1.0;
+    int wait, ms, r;
+
+    for (i = 0; i < n; i++) {
+        if (PYUDNS_RESOLVE_PENDING != items[i].status) {
+            continue;
+        }
+        items[i].npending = &npending;
+        if (DNS_T_AAAA == qtype) {
+            q = dns_submit_a6(ctx, items[i].name, flags, on_resolve_many_a6, &items[i]);
+        } else {
+            q = dns_submit_a4(ctx, items[i].name, flags, on_resolve_many_a4, &items[i]);
+        }
+        if (NULL == q) {
+            r = dns_status(ctx);
+            items[i].status = r < 0 ? r : DNS_E_BADQUERY;
+            items[i].completed = stats_now();
+            continue;
+        }
+        npending++;
+    }
+
+    pfd.fd = dns_sock(ctx);
+    pfd.events = POLLIN;
+    if (timeout >= 0) {
+        deadline = ev_time() + timeout;
+    }
+    while (npending > 0) {
+        now = ev_time();
+        // sends queries and retries, may complete some of them by timeout
+        wait = dns_timeouts(ctx, -1, (time_t)now);
+        if (npending <= 0) {
+            break;
+        }
+        if (wait < 0 && deadline < 0) {
+            break; // nothing scheduled in udns, should not happen
+        }
+        ms = wait * 1000;
+        if (deadline >= 0) {
+            if (now >= deadline) {
+                break;
+            }
+            if (wait < 0 || (deadline - now) * 1000 < ms) {
+                ms = (int)ceil((deadline - now) * 1000);
+            }
+        }
+        r = poll(&pfd, 1, ms);
+        if (r < 0 && EINTR != errno) {
+            break;
+        }
+        if (r > 0) {
+            dns_ioevent(ctx, (time_t)ev_time());
+        }
+    }
+}
+
+// Resolver.resolve_many(names, qtype=T_A, timeout=None, flags=0) -> dict
+PyDoc_STRVAR(Resolver_resolve_many_doc, "\
+resolve_many(names, qtype=T_A, timeout=None, flags=0) -> dict\n\
+\n\
+Resolves all `names` and blocks until done, no callbacks or event loop.\n\
+`qtype` is T_A or T_AAAA. Returns dict mapping every name to tuple of\n\
+addresses, or to E_* error code (int) if it failed. Names not answered\n\
+within `timeout` seconds get E_TEMPFAIL. See submit_a4() for `flags`.\n\
+Queries go through own socket, GIL is released for the whole network part,\n\
+so other threads keep running. Cache is used and updated as in submit_a4().\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_resolve_many (Resolver *self, PyObject *args) {
+    PyObject *names, *seq, *timeout_obj = Py_None, *result = NULL, *value;
+    struct dns_ctx *ctx = NULL;
+    ResolveItem *items = NULL;
+    struct dns_rr_a4 *a4;
+    struct dns_rr_a6 *a6;
+    hosts_entry *h;
+    cache_entry *e;
+    char *buf = NULL;
+    const char *name;
+    Py_ssize_t i, n, len, size = 0;
+    double timeout = -1.0;
+    time_t now;
+    uint64_t submitted;
+    int qtype = DNS_T_A, flags = 0, nrr;
+    unsigned ttl;
+    const void *addrs;
+
+    if (!PyArg_ParseTuple(args, "O|iOi", &names, &qtype, &timeout_obj, &flags)) {
+        PyErr_SetString(PyExc_TypeError, "Resolver.resolve_many(names, qtype=T_A, timeout=None, flags=0) wrong arguments.");
+        return NULL;
+    }
+    if (DNS_T_A != qtype && DNS_T_AAAA != qtype) {
+        PyErr_SetString(PyExc_ValueError, "'qtype' must be T_A or T_AAAA.");
+        return NULL;
+    }
+    if (timeout_from_object(timeout_obj, &timeout) < 0) {
+        return NULL;
+    }
+
+    seq = PySequence_Fast(names, "'names' is not iterable.");
+    if (NULL == seq) {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < n; i++) {
+        value = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyUnicode_Check(value) || NULL == PyUnicode_AsUTF8AndSize(value, &len)) {
+            PyErr_SetString(PyExc_TypeError, "'names' must contain only strings.");
+            goto out;
+        }
+        size += len + 1;
+    }
+
+    // names are copied, other threads may change `names` while GIL is released
+    items = PyMem_New(ResolveItem, n > 0 ? n : 1);
+    buf = PyMem_Malloc(size > 0 ? size : 1);
+    result = PyDict_New();
+    if (NULL == items || NULL == buf || NULL == result) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    now = time(NULL);
+    size = 0;
+    for (i = 0; i < n; i++) {
+        value = PySequence_Fast_GET_ITEM(seq, i);
+        name = PyUnicode_AsUTF8AndSize(value, &len); // cached by the check above
+        items[i].name = memcpy(buf + size, name, len + 1);
+        items[i].status = PYUDNS_RESOLVE_PENDING;
+        items[i].rr = NULL;
+        size += len + 1;
+
+        // hosts file entry wins over cache, names in it are never resolved
+        h = hosts_lookup(&self->hosts, items[i].name, now);
+        if (NULL != h && 0 == (DNS_T_AAAA == qtype ? h->nrr6 : h->nrr4)) {
+            h = NULL;
+        }
+        e = NULL == h ? cache_lookup(&self->cache, items[i].name, qtype, now) : NULL;
+        if (NULL != h || NULL != e) {
+            items[i].status = PYUDNS_RESOLVE_CACHED;
+            stats_submit(&self->stats);
+            stats_complete(&self->stats, NULL != e ? e->status : 0, 0);
+            if (NULL != h) {
+                value = DNS_T_AAAA == qtype ? addrs_build(qtype, h->addr6, h->nrr6, flags)
+                                            : addrs_build(qtype, h->addr4, h->nrr4, flags);
+            } else if (0 != e->status) {
+                value = PyLong_FromLong(e->status);
+            } else {
+                value = addrs_build(qtype, e->data, e->nrr, flags);
+            }
+            if (NULL == value || PyDict_SetItem(result, PySequence_Fast_GET_ITEM(seq, i), value) < 0) {
+                Py_XDECREF(value);
+                goto error;
+            }
+            Py_DECREF(value);
+        }
+    }
+
+    ctx = dns_new(self->ctx);
+    if (NULL == ctx) {
+        PyErr_SetString(PyExc_MemoryError, "Resolver.resolve_many() failed to create udns context.");
+        goto error;
+    }
+    dns_set_dbgfn(ctx, NULL); // runs without GIL, answers are not retried over TCP
+    if (dns_open(ctx) < 0) {
+        PyErr_SetString(PyExc_IOError, "Resolver.resolve_many() failed to open udns socket.");
+        goto error;
+    }
+
+    submitted = stats_now();
+    Py_BEGIN_ALLOW_THREADS
+    resolve_many_loop(ctx, items, n, qtype, flags & ~PYUDNS_FLAGS_MASK, timeout);
+    Py_END_ALLOW_THREADS
+
+    now = time(NULL);
+    for (i = 0; i < n; i++) {
+        if (PYUDNS_RESOLVE_CACHED != items[i].status) {
+            stats_submit(&self->stats);
+            if (PYUDNS_RESOLVE_PENDING == items[i].status) {
+                stats_complete(&self->stats, DNS_E_TEMPFAIL, stats_now() - submitted);
+            } else {
+                stats_complete(&self->stats, items[i].status, items[i].completed - submitted);
+            }
+        }
+        if (NULL != items[i].rr) {
+            if (DNS_T_AAAA == qtype) {
+                a6 = items[i].rr;
+                addrs = a6->dnsa6_addr;
+                nrr = a6->dnsa6_nrr;
+                ttl = a6->dnsa6_ttl;
+            } else {
+                a4 = items[i].rr;
+                addrs = a4->dnsa4_addr;
+                nrr = a4->dnsa4_nrr;
+                ttl = a4->dnsa4_ttl;
+            }
+            cache_store(&self->cache, items[i].name, qtype, 0, ttl, nrr, addrs,
+                        nrr * (DNS_T_AAAA == qtype ? sizeof(struct in6_addr) : sizeof(struct in_addr)), now);
+            value = addrs_build(qtype, addrs, nrr, flags);
+        } else if (PYUDNS_RESOLVE_PENDING == items[i].status) {
+            value = PyLong_FromLong(DNS_E_TEMPFAIL);
+        } else if (PYUDNS_RESOLVE_CACHED == items[i].status) {
+            continue;
+        } else {
+            if (DNS_E_NXDOMAIN == items[i].status || DNS_E_NODATA == items[i].status) {
+                cache_store(&self->cache, items[i].name, qtype, items[i].status,
+                            self->negative_ttl, 0, NULL, 0, now);
+            }
+            value = PyLong_FromLong(items[i].status);
+        }
+        if (NULL == value || PyDict_SetItem(result, PySequence_Fast_GET_ITEM(seq, i), value) < 0) {
+            Py_XDECREF(value);
+            goto error;
+        }
+        Py_DECREF(value);
+    }
+    goto out;
+
+error:
+    Py_CLEAR(result);
+out:
+    if (NULL != ctx) {
+        dns_free(ctx); // drops queries left after timeout without callbacks
+    }
+    if (NULL != items) {
+        for (i = 0; i < n; i++) {
+            free(items[i].rr);
+        }
+    }
+    PyMem_Free(items);
+    PyMem_Free(buf);
+    Py_DECREF(seq);
+    return result;
+}
+
+static Lookup*
+inflight_find (Resolver *self, const char *qname, int qtype, int flags, unsigned hash) {
+    Lookup *lookup;
+
+    if (0 == self->inflight_size) {
+        return NULL;
+    }
+    for (lookup = self->inflight[hash & (self->inflight_size - 1)]; NULL != lookup; lookup = lookup->hnext) {
+        if (lookup->hash == hash && lookup->qtype == qtype && lookup->flags == flags &&
+            0 == strcmp(lookup->qname, qname)) {
+            return lookup;
+        }
+    }
+    return NULL;
+}
+
+// Adds lookup to in-flight table. If table can't grow, lookup is simply not shared.
+static void
+inflight_add (Resolver *self, Lookup *lookup) {
+    Lookup **table, *l, *next;
+    size_t i, size;
+
+    if (self->inflight_count >= self->inflight_size) {
+        size = self->inflight_size ? self->inflight_size * 2 : 64;
+        table = PyMem_New(Lookup*, size);
+        if (NULL != table) {
+            memset(table, 0, size * sizeof(Lookup*));
+            for (i = 0; i < self->inflight_size; i++) {
+                for (l = self->inflight[i]; NULL != l; l = next) {
+                    next = l->hnext;
+                    l->hnext = table[l->hash & (size - 1)];
+                    table[l->hash & (size - 1)] = l;
+                }
+            }
+            PyMem_Free(self->inflight);
+            self->inflight = table;
+            self->inflight_size = size;
+        }
+    }
+    lookup->hnext = NULL;
+    if (0 == self->inflight_size) {
+        return;
+    }
+    lookup->hnext = self->inflight[lookup->hash & (self->inflight_size - 1)];
+    self->inflight[lookup->hash & (self->inflight_size - 1)] = lookup;
+    self->inflight_count++;
+}
+
+static void
+inflight_remove (Resolver *self, Lookup *lookup) {
+    Lookup **pp;
+
+    if (0 == self->inflight_size) {
+        return;
+    }
+    for (pp = &self->inflight[lookup->hash & (self->inflight_size - 1)]; NULL != *pp; pp = &(*pp)->hnext) {
+        if (*pp == lookup) {
+            *pp = lookup->hnext;
+            self->inflight_count--;
+            return;
+        }
+    }
+}
+
+// Cancels lookups left in flight without callbacks. Only refresh lookups
+// can be left when resolver is freed, waiters keep it alive.
+static void
+inflight_cancel_all (Resolver *self) {
+    Lookup *lookup, *next;
+    size_t i;
+
+    for (i = 0; i < self->inflight_size; i++) {
+        for (lookup = self->inflight[i]; NULL != lookup; lookup = next) {
+            next = lookup->hnext;
+            if (NULL != lookup->mq) {
+                mmsg_cancel(&self->mmsg, lookup->mq);
+            } else if (NULL != lookup->tq) {
+                tcp_cancel(&self->tcp, lookup->tq);
+            } else if (NULL != lookup->q) {
+                dns_cancel(self->ctx, lookup->q);
+            }
+            PyMem_Free(lookup);
+        }
+        self->inflight[i] = NULL;
+    }
+    self->inflight_count = 0;
+}
+
+static void lookup_defer_failure(Resolver *self, Lookup *lookup, int status);
+
+// Cancels lookups sent through TRANSPORT_MMSG or TCP before close() shuts
+// their sockets, waiters get DNS_E_TEMPFAIL on next tick.
+static void
+inflight_fail_closed (Resolver *self) {
+    Lookup *lookup, *next;
+    size_t i;
+
+    for (i = 0; i < self->inflight_size; i++) {
+        for (lookup = self->inflight[i]; NULL != lookup; lookup = next) {
+            next = lookup->hnext;
+            if (NULL != lookup->mq) {
+                mmsg_cancel(&self->mmsg, lookup->mq);
+                lookup->mq = NULL;
+            } else if (NULL != lookup->tq) {
+                tcp_cancel(&self->tcp, lookup->tq);
+                lookup->tq = NULL;
+            } else {
+                continue;
+            }
+            lookup_defer_failure(self, lookup, DNS_E_TEMPFAIL);
+        }
+    }
+}
+
+static void
+lookup_add_waiter (Lookup *lookup, QuerySlot *slot) {
+    slot->lookup = lookup;
+    slot->next = NULL;
+    slot->prev = lookup->waiters_tail;
+    if (NULL != lookup->waiters_tail) {
+        lookup->waiters_tail->next = slot;
+    } else {
+        lookup->waiters = slot;
+    }
+    lookup->waiters_tail = slot;
+}
+
+static void
+lookup_remove_waiter (Lookup *lookup, QuerySlot *slot) {
+    if (NULL != slot->prev) {
+        slot->prev->next = slot->next;
+    } else {
+        lookup->waiters = slot->next;
+    }
+    if (NULL != slot->next) {
+        slot->next->prev = slot->prev;
+    } else {
+        lookup->waiters_tail = slot->prev;
+    }
+    slot->prev = slot->next = NULL;
+    slot->lookup = NULL;
+}
+
+/*@null@*/
+static Lookup*
+lookup_new (Resolver *self, const char *qname, int len, unsigned hash, int qtype, int flags) {
+    Lookup *lookup;
+
+    lookup = PyMem_Malloc(sizeof(Lookup) + len);
+    if (NULL == lookup) {
+        return NULL;
+    }
+    memcpy(lookup->qname, qname, len + 1);
+    lookup->q = NULL;
+    lookup->mq = NULL;
+    lookup->tq = NULL;
+    lookup->tc_serv = -1;
+    lookup->priority = 0;
+    lookup->absolute = false;
+    lookup->queue_index = -1;
+    lookup->seq = 0;
+    lookup->resolver = (PyObject*)self;
+    lookup->waiters = lookup->waiters_tail = NULL;
+    lookup->hash = hash;
+    lookup->qtype = qtype;
+    lookup->flags = flags;
+    return lookup;
+}
+
+// Detaches slot from its lookup. Last waiter cancels udns query.
+static void
+resolver_release_lookup (Resolver *self, QuerySlot *slot) {
+    Lookup *lookup = slot->lookup;
+
+    lookup_remove_waiter(lookup, slot);
+    if (NULL != lookup->waiters) {
+        return;
+    }
+    if (lookup->queue_index >= 0) {
+        PYUDNS_PROBE4(cancel, lookup, lookup->qname, lookup->qtype & 0xffff, stats_now());
+        queue_remove(self, lookup);
+        inflight_remove(self, lookup);
+        PyMem_Free(lookup);
+        return;
+    }
+    // q is NULL while lookup delivers its answer, it frees itself then
+    if (NULL != lookup->q || NULL != lookup->mq || NULL != lookup->tq) {
+        PYUDNS_PROBE4(cancel, lookup, lookup->qname, lookup->qtype & 0xffff, stats_now());
+        if (NULL != lookup->mq) {
+            mmsg_cancel(&self->mmsg, lookup->mq);
+        } else if (NULL != lookup->tq) {
+            tcp_cancel(&self->tcp, lookup->tq);
+        } else {
+            dns_cancel(self->ctx, lookup->q);
+        }
+        inflight_remove(self, lookup);
+        PyMem_Free(lookup);
+        resolver_release_queue(self);
+    }
+}
+
+// Detaches pending slot from its lookup or deferred completion.
+static void
+slot_cancel (QuerySlot *slot) {
+    if (NULL != slot->lookup || NULL != slot->deferred) {
+        stats_cancel(&slot->resolver->stats);
+    }
+    if (NULL != slot->lookup) {
+        resolver_release_lookup((Resolver*)slot->lookup->resolver, slot);
+    } else if (NULL != slot->deferred) {
+        ((Resolver*)slot->deferred->resolver)->ndeferred--;
+        slot->deferred->slot = NULL;
+        Py_CLEAR(slot->deferred->value);
+        slot->deferred = NULL;
+    }
+}
+
+// Completes submit_addr() query with the family answered so far, lookup of
+// the other one is cancelled.
+static void
+query_addr_finish (Query *query) {
+    Py_ssize_t i;
+
+    for (i = 0; i < query->nslots; i++) {
+        slot_cancel(&query->slots[i]);
+    }
+    query->npending = 0;
+    query_batch_complete(query->slots[0].resolver, query);
+}
+
+// One family of submit_addr() query has addresses: waits addr_delay for the
+// other one, see Resolver.resolution_delay.
+static void
+query_addr_answered (Resolver *self, Query *query) {
+    Query *prev;
+
+    if (self->addr_delay < 0) {
+        return;
+    }
+    if (0 == self->addr_delay) {
+        query_addr_finish(query);
+        return;
+    }
+    query->addr_deadline = stats_now() + (uint64_t)(self->addr_delay * 1e6);
+    // deadlines mostly come in order, search from the tail
+    for (prev = self->addr_tail; NULL != prev && prev->addr_deadline > query->addr_deadline; prev = prev->addr_prev) {
+    }
+    query->addr_prev = prev;
+    query->addr_next = NULL == prev ? self->addr_head : prev->addr_next;
+    if (NULL != query->addr_next) {
+        query->addr_next->addr_prev = query;
+    } else {
+        self->addr_tail = query;
+    }
+    if (NULL != prev) {
+        prev->addr_next = query;
+    } else {
+        self->addr_head = query;
+    }
+}
+
+// Completes submit_addr() queries whose resolution delay passed.
+static void
+resolver_addr_expire (Resolver *self) {
+    uint64_t now;
+
+    if (NULL == self->addr_head) {
+        return;
+    }
+    now = stats_now();
+    // callbacks may complete or add others, so always take the current head
+    while (NULL != self->addr_head && self->addr_head->addr_deadline <= now) {
+        query_addr_finish(self->addr_head);
+    }
+}
+
+// Microseconds until first resolution delay ends, -1 if none is running.
+static int64_t
+resolver_addr_wait (Resolver *self) {
+    uint64_t now;
+
+    if (NULL == self->addr_head) {
+        return -1;
+    }
+    now = stats_now();
+    return self->addr_head->addr_deadline > now ? (int64_t)(self->addr_head->addr_deadline - now) : 0;
+}
+
+// stats_now() by which timeouts() has work: transport wait it returned last
+// time, or exact end of first resolution delay. 0 if there is none.
+static uint64_t
+resolver_next_deadline (Resolver *self) {
+    uint64_t deadline = self->timeouts_deadline;
+
+    if (NULL != self->addr_head && (0 == deadline || self->addr_head->addr_deadline < deadline)) {
+        deadline = self->addr_head->addr_deadline;
+    }
+    return deadline;
+}
+
+// Splits Lookup.qtype key into query class and type.
+static void
+lookup_class_type (const Lookup *lookup, int *qclass, int *qtype) {
+    *qclass = DNS_C_IN;
+    *qtype = lookup->qtype;
+    if (*qtype > 0xffff) {
+        // PYUDNS_RAW_KEY() of Resolver.submit()
+        *qclass = (*qtype >> 16) - 1;
+        *qtype &= 0xffff;
+    }
+}
+
+// Lookups sent and not answered yet, what max_inflight limits.
+static int
+resolver_inflight (Resolver *self) {
+    return dns_active(self->ctx) + self->mmsg.active + self->tcp.active;
+}
+
+// Whether queued lookup `a` is sent before `b`: higher priority first,
+// submit order among equal ones.
+static bool
+queue_before (const Lookup *a, const Lookup *b) {
+    return a->priority != b->priority ? a->priority > b->priority : a->seq < b->seq;
+}
+
+static void
+queue_set (Resolver *self, size_t i, Lookup *lookup) {
+    self->queue[i] = lookup;
+    lookup->queue_index = (Py_ssize_t)i;
+}
+
+static void
+queue_sift_up (Resolver *self, size_t i) {
+    Lookup *lookup = self->queue[i];
+
+    while (i > 0 && queue_before(lookup, self->queue[(i - 1) / 2])) {
+        queue_set(self, i, self->queue[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    queue_set(self, i, lookup);
+}
+
+static void
+queue_sift_down (Resolver *self, size_t i) {
+    Lookup *lookup = self->queue[i];
+    size_t child;
+
+    for (; (child = 2 * i + 1) < self->queue_len; i = child) {
+        if (child + 1 < self->queue_len && queue_before(self->queue[child + 1], self->queue[child])) {
+            child++;
+        }
+        if (!queue_before(self->queue[child], lookup)) {
+            break;
+        }
+        queue_set(self, i, self->queue[child]);
+    }
+    queue_set(self, i, lookup);
+}
+
+// Returns 0 or DNS_E_NOMEM.
+static int
+queue_push (Resolver *self, Lookup *lookup) {
+    Lookup **queue;
+    size_t cap;
+
+    if (self->queue_len == self->queue_cap) {
+        cap = self->queue_cap > 0 ? self->queue_cap * 2 : 64;
+        queue = PyMem_Resize(self->queue, Lookup*, cap);
+        if (NULL == queue) {
+            return DNS_E_NOMEM;
+        }
+        self->queue = queue;
+        self->queue_cap = cap;
+    }
+    lookup->seq = self->queue_seq++;
+    queue_set(self, self->queue_len++, lookup);
+    queue_sift_up(self, self->queue_len - 1);
+    return 0;
+}
+
+static void
+queue_remove (Resolver *self, Lookup *lookup) {
+    size_t i = (size_t)lookup->queue_index;
+    Lookup *last = self->queue[--self->queue_len];
+
+    lookup->queue_index = -1;
+    if (i == self->queue_len) {
+        return;
+    }
+    queue_set(self, i, last);
+    queue_sift_up(self, i);
+    queue_sift_down(self, (size_t)last->queue_index);
+}
+
+// Raises priority of queued lookup to that of new submitter.
+static void
+queue_raise (Resolver *self, Lookup *lookup, int priority) {
+    if (lookup->queue_index >= 0 && priority > lookup->priority) {
+        lookup->priority = priority;
+        queue_sift_up(self, (size_t)lookup->queue_index);
+    }
+}
+
+// Sends new lookup, or queues it while max_inflight lookups are in flight.
+// Returns 0 or DNS_E_*.
+static int
+resolver_start_lookup (Resolver *self, Lookup *lookup, const char *name, int qclass, int qtype) {
+    size_t len = strlen(name);
+
+    if (self->max_inflight > 0 &&
+        (self->queue_len > 0 || resolver_inflight(self) >= self->max_inflight)) {
+        lookup->absolute = len > 0 && '.' == name[len - 1];
+        PYUDNS_PROBE4(queue, lookup, lookup->qname, qtype, stats_now());
+        return queue_push(self, lookup);
+    }
+    return lookup_submit(self, lookup, name, qclass, qtype);
+}
+
+// Fails lookup which could not be sent, waiters get `status` on next tick.
+static void
+lookup_defer_failure (Resolver *self, Lookup *lookup, int status) {
+    QuerySlot *slot;
+
+    inflight_remove(self, lookup);
+    while (NULL != (slot = lookup->waiters)) {
+        lookup_remove_waiter(lookup, slot);
+        if (0 != resolver_defer(self, slot, NULL, status)) {
+            slot_complete(slot, NULL, status);
+        }
+    }
+    PyMem_Free(lookup);
+}
+
+// Sends queued lookups while there is room under max_inflight. Lookups that
+// fail to send complete on next tick, not from the caller's context.
+static void
+resolver_release_queue (Resolver *self) {
+    char name[CACHE_MAXNAME + 1];
+    Lookup *lookup;
+    size_t len;
+    int qclass, qtype, status;
+
+    while (self->queue_len > 0 &&
+           (0 == self->max_inflight || resolver_inflight(self) < self->max_inflight)) {
+        lookup = self->queue[0];
+        queue_remove(self, lookup);
+        len = strlen(lookup->qname);
+        memcpy(name, lookup->qname, len);
+        if (lookup->absolute) {
+            name[len++] = '.';
+        }
+        name[len] = '\0';
+        lookup_class_type(lookup, &qclass, &qtype);
+        status = lookup_submit(self, lookup, name, qclass, qtype);
+        if (0 != status) {
+            lookup_defer_failure(self, lookup, status);
+        }
+    }
+}
+
+static void on_lookup_reply(void *data, dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status);
+static void on_tcp_reply(void *data, dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status);
+
+// Sends lookup whose answer came truncated over UDP again over TCP, to the
+// same server and only once. Returns true if it did, lookup then completes
+// from on_lookup_reply().
+static bool
+lookup_retry_tcp (Lookup *lookup) {
+    Resolver *self = (Resolver*)lookup->resolver;
+    dnsc_t dn[DNS_MAXDN];
+    int serv = lookup->tc_serv, qclass, qtype, isabs;
+
+    lookup->tc_serv = -1;
+    if (serv < 0 || dns_ptodn(lookup->qname, 0, dn, sizeof(dn), &isabs) <= 0) {
+        return false;
+    }
+    lookup_class_type(lookup, &qclass, &qtype);
+    lookup->q = NULL;
+    lookup->mq = NULL;
+    lookup->tq = tcp_submit(&self->tcp, serv, dn, qclass, qtype, lookup->flags, on_tcp_reply, lookup);
+    if (NULL == lookup->tq) {
+        return false;
+    }
+    PYUDNS_PROBE5(retry, lookup, lookup->qname, qtype, serv, stats_now());
+    return true;
+}
+
+// udns debug hook, called for datagrams udns sends and receives. Marks
+// lookups whose answer came truncated, so that their failure is retried over
+// TCP to the server which sent it. udns query id is not known here, so all
+// lookups of the name and type are marked whatever their flags.
+static void
+on_dns_dbg (int code, const struct sockaddr *sa, unsigned salen,
+            dnscc_t *pkt, int plen, const struct dns_query *q, void *data) {
+    Resolver *self = dbg_resolver;
+    dnscc_t *cur, *end = pkt + plen;
+    dnsc_t dn[DNS_MAXDN];
+    char name[DNS_MAXNAME], qname[CACHE_MAXNAME];
+    Lookup *lookup;
+    unsigned hash;
+    int i, qclass, qtype, keys[2], serv = -2;
+
+    if (NULL == self || 0 == self->inflight_size || plen < DNS_HSIZE ||
+        !dns_qr(pkt) || !dns_tc(pkt) || 1 != dns_numqd(pkt)) {
+        return;
+    }
+    cur = pkt + DNS_HSIZE;
+    if (dns_getdn(pkt, &cur, end, dn, sizeof(dn)) <= 0 || cur + 4 > end ||
+        dns_dntop(dn, name, sizeof(name)) <= 0 || cache_normalize(name, qname) < 0) {
+        return;
+    }
+    qtype = dns_get16(cur);
+    qclass = dns_get16(cur + 2);
+    keys[0] = PYUDNS_RAW_KEY(qclass, qtype);
+    keys[1] = DNS_C_IN == qclass && (DNS_T_A == qtype || DNS_T_AAAA == qtype || DNS_T_PTR == qtype) ? qtype : -1;
+    for (i = 0; i < 2 && keys[i] >= 0; i++) {
+        hash = cache_hash(qname, keys[i]);
+        for (lookup = self->inflight[hash & (self->inflight_size - 1)]; NULL != lookup; lookup = lookup->hnext) {
+            if (lookup->hash == hash && lookup->qtype == keys[i] && NULL != lookup->q &&
+                0 == strcmp(lookup->qname, qname)) {
+                if (-2 == serv) {
+                    serv = tcp_add_serv(&self->tcp, sa, salen);
+                }
+                lookup->tc_serv = serv;
+            }
+        }
+    }
+}
+
+// Delivers A or AAAA answer `addrs`, or error `status` if result is NULL,
+// to all waiters and frees lookup and result.
+static void
+lookup_done_addr (Lookup *lookup, void *result, const void *addrs, int nrr, unsigned ttl, int status) {
+    Resolver *resolver = (Resolver*)lookup->resolver;
+    QuerySlot *slot;
+    PyObject *values[2] = {NULL, NULL}; // shared by waiters: [0] tuple, [1] packed
+    PyObject *value;
+    int packed, qtype = lookup->qtype;
+    size_t size = DNS_T_AAAA == qtype ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+    time_t now = time(NULL);
+
+    // same name submitted from callbacks below starts a new lookup
+    lookup->q = NULL;
+    lookup->mq = NULL;
+    lookup->tq = NULL;
+    inflight_remove(resolver, lookup);
+    // queued lookups go out before the ones callbacks below submit
+    resolver_release_queue(resolver);
+
+    if (NULL == result) {
+        if (DNS_E_NXDOMAIN == status || DNS_E_NODATA == status) {
+            cache_store(&resolver->cache, lookup->qname, qtype, status,
+                        resolver->negative_ttl, 0, NULL, 0, now);
+        }
+    } else {
+        cache_store(&resolver->cache, lookup->qname, qtype, 0, ttl, nrr, addrs, nrr * size, now);
+    }
+
+    PYUDNS_PROBE5(callback__entry, lookup, lookup->qname, qtype, status, stats_now());
+    // callbacks may cancel other waiters, so always take the current head
+    while (NULL != (slot = lookup->waiters)) {
+        lookup_remove_waiter(lookup, slot);
+        value = NULL;
+        if (NULL != result) {
+            packed = (((Query*)slot->query)->flags & PYUDNS_RESULT_PACKED) ? 1 : 0;
+            if (NULL == values[packed]) {
+                values[packed] = addrs_build(qtype, addrs, nrr, packed ? PYUDNS_RESULT_PACKED : 0);
+            }
+            value = values[packed];
+            Py_XINCREF(value);
+        }
+        slot_complete(slot, value, status);
+    }
+
+    PYUDNS_PROBE5(callback__return, lookup, lookup->qname, qtype, status, stats_now());
+
+    Py_XDECREF(values[0]);
+    Py_XDECREF(values[1]);
+    free(result); // man 3 udns: it's the application who is responsible for freeing result memory
+    PyMem_Free(lookup);
+}
+
+static void
+lookup_done_a4 (Lookup *lookup, struct dns_rr_a4 *result, int status) {
+    if (NULL == result) {
+        lookup_done_addr(lookup, NULL, NULL, 0, 0, status);
+    } else {
+        lookup_done_addr(lookup, result, result->dnsa4_addr, result->dnsa4_nrr, result->dnsa4_ttl, status);
+    }
+}
+
+static void
+lookup_done_a6 (Lookup *lookup, struct dns_rr_a6 *result, int status) {
+    if (NULL == result) {
+        lookup_done_addr(lookup, NULL, NULL, 0, 0, status);
+    } else {
+        lookup_done_addr(lookup, result, result->dnsa6_addr, result->dnsa6_nrr, result->dnsa6_ttl, status);
+    }
+}
+
+// Fires reply probe as answer or failure of lookup comes from any transport.
+static inline void
+lookup_trace_reply (Lookup *lookup, int status) {
+    PYUDNS_PROBE5(reply, lookup, lookup->qname, lookup->qtype & 0xffff, status, stats_now());
+}
+
+static void
+on_dns_resolve_a4 (struct dns_ctx *ctx, struct dns_rr_a4 *result, void *data) {
+    lookup_trace_reply(data, NULL == result ? dns_status(ctx) : 0);
+    if (NULL == result && lookup_retry_tcp(data)) {
+        return;
+    }
+    lookup_done_a4(data, result, NULL == result ? dns_status(ctx) : 0);
+}
+
+static void
+on_dns_resolve_a6 (struct dns_ctx *ctx, struct dns_rr_a6 *result, void *data) {
+    lookup_trace_reply(data, NULL == result ? dns_status(ctx) : 0);
+    if (NULL == result && lookup_retry_tcp(data)) {
+        return;
+    }
+    lookup_done_a6(data, result, NULL == result ? dns_status(ctx) : 0);
+}
+
+// Sends A or AAAA query for cached `name` in background, its answer only
+// replaces the cache entry. On failure the entry is served until it expires.
+static void
+resolver_refresh_addr (Resolver *self, const char *name, const char *qname, int qtype) {
+    Lookup *lookup;
+    unsigned hash = cache_hash(qname, qtype);
+
+    if (NULL != inflight_find(self, qname, qtype, 0, hash)) {
+        return;
+    }
+    // not worth a place in the admission queue, stale answer is still served
+    if (self->max_inflight > 0 &&
+        (self->queue_len > 0 || resolver_inflight(self) >= self->max_inflight)) {
+        return;
+    }
+    lookup = lookup_new(self, qname, strlen(qname), hash, qtype, 0);
+    if (NULL == lookup) {
+        return;
+    }
+    if (0 != lookup_submit(self, lookup, name, DNS_C_IN, qtype)) {
+        PyMem_Free(lookup);
+        return;
+    }
+    inflight_add(self, lookup);
+    if (0 == self->inflight_size) {
+        // nothing would find it on dealloc
+        if (NULL != lookup->mq) {
+            mmsg_cancel(&self->mmsg, lookup->mq);
+        } else {
+            dns_cancel(self->ctx, lookup->q);
+        }
+        PyMem_Free(lookup);
+    }
+}
+
+// Starts A or AAAA lookup of `name` for slot. Answer comes from hosts file or cache on next tick,
+// from identical lookup already in flight or from new udns query.
+// Returns 0 or udns error status if query can't be submitted.
+static int
+resolver_submit_addr_slot (Resolver *self, QuerySlot *slot, const char *name, int qtype, int flags, int priority) {
+    Query *query = (Query*)slot->query;
+    char qname[CACHE_MAXNAME];
+    hosts_entry *h;
+    cache_entry *e;
+    Lookup *lookup;
+    PyObject *value;
+    unsigned hash;
+    int len, status;
+    time_t now = time(NULL);
+
+    slot_start(self, slot);
+    if (NULL != self->hosts.path) {
+        h = hosts_lookup(&self->hosts, name, now);
+        value = NULL;
+        if (NULL != h && DNS_T_A == qtype && h->nrr4 > 0) {
+            value = addrs_build(DNS_T_A, h->addr4, h->nrr4, query->flags);
+        } else if (NULL != h && DNS_T_AAAA == qtype && h->nrr6 > 0) {
+            value = addrs_build(DNS_T_AAAA, h->addr6, h->nrr6, query->flags);
+        } else {
+            h = NULL;
+        }
+        if (NULL != h) {
+            status = 0;
+            if (NULL == value) {
+                PyErr_Clear();
+                status = DNS_E_NOMEM;
+            }
+            return resolver_defer(self, slot, value, status);
+        }
+    }
+    e = cache_lookup(&self->cache, name, qtype, now);
+    if (NULL != e) {
+        value = NULL;
+        status = e->status;
+        if (0 == status) {
+            value = addrs_build(qtype, e->data, e->nrr, query->flags);
+            if (NULL == value) {
+                PyErr_Clear();
+                status = DNS_E_NOMEM;
+            }
+        }
+        status = resolver_defer(self, slot, value, status);
+        if (cache_prefetch_due(&self->cache, e, now)) {
+            resolver_refresh_addr(self, name, e->qname, qtype);
+        }
+        return status;
+    }
+
+    len = cache_normalize(name, qname);
+    if (len < 0) {
+        return DNS_E_BADQUERY;
+    }
+    flags &= ~PYUDNS_FLAGS_MASK;
+    hash = cache_hash(qname, qtype);
+    lookup = inflight_find(self, qname, qtype, flags, hash);
+    if (NULL == lookup) {
+        lookup = lookup_new(self, qname, len, hash, qtype, flags);
+        if (NULL == lookup) {
+            return DNS_E_NOMEM;
+        }
+        lookup->priority = priority;
+        status = resolver_start_lookup(self, lookup, name, DNS_C_IN, qtype);
+        if (0 != status) {
+            PyMem_Free(lookup);
+            return status;
+        }
+        inflight_add(self, lookup);
+    } else {
+        queue_raise(self, lookup, priority);
+    }
+    lookup_add_waiter(lookup, slot);
+    return 0;
+}
+
+// Resolver.submit_a4(domain, callback, data=None, flags=0, priority=0) -> Query
+PyDoc_STRVAR(Resolver_submit_a4_doc, "\
+submit_a4(domain, callback, data=None, flags=0, priority=0) -> Query\n\
+\n\
+`callback(result, data)` gets tuple of dotted-quad strings or None.\n\
+With RESULT_PACKED in `flags` result is bytes of raw addresses instead,\n\
+4 bytes per record in network byte order.\n\
+Answers found in cache (see cache_max_bytes) are delivered on next\n\
+ioevent()/run() tick without network traffic. Name already being resolved\n\
+does not send another query, all submitters get the same answer.\n\
+While max_inflight queries are in flight the query waits in queue, higher\n\
+`priority` ones are sent first.\n\
+With callback None the result is queued for drain() instead.\n\
+");
+
+// Picks Resolver which resolves `name` for submit owner (Resolver or ResolverPool).
+typedef Resolver *(*resolver_picker)(PyObject *owner, const char *name);
+
+static Resolver*
+resolver_pick_self (PyObject *owner, const char *name) {
+    return (Resolver*)owner;
+}
+
+// submit_a4() implementation shared by Resolver and ResolverPool.
+/*@null@*/
+static PyObject*
+submit_a4 (PyObject *owner, resolver_picker pick, PyObject *const *args, Py_ssize_t nargs) {
+    const char *domain;
+    PyObject *cb, *cb_data = Py_None;
+    Resolver *resolver;
+    Query *query;
+    int flags = 0, priority = 0, status;
+
+    if (fastcall_parse(args, nargs, "sO|Oii", "Resolver.submit_a4(domain, callback, data=None, flags=0, priority=0) wrong arguments.",
+                       &domain, &cb, &cb_data, &flags, &priority) < 0) {
+        return NULL;
+    }
+    if (!cb || (Py_None != cb && !PyCallable_Check(cb))) {
+        PyErr_SetString(PyExc_TypeError, "'callback' is not callable or None.");
+        return NULL;
+    }
+
+    query = Query_create(owner, cb, cb_data, flags);
+    if (NULL == query) {
+        return NULL;
+    }
+    query->slots = &query->slot;
+    query->nslots = 1;
+    query->npending = 1;
+    query->slot.query = (PyObject*)query;
+    query->slot.index = -1;
+    Py_INCREF(query);
+    resolver = pick(owner, domain);
+    status = resolver_submit_addr_slot(resolver, &query->slot, domain, DNS_T_A, flags, priority);
+    // report failure through callback as well
+    if (0 != status && 0 != resolver_defer(resolver, &query->slot, NULL, status)) {
+        slot_complete(&query->slot, NULL, status);
+    }
+
+    return (PyObject*)query;
+}
+
+/*@null@*/
+static PyObject*
+Resolver_submit_a4 (Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    return submit_a4((PyObject*)self, resolver_pick_self, args, nargs);
+}
+
+// Resolver.submit_a4_many(names, callback, data=None, flags=0, priority=0) -> Query
+PyDoc_STRVAR(Resolver_submit_a4_many_doc, "\
+submit_a4_many(names, callback, data=None, flags=0, priority=0) -> Query\n\
+\n\
+Submits A queries for every name in `names` iterable at once.\n\
+`callback(results, data)` is called once, when all names are done.\n\
+`results` is a tuple in order of `names`: tuple of addresses for resolved\n\
+names, E_* error code (int) for failed ones. See submit_a4() for `flags`\n\
+and `priority`.\n\
+Returned Query represents whole batch, cancel() cancels all pending names.\n\
+If no name could be submitted, callback is called before return.\n\
+With callback None `results` is queued for drain() instead.\n\
+");
+
+// submit_a4_many() implementation shared by Resolver and ResolverPool.
+/*@null@*/
+static PyObject*
+submit_a4_many (PyObject *owner, resolver_picker pick, PyObject *const *args, Py_ssize_t nargs) {
+    PyObject *names, *seq, *cb, *cb_data = Py_None;
+    Query *query;
+    QuerySlot *slot;
+    Py_ssize_t i, n;
+    const char *domain;
+    int flags = 0, priority = 0, status;
+
+    if (fastcall_parse(args, nargs, "OO|Oii", "Resolver.submit_a4_many(names, callback, data=None, flags=0, priority=0) wrong arguments.",
+                       &names, &cb, &cb_data, &flags, &priority) < 0) {
+        return NULL;
+    }
+    if (!cb || (Py_None != cb && !PyCallable_Check(cb))) {
+        PyErr_SetString(PyExc_TypeError, "'callback' is not callable or None.");
+        return NULL;
+    }
+
+    seq = PySequence_Fast(names, "'names' is not iterable.");
+    if (NULL == seq) {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < n; i++) {
+        if (NULL == PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i))) {
+            PyErr_SetString(PyExc_TypeError, "'names' must contain only strings.");
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+
+    query = Query_create(owner, cb, cb_data, flags);
+    if (NULL == query) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+    query->results = PyTuple_New(n);
+    query->slots = PyMem_New(QuerySlot, n > 0 ? n : 1);
+    if (NULL == query->results || NULL == query->slots) {
+        Py_DECREF(seq);
+        Py_DECREF(query);
+        return PyErr_NoMemory();
+    }
+    query->nslots = n;
+    query->npending = n;
+
+    Py_INCREF(query);
+    for (i = 0; i < n; i++) {
+        slot = &query->slots[i];
+        slot->lookup = NULL;
+        slot->prev = slot->next = NULL;
+        slot->deferred = NULL;
+        slot->query = (PyObject*)query;
+        slot->index = i;
+        Py_INCREF(Py_None);
+        PyTuple_SET_ITEM(query->results, i, Py_None);
+
+        domain = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+        status = resolver_submit_addr_slot(pick(owner, domain), slot, domain, DNS_T_A, flags, priority);
+        if (0 != status) {
+            stats_complete(&slot->resolver->stats, status, 0);
+            Py_DECREF(Py_None);
+            PyTuple_SET_ITEM(query->results, i, PyLong_FromLong(status));
+            query->npending--;
+        }
+    }
+    Py_DECREF(seq);
+
+    if (0 == query->npending) {
+        query_batch_complete(pick(owner, ""), query);
+    }
+
+    return (PyObject*)query;
+}
+
+/*@null@*/
+static PyObject*
+Resolver_submit_a4_many (Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    return submit_a4_many((PyObject*)self, resolver_pick_self, args, nargs);
+}
+
+// Resolver.submit_addr(name, callback, data=None, family=AF_UNSPEC, flags=0, priority=0) -> Query
+PyDoc_STRVAR(Resolver_submit_addr_doc, "\
+submit_addr(name, callback, data=None, family=AF_UNSPEC, flags=0, priority=0) -> Query\n\
+\n\
+Resolves IPv6 and IPv4 addresses of `name` at once: AAAA and A queries go\n\
+out in parallel and `callback(result, data)` is called once, with tuple of\n\
+address strings of both families interleaved starting with IPv6\n\
+(RFC 8305), or None if neither family resolved, Query.status tells why.\n\
+Once one family has addresses the other is waited for resolution_delay\n\
+seconds at most, its lookup is cancelled then. `family` AF_INET6 or\n\
+AF_INET asks only one. Hosts file, cache and lookups in flight serve each\n\
+family as in submit_a4(), RESULT_PACKED is not supported.\n\
+With callback None the result is queued for drain() instead.\n\
+");
+
+// submit_addr() implementation shared by Resolver and ResolverPool.
+/*@null@*/
+static PyObject*
+submit_addr (PyObject *owner, resolver_picker pick, PyObject *const *args, Py_ssize_t nargs) {
+    static const int qtypes[2] = {DNS_T_AAAA, DNS_T_A}; // slot order, IPv6 first
+    const char *name;
+    PyObject *cb, *cb_data = Py_None;
+    Resolver *resolver;
+    Query *query;
+    QuerySlot *slot;
+    Py_ssize_t i, first = 0, n = 2;
+    int family = AF_UNSPEC, flags = 0, priority = 0, status;
+
+    if (fastcall_parse(args, nargs, "sO|Oiii", "Resolver.submit_addr(name, callback, data=None, family=AF_UNSPEC, flags=0, priority=0) wrong arguments.",
+                       &name, &cb, &cb_data, &family, &flags, &priority) < 0) {
+        return NULL;
+    }
+    if (!cb || (Py_None != cb && !PyCallable_Check(cb))) {
+        PyErr_SetString(PyExc_TypeError, "'callback' is not callable or None.");
+        return NULL;
+    }
+    if (AF_INET == family) {
+        first = 1;
+        n = 1;
+    } else if (AF_INET6 == family) {
+        n = 1;
+    } else if (AF_UNSPEC != family) {
+        PyErr_SetString(PyExc_ValueError, "'family' must be AF_UNSPEC, AF_INET or AF_INET6.");
+        return NULL;
+    }
+
+    query = Query_create(owner, cb, cb_data, flags & ~PYUDNS_RESULT_PACKED);
+    if (NULL == query) {
+        return NULL;
+    }
+    query->results = PyTuple_New(n);
+    query->slots = PyMem_New(QuerySlot, n);
+    if (NULL == query->results || NULL == query->slots) {
+        Py_DECREF(query);
+        return PyErr_NoMemory();
+    }
+    query->nslots = n;
+    query->npending = n;
+    query->addrs = true;
+
+    Py_INCREF(query);
+    // both families on one resolver, it keeps the resolution delay
+    resolver = pick(owner, name);
+    for (i = 0; i < n; i++) {
+        slot = &query->slots[i];
+        slot->lookup = NULL;
+        slot->prev = slot->next = NULL;
+        slot->deferred = NULL;
+        slot->query = (PyObject*)query;
+        slot->index = i;
+        Py_INCREF(Py_None);
+        PyTuple_SET_ITEM(query->results, i, Py_None);
+    }
+    for (i = 0; i < n; i++) {
+        slot = &query->slots[i];
+        status = resolver_submit_addr_slot(resolver, slot, name, qtypes[first + i], flags, priority);
+        // report failure through callback as well
+        if (0 != status && 0 != resolver_defer(resolver, slot, NULL, status)) {
+            slot_complete(slot, NULL, status);
+        }
+    }
+
+    return (PyObject*)query;
+}
+
+/*@null@*/
+static PyObject*
+Resolver_submit_addr (Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    return submit_addr((PyObject*)self, resolver_pick_self, args, nargs);
+}
+
+// Writes absolute reverse name of IPv4 (4 bytes) or IPv6 (16 bytes) address
+// into buf, e.g. "4.3.2.1.in-addr.arpa.". Returns its length without the dot.
+static int
+ptr_name (const unsigned char *addr, int af, char *buf) {
+    static const char hex[] = "0123456789abcdef";
+    char *p = buf;
+    int i;
+
+    if (AF_INET == af) {
+        p += sprintf(p, "%u.%u.%u.%u.in-addr.arpa", addr[3], addr[2], addr[1], addr[0]);
+    } else {
+        for (i = 15; i >= 0; i--) {
+            *p++ = hex[addr[i] & 0xf];
+            *p++ = '.';
+            *p++ = hex[addr[i] >> 4];
+            *p++ = '.';
+        }
+        memcpy(p, "ip6.arpa", 8);
+        p += 8;
+    }
+    p[0] = '.';
+    p[1] = '\0';
+    return (int)(p - buf);
+}
+
+// Starts PTR lookup of packed address for slot, from identical lookup already
+// in flight or new query. Returns 0 or udns error status.
+static int
+resolver_submit_ptr_slot (Resolver *self, QuerySlot *slot, const char *name, int len, int flags, int priority) {
+    char qname[CACHE_MAXNAME];
+    Lookup *lookup;
+    unsigned hash;
+    int status;
+
+    slot_start(self, slot);
+    // reverse names are lowercase already, normalized one only lacks the dot
+    memcpy(qname, name, len);
+    qname[len] = '\0';
+    flags &= ~PYUDNS_FLAGS_MASK;
+    hash = cache_hash(qname, DNS_T_PTR);
+    lookup = inflight_find(self, qname, DNS_T_PTR, flags, hash);
+    if (NULL == lookup) {
+        lookup = lookup_new(self, qname, len, hash, DNS_T_PTR, flags);
+        if (NULL == lookup) {
+            return DNS_E_NOMEM;
+        }
+        lookup->priority = priority;
+        status = resolver_start_lookup(self, lookup, name, DNS_C_IN, DNS_T_PTR);
+        if (0 != status) {
+            PyMem_Free(lookup);
+            return status;
+        }
+        inflight_add(self, lookup);
+    } else {
+        queue_raise(self, lookup, priority);
+    }
+    lookup_add_waiter(lookup, slot);
+    return 0;
+}
+
+// Resolver.submit_ptr_many(addrs, family, callback, data=None, flags=0, priority=0) -> Query
+PyDoc_STRVAR(Resolver_submit_ptr_many_doc, "\
+submit_ptr_many(addrs, family, callback, data=None, flags=0, priority=0) -> Query\n\
+\n\
+Submits PTR queries for packed addresses in `addrs`, any contiguous buffer\n\
+(bytes, array, numpy array...) of 4 byte IPv4 addresses with `family`\n\
+AF_INET or 16 byte IPv6 addresses with AF_INET6, in network byte order.\n\
+Reverse names are built in C, the buffer is read once before return.\n\
+`callback(results, data)` is called once, when all addresses are done.\n\
+`results` is a tuple in order of addresses: tuple of host names for\n\
+resolved ones, E_* error code (int) for failed ones. Answers are not\n\
+cached, identical queries in flight are shared. See submit_a4_many().\n\
+");
+
+// submit_ptr_many() implementation shared by Resolver and ResolverPool.
+/*@null@*/
+static PyObject*
+submit_ptr_many (PyObject *owner, resolver_picker pick, PyObject *const *args, Py_ssize_t nargs) {
+    PyObject *addrs, *cb, *cb_data = Py_None;
+    Py_buffer view;
+    Query *query;
+    QuerySlot *slot;
+    Py_ssize_t i, n, size;
+    char name[DNS_MAXNAME];
+    int family, len, flags = 0, priority = 0, status;
+
+    if (fastcall_parse(args, nargs, "OiO|Oii", "Resolver.submit_ptr_many(addrs, family, callback, data=None, flags=0, priority=0) wrong arguments.",
+                       &addrs, &family, &cb, &cb_data, &flags, &priority) < 0) {
+        return NULL;
+    }
+    if (!cb || (Py_None != cb && !PyCallable_Check(cb))) {
+        PyErr_SetString(PyExc_TypeError, "'callback' is not callable or None.");
+        return NULL;
+    }
+    if (AF_INET != family && AF_INET6 != family) {
+        PyErr_SetString(PyExc_ValueError, "'family' must be AF_INET or AF_INET6.");
+        return NULL;
+    }
+    if (PyObject_GetBuffer(addrs, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    size = AF_INET == family ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+    if (0 != view.len % size) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "'addrs' length is not a multiple of address size.");
+        return NULL;
+    }
+    n = view.len / size;
+
+    query = Query_create(owner, cb, cb_data, flags);
+    if (NULL == query) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    query->results = PyTuple_New(n);
+    query->slots = PyMem_New(QuerySlot, n > 0 ? n : 1);
+    if (NULL == query->results || NULL == query->slots) {
+        PyBuffer_Release(&view);
+        Py_DECREF(query);
+        return PyErr_NoMemory();
+    }
+    query->nslots = n;
+    query->npending = n;
+
+    Py_INCREF(query);
+    for (i = 0; i < n; i++) {
+        slot = &query->slots[i];
+        slot->lookup = NULL;
+        slot->prev = slot->next = NULL;
+        slot->deferred = NULL;
+        slot->query = (PyObject*)query;
+        slot->index = i;
+        Py_INCREF(Py_None);
+        PyTuple_SET_ITEM(query->results, i, Py_None);
+
+        len = ptr_name((const unsigned char*)view.buf + i * size, family, name);
+        status = resolver_submit_ptr_slot(pick(owner, name), slot, name, len, flags, priority);
+        if (0 != status) {
+            stats_complete(&slot->resolver->stats, status, 0);
+            Py_DECREF(Py_None);
+            PyTuple_SET_ITEM(query->results, i, PyLong_FromLong(status));
+            query->npending--;
+        }
+    }
+    PyBuffer_Release(&view);
+
+    if (0 == query->npending) {
+        query_batch_complete(pick(owner, ""), query);
+    }
+
+    return (PyObject*)query;
+}
+
+/*@null@*/
+static PyObject*
+Resolver_submit_ptr_many (Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    return submit_ptr_many((PyObject*)self, resolver_pick_self, args, nargs);
+}
+
+// udns parser for Resolver.submit(): keeps whole reply and positions of
+// matching answer records, decoding is left to RRWrap.
+static int
+raw_parse (dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, void **result) {
+    struct dns_parse p;
+    struct dns_rr rr;
+    RawRR *ret;
+    unsigned plen = end - pkt;
+    int r, nrr = 0;
+
+    dns_initparse(&p, qdn, pkt, cur, end);
+    while ((r = dns_nextrr(&p, &rr)) > 0) {
+        nrr++;
+    }
+    if (r < 0) {
+        return DNS_E_PROTOCOL;
+    }
+    if (0 == nrr) {
+        return DNS_E_NODATA;
+    }
+
+    ret = malloc(sizeof(RawRR) + nrr * sizeof(RawRecord) + plen + dns_stdrr_size(&p));
+    if (NULL == ret) {
+        return DNS_E_NOMEM;
+    }
+    ret->base.dnsn_nrr = nrr;
+    ret->qclass = dns_get16(cur + 2);
+    ret->qtype = dns_get16(cur);
+    ret->records = (RawRecord*)(ret + 1);
+    ret->pkt = (unsigned char*)(ret->records + nrr);
+    ret->plen = plen;
+    memcpy(ret->pkt, pkt, plen);
+
+    dns_rewind(&p, qdn);
+    nrr = 0;
+    while (dns_nextrr(&p, &rr) > 0) {
+        ret->records[nrr].offset = rr.dnsrr_dptr - pkt;
+        ret->records[nrr].length = rr.dnsrr_dsz;
+        ret->records[nrr].type = rr.dnsrr_typ;
+        nrr++;
+    }
+    dns_stdrr_finish(&ret->base, (char*)ret->pkt + plen, &p);
+    *result = ret;
+    return 0;
+}
+
+// Same as lookup_done_addr() for Resolver.submit() lookups.
+static void
+lookup_done_raw (Lookup *lookup, RawRR *result, int status) {
+    QuerySlot *slot;
+    PyObject *value = NULL;
+
+    lookup->q = NULL;
+    lookup->mq = NULL;
+    lookup->tq = NULL;
+    inflight_remove((Resolver*)lookup->resolver, lookup);
+    resolver_release_queue((Resolver*)lookup->resolver);
+
+    if (NULL != result) {
+        // RR is read-only, all waiters share one; it owns result from now
+        value = RRWrap_create(lookup->resolver, result);
+        if (NULL == value) {
+            PyErr_Clear();
+            status = DNS_E_NOMEM;
+        }
+    }
+
+    PYUDNS_PROBE5(callback__entry, lookup, lookup->qname, lookup->qtype & 0xffff, status, stats_now());
+    while (NULL != (slot = lookup->waiters)) {
+        lookup_remove_waiter(lookup, slot);
+        Py_XINCREF(value);
+        slot_complete(slot, value, status);
+    }
+    PYUDNS_PROBE5(callback__return, lookup, lookup->qname, lookup->qtype & 0xffff, status, stats_now());
+
+    Py_XDECREF(value);
+    PyMem_Free(lookup);
+}
+
+static void
+on_dns_resolve_raw (struct dns_ctx *ctx, void *result, void *data) {
+    lookup_trace_reply(data, NULL == result ? dns_status(ctx) : 0);
+    if (NULL == result && lookup_retry_tcp(data)) {
+        return;
+    }
+    lookup_done_raw(data, result, NULL == result ? dns_status(ctx) : 0);
+}
+
+// Same as lookup_done_addr() for submit_ptr_many() lookups, answer is a tuple
+// of names. PTR answers are not cached.
+static void
+lookup_done_ptr (Lookup *lookup, struct dns_rr_ptr *result, int status) {
+    QuerySlot *slot;
+    PyObject *value = NULL, *name;
+    int i;
+
+    lookup->q = NULL;
+    lookup->mq = NULL;
+    lookup->tq = NULL;
+    inflight_remove((Resolver*)lookup->resolver, lookup);
+    resolver_release_queue((Resolver*)lookup->resolver);
+
+    if (NULL != result) {
+        value = PyTuple_New(result->dnsptr_nrr);
+        for (i = 0; NULL != value && i < result->dnsptr_nrr; i++) {
+            name = PyUnicode_DecodeUTF8(result->dnsptr_ptr[i], strlen(result->dnsptr_ptr[i]), "replace");
+            if (NULL == name) {
+                Py_CLEAR(value);
+                break;
+            }
+            PyTuple_SET_ITEM(value, i, name);
+        }
+        if (NULL == value) {
+            PyErr_Clear();
+            status = DNS_E_NOMEM;
+        }
+    }
+
+    PYUDNS_PROBE5(callback__entry, lookup, lookup->qname, DNS_T_PTR, status, stats_now());
+    while (NULL != (slot = lookup->waiters)) {
+        lookup_remove_waiter(lookup, slot);
+        Py_XINCREF(value);
+        slot_complete(slot, value, status);
+    }
+    PYUDNS_PROBE5(callback__return, lookup, lookup->qname, DNS_T_PTR, status, stats_now());
+
+    Py_XDECREF(value);
+    free(result);
+    PyMem_Free(lookup);
+}
+
+static void
+on_dns_resolve_ptr (struct dns_ctx *ctx, void *result, void *data) {
+    lookup_trace_reply(data, NULL == result ? dns_status(ctx) : 0);
+    if (NULL == result && lookup_retry_tcp(data)) {
+        return;
+    }
+    lookup_done_ptr(data, result, NULL == result ? dns_status(ctx) : 0);
+}
+
+// TRANSPORT_MMSG or TCP reply, parsed here as udns would do before its callback.
+static void
+on_lookup_reply (void *data, dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status) {
+    Lookup *lookup = data;
+    void *result = NULL;
+
+    if (0 == status) {
+        status = (DNS_T_A == lookup->qtype ? dns_parse_a4 :
+                  DNS_T_AAAA == lookup->qtype ? dns_parse_a6 :
+                  DNS_T_PTR == lookup->qtype ? dns_parse_ptr : raw_parse)(qdn, pkt, cur, end, &result);
+        if (0 != status) {
+            result = NULL;
+        }
+    }
+    if (DNS_T_A == lookup->qtype) {
+        lookup_done_a4(lookup, result, status);
+    } else if (DNS_T_AAAA == lookup->qtype) {
+        lookup_done_a6(lookup, result, status);
+    } else if (DNS_T_PTR == lookup->qtype) {
+        lookup_done_ptr(lookup, result, status);
+    } else {
+        lookup_done_raw(lookup, result, status);
+    }
+}
+
+static void
+on_mmsg_reply (void *data, int serv, dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status) {
+    Lookup *lookup = data;
+    Resolver *self = (Resolver*)lookup->resolver;
+
+    lookup_trace_reply(lookup, status);
+    // mmsg reports truncated answer as DNS_E_PROTOCOL
+    if (DNS_E_PROTOCOL == status && serv >= 0) {
+        lookup->mq = NULL;
+        lookup->tc_serv = tcp_add_serv(&self->tcp, (struct sockaddr*)&self->mmsg.servs[serv],
+                                       self->mmsg.servlens[serv]);
+        if (lookup_retry_tcp(lookup)) {
+            return;
+        }
+    }
+    on_lookup_reply(data, qdn, pkt, cur, end, status);
+}
+
+static void
+on_tcp_reply (void *data, dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status) {
+    lookup_trace_reply(data, status);
+    on_lookup_reply(data, qdn, pkt, cur, end, status);
+}
+
+// Sends new lookup through udns or TRANSPORT_MMSG. Returns 0 or DNS_E_*.
+static int
+lookup_submit (Resolver *self, Lookup *lookup, const char *name, int qclass, int qtype) {
+    dnsc_t dn[DNS_MAXDN];
+    int isabs, status;
+
+    PYUDNS_PROBE4(submit, lookup, lookup->qname, qtype, stats_now());
+    if (self->mmsg.fd >= 0) {
+        if (dns_ptodn(name, 0, dn, sizeof(dn), &isabs) <= 0) {
+            return DNS_E_BADQUERY;
+        }
+        lookup->mq = mmsg_submit(&self->mmsg, dn, qclass, qtype, lookup->flags, on_mmsg_reply, lookup);
+        return NULL == lookup->mq ? self->mmsg.status : 0;
+    }
+
+    if (DNS_T_A == lookup->qtype) {
+        lookup->q = dns_submit_a4(self->ctx, name, lookup->flags, on_dns_resolve_a4, (void*)lookup);
+    } else if (DNS_T_AAAA == lookup->qtype) {
+        lookup->q = dns_submit_a6(self->ctx, name, lookup->flags, on_dns_resolve_a6, (void*)lookup);
+    } else if (DNS_T_PTR == lookup->qtype) {
+        lookup->q = dns_submit_p(self->ctx, name, DNS_C_IN, DNS_T_PTR, lookup->flags,
+                                 dns_parse_ptr, on_dns_resolve_ptr, (void*)lookup);
+    } else {
+        lookup->q = dns_submit_p(self->ctx, name, qclass, qtype, lookup->flags,
+                                 raw_parse, on_dns_resolve_raw, (void*)lookup);
+    }
+    if (NULL == lookup->q) {
+        status = dns_status(self->ctx);
+        return status < 0 ? status : DNS_E_BADQUERY;
+    }
+    return 0;
+}
+
+// Resolver.submit(name, qclass, qtype, callback, data=None, flags=0, priority=0) -> Query
+PyDoc_STRVAR(Resolver_submit_doc, "\
+submit(name, qclass, qtype, callback, data=None, flags=0, priority=0) -> Query\n\
+\n\
+Submits query of any class and type, e.g. submit(name, C_IN, T_MX, cb).\n\
+`callback(rr, data)` gets RR object with the raw answer, or None on error.\n\
+RR supports buffer protocol to read the reply packet without copy, and\n\
+sequence protocol to decode records one by one on access. Answers are not\n\
+cached, identical queries in flight are shared. See submit_a4() for\n\
+`priority`.\n\
+With callback None the RR or None is queued for drain() instead.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_submit (Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    const char *name;
+    char qname[CACHE_MAXNAME];
+    PyObject *cb, *cb_data = Py_None;
+    Query *query;
+    Lookup *lookup;
+    unsigned hash;
+    int qclass, qtype, key, flags = 0, priority = 0, len, status = 0;
+
+    if (fastcall_parse(args, nargs, "siiO|Oii", "Resolver.submit(name, qclass, qtype, callback, data=None, flags=0, priority=0) wrong arguments.",
+                       &name, &qclass, &qtype, &cb, &cb_data, &flags, &priority) < 0) {
+        return NULL;
+    }
+    if (!cb || (Py_None != cb && !PyCallable_Check(cb))) {
+        PyErr_SetString(PyExc_TypeError, "'callback' is not callable or None.");
+        return NULL;
+    }
+    if (qclass < 0 || qclass > 0xffff || qtype < 0 || qtype > 0xffff) {
+        PyErr_SetString(PyExc_ValueError, "'qclass' and 'qtype' must be in range 0..65535.");
+        return NULL;
+    }
+
+    query = Query_create((PyObject*)self, cb, cb_data, flags);
+    if (NULL == query) {
+        return NULL;
+    }
+    query->slots = &query->slot;
+    query->nslots = 1;
+    query->npending = 1;
+    query->slot.query = (PyObject*)query;
+    query->slot.index = -1;
+    Py_INCREF(query);
+    slot_start(self, &query->slot);
+
+    flags &= ~PYUDNS_FLAGS_MASK;
+    key = PYUDNS_RAW_KEY(qclass, qtype);
+    len = cache_normalize(name, qname);
+    if (len < 0) {
+        status = DNS_E_BADQUERY;
+        goto fail;
+    }
+    hash = cache_hash(qname, key);
+    lookup = inflight_find(self, qname, key, flags, hash);
+    if (NULL == lookup) {
+        lookup = lookup_new(self, qname, len, hash, key, flags);
+        if (NULL == lookup) {
+            status = DNS_E_NOMEM;
+            goto fail;
+        }
+        lookup->priority = priority;
+        status = resolver_start_lookup(self, lookup, name, qclass, qtype);
+        if (0 != status) {
+            PyMem_Free(lookup);
+            goto fail;
+        }
+        inflight_add(self, lookup);
+    } else {
+        queue_raise(self, lookup, priority);
+    }
+    lookup_add_waiter(lookup, &query->slot);
+
+    return (PyObject*)query;
+
+fail:
+    // report failure through callback as well
+    if (0 != resolver_defer(self, &query->slot, NULL, status)) {
+        slot_complete(&query->slot, NULL, status);
+    }
+    return (PyObject*)query;
+}
+
+// Parses drain(max=None) argument, -1 means all.
+static int
+drain_max_from_args (PyObject *const *args, Py_ssize_t nargs, const char *usage, Py_ssize_t *max) {
+    PyObject *obj = Py_None;
+
+    if (fastcall_parse(args, nargs, "|O", usage, &obj) < 0) {
+        return -1;
+    }
+    *max = -1;
+    if (Py_None != obj) {
+        *max = PyLong_AsSsize_t(obj);
+        if (-1 == *max && PyErr_Occurred()) {
+            return -1;
+        }
+        if (*max < 0) {
+            PyErr_SetString(PyExc_ValueError, "'max' must be non-negative int or None.");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Resolver.drain(max=None) -> list
+PyDoc_STRVAR(Resolver_drain_doc, "\
+drain(max=None) -> list\n\
+\n\
+Returns [(query, result), ...] of queries submitted with callback None,\n\
+in completion order, at most `max` of them. `result` is what callback would\n\
+get, query.data and query.status are available as usual. Completions are\n\
+queued in C by ioevent()/run() without calling Python, so one drain() per\n\
+ioevent() is the only Python-level call however many replies arrived.\n\
+Undrained completions keep their queries and this resolver alive.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_drain (Resolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    PyObject *list;
+    Py_ssize_t max;
+
+    if (drain_max_from_args(args, nargs, "Resolver.drain(max=None) wrong arguments.", &max) < 0) {
+        return NULL;
+    }
+    list = PyList_New(0);
+    if (NULL == list || completion_drain(&self->completed, max, list) < 0) {
+        Py_XDECREF(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Resolver.stats() -> dict
+PyDoc_STRVAR(Resolver_stats_doc, "\
+stats() -> dict\n\
+\n\
+Snapshot of lookup counters since creation or reset_stats():\n\
+`submits`, `completions`, `cancels`, `timeouts` (E_TEMPFAIL completions),\n\
+`errors` dict of E_* code -> count, `inflight` and `inflight_peak` gauge,\n\
+`latency` dict of submit-to-completion microseconds: count, min, max, mean,\n\
+p50, p90, p99, p999 and `histogram`, tuple of (bucket upper bound, count)\n\
+for non-empty buckets. Percentiles are accurate within ~6%.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_stats (Resolver *self, PyObject *args) {
+    dns_stats *st = &self->stats;
+    PyObject *errors, *hist, *key, *item;
+    size_t i;
+    int code;
+
+    errors = PyDict_New();
+    hist = PyList_New(0);
+    if (NULL == errors || NULL == hist) {
+        goto error;
+    }
+    for (code = 1; code < STATS_NERRORS; code++) {
+        key = PyLong_FromLong(-code);
+        item = PyLong_FromUnsignedLongLong(st->errors[code]);
+        if (NULL == key || NULL == item || PyDict_SetItem(errors, key, item) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(key);
+        Py_DECREF(item);
+    }
+    if (st->errors[0] > 0) {
+        item = PyLong_FromUnsignedLongLong(st->errors[0]);
+        if (NULL == item || PyDict_SetItemString(errors, "other", item) < 0) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+    for (i = 0; i < STATS_NBUCKETS; i++) {
+        if (0 == st->buckets[i]) {
+            continue;
+        }
+        item = Py_BuildValue("(KK)", (unsigned long long)stats_bucket_max(i), st->buckets[i]);
+        if (NULL == item || PyList_Append(hist, item) < 0) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+    item = PyList_AsTuple(hist);
+    Py_DECREF(hist);
+    if (NULL == item) {
+        Py_DECREF(errors);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:N,s:l,s:l,s:{s:K,s:K,s:K,s:d,s:K,s:K,s:K,s:K,s:N}}",
+        "submits", st->submits,
+        "completions", st->completions,
+        "cancels", st->cancels,
+        "timeouts", st->timeouts,
+        "errors", errors,
+        "inflight", st->inflight,
+        "inflight_peak", st->inflight_peak,
+        "latency",
+            "count", st->latency_count,
+            "min", (unsigned long long)st->latency_min,
+            "max", (unsigned long long)st->latency_max,
+            "mean", st->latency_count ? (double)st->latency_sum / st->latency_count : 0.0,
+            "p50", (unsigned long long)stats_percentile(st, 0.5),
+            "p90", (unsigned long long)stats_percentile(st, 0.9),
+            "p99", (unsigned long long)stats_percentile(st, 0.99),
+            "p999", (unsigned long long)stats_percentile(st, 0.999),
+            "histogram", item);
+
+error:
+    Py_XDECREF(errors);
+    Py_XDECREF(hist);
+    return NULL;
+}
+
+// Resolver.reset_stats() -> None
+PyDoc_STRVAR(Resolver_reset_stats_doc, "\
+reset_stats()\n\
+\n\
+Clears counters and latency histogram. `inflight` keeps current value.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_reset_stats (Resolver *self, PyObject *args) {
+    stats_reset(&self->stats);
+
+    Py_RETURN_NONE;
+}
+
+// Resolver.cache_clear() -> None
+PyDoc_STRVAR(Resolver_cache_clear_doc, "\
+cache_clear()\n\
+\n\
+Drops all cached answers. Counters in cache_stats are kept.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_cache_clear (Resolver *self, PyObject *args) {
+    cache_clear(&self->cache);
+
+    Py_RETURN_NONE;
+}
+
+// Resolver.save_cache(path) -> int
+PyDoc_STRVAR(Resolver_save_cache_doc, "\
+save_cache(path) -> int\n\
+\n\
+Writes unexpired cached answers with their absolute expiry to snapshot\n\
+file `path` for load_cache(), atomically. Returns number of entries.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_save_cache (Resolver *self, PyObject *args) {
+    PyObject *obj, *path;
+    long n;
+
+    if (!PyArg_ParseTuple(args, "O", &obj)) {
+        PyErr_SetString(PyExc_TypeError, "Resolver.save_cache(path) takes 1 path argument.");
+        return NULL;
+    }
+    if (!PyUnicode_FSConverter(obj, &path)) {
+        return NULL;
+    }
+
+    n = cache_save(&self->cache, PyBytes_AS_STRING(path), time(NULL));
+    Py_DECREF(path);
+    if (n < 0) {
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, obj);
+    }
+    return PyLong_FromLong(n);
+}
+
+// Resolver.load_cache(path) -> int
+PyDoc_STRVAR(Resolver_load_cache_doc, "\
+load_cache(path) -> int\n\
+\n\
+Maps snapshot written by save_cache(), e.g. by previous process, and\n\
+answers from it on cache misses while its entries are valid. Records are\n\
+not parsed on load, one is copied into cache when it is first asked for.\n\
+Replaces previously loaded snapshot; cache_clear() drops it.\n\
+Needs cache_max_bytes set. Returns number of records in file.\n\
+Raises ValueError if file is not a snapshot of this version.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_load_cache (Resolver *self, PyObject *args) {
+    PyObject *obj, *path;
+    long n;
+
+    if (!PyArg_ParseTuple(args, "O", &obj)) {
+        PyErr_SetString(PyExc_TypeError, "Resolver.load_cache(path) takes 1 path argument.");
+        return NULL;
+    }
+    if (!PyUnicode_FSConverter(obj, &path)) {
+        return NULL;
+    }
+
+    n = cache_load(&self->cache, PyBytes_AS_STRING(path));
+    Py_DECREF(path);
+    if (n < 0 && EINVAL == errno) {
+        PyErr_Format(PyExc_ValueError, "%R is not a cache snapshot of this version.", obj);
+        return NULL;
+    }
+    if (n < 0) {
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, obj);
+    }
+    return PyLong_FromLong(n);
+}
+
+// Resolver.set_prefetch(fraction, min_hits=8, rate=10.0) -> None
+PyDoc_STRVAR(Resolver_set_prefetch_doc, "\
+set_prefetch(fraction, min_hits=8, rate=10.0)\n\
+\n\
+Enables refresh-ahead of hot cached A answers (see cache_max_bytes).\n\
+When submit_a4() hits an entry which was hit `min_hits` times and has\n\
+`fraction` (0..1) of its TTL passed, the answer is delivered from cache and\n\
+a background query replaces the entry before it expires. At most `rate`\n\
+refreshes per second are sent, due ones over budget wait for later hits.\n\
+fraction 0 disables it. See prefetches in cache_stats.\n\
+");
+
+/*@null@*/
+static PyObject*
+Resolver_set_prefetch (Resolver *self, PyObject *args) {
+    double fraction, rate = CACHE_PREFETCH_RATE;
+    int min_hits = CACHE_PREFETCH_MIN_HITS;
+
+    if (!PyArg_ParseTuple(args, "d|id", &fraction, &min_hits, &rate)) {
+        PyErr_SetString(PyExc_TypeError, "Resolver.set_prefetch(fraction, min_hits=8, rate=10.0) wrong arguments.");
+        return NULL;
+    }
+    if (!(fraction >= 0 && fraction <= 1) || min_hits < 0 || !(rate > 0)) {
+        PyErr_SetString(PyExc_ValueError, "'fraction' must be in 0..1, 'min_hits' >= 0 and 'rate' > 0.");
+        return NULL;
+    }
+
+    self->cache.prefetch_fraction = fraction;
+    self->cache.prefetch_min_hits = (unsigned)min_hits;
+    self->cache.prefetch_rate = rate;
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Resolver_methods[] = {
+    {"add_serv", (PyCFunction)Resolver_add_serv, METH_VARARGS, Resolver_add_serv_doc},
+    {"cache_clear", (PyCFunction)Resolver_cache_clear, METH_NOARGS, Resolver_cache_clear_doc},
+    {"cancel", (PyCFunction)(void(*)(void))Resolver_cancel, METH_FASTCALL, Resolver_cancel_doc},
+    {"close", (PyCFunction)Resolver_close, METH_NOARGS, Resolver_close_doc},
+    {"drain", (PyCFunction)(void(*)(void))Resolver_drain, METH_FASTCALL, Resolver_drain_doc},
+    {"ioevent", (PyCFunction)(void(*)(void))Resolver_ioevent, METH_FASTCALL, Resolver_ioevent_doc},
+    {"load_cache", (PyCFunction)Resolver_load_cache, METH_VARARGS, Resolver_load_cache_doc},
+    {"open", (PyCFunction)Resolver_open, METH_NOARGS, Resolver_open_doc},
+    {"reset_stats", (PyCFunction)Resolver_reset_stats, METH_NOARGS, Resolver_reset_stats_doc},
+    {"resolve_many", (PyCFunction)Resolver_resolve_many, METH_VARARGS, Resolver_resolve_many_doc},
+    {"run", (PyCFunction)Resolver_run, METH_VARARGS, Resolver_run_doc},
+    {"run_until_idle", (PyCFunction)Resolver_run_until_idle, METH_NOARGS, Resolver_run_until_idle_doc},
+    {"save_cache", (PyCFunction)Resolver_save_cache, METH_VARARGS, Resolver_save_cache_doc},
+    {"set_opts", (PyCFunction)Resolver_set_opts, METH_VARARGS, Resolver_set_opts_doc},
+    {"set_prefetch", (PyCFunction)Resolver_set_prefetch, METH_VARARGS, Resolver_set_prefetch_doc},
+    {"set_transport", (PyCFunction)Resolver_set_transport, METH_VARARGS, Resolver_set_transport_doc},
+    {"stats", (PyCFunction)Resolver_stats, METH_NOARGS, Resolver_stats_doc},
+    {"submit", (PyCFunction)(void(*)(void))Resolver_submit, METH_FASTCALL, Resolver_submit_doc},
+    {"submit_a4", (PyCFunction)(void(*)(void))Resolver_submit_a4, METH_FASTCALL, Resolver_submit_a4_doc},
+    {"submit_a4_many", (PyCFunction)(void(*)(void))Resolver_submit_a4_many, METH_FASTCALL, Resolver_submit_a4_many_doc},
+    {"submit_addr", (PyCFunction)(void(*)(void))Resolver_submit_addr, METH_FASTCALL, Resolver_submit_addr_doc},
+    {"submit_ptr_many", (PyCFunction)(void(*)(void))Resolver_submit_ptr_many, METH_FASTCALL, Resolver_submit_ptr_many_doc},
+    {"timeouts", (PyCFunction)(void(*)(void))Resolver_timeouts, METH_FASTCALL, Resolver_timeouts_doc},
+    {NULL} /* Sentinel */
+};
+
+static PyObject*
+Resolver_get_active(Resolver *self, void *closure) {
+    int active = resolver_pending(self);
+
+    return Py_BuildValue("i", active);
+}
+
+static PyObject*
+Resolver_get_sock(Resolver *self, void *closure) {
+    int sock = resolver_sock(self);
+
+    return Py_BuildValue("i", sock);
+}
+
+static PyObject*
+Resolver_get_status(Resolver *self, void *closure) {
+    int status = dns_status(self->ctx);
+
+    return Py_BuildValue("i", status);
+}
+
+static PyObject*
+Resolver_get_cache_max_bytes(Resolver *self, void *closure) {
+    return PyLong_FromSize_t(self->cache.max_bytes);
+}
+
+static int
+Resolver_set_cache_max_bytes(Resolver *self, PyObject *value, void *closure) {
+    Py_ssize_t max_bytes;
+
+    if (NULL == value) {
+        PyErr_SetString(PyExc_TypeError, "Can't delete cache_max_bytes.");
+        return -1;
+    }
+    max_bytes = PyNumber_AsSsize_t(value, PyExc_OverflowError);
+    if (-1 == max_bytes && PyErr_Occurred()) {
+        return -1;
+    }
+    if (max_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache_max_bytes must be >= 0.");
+        return -1;
+    }
+    cache_set_max_bytes(&self->cache, (size_t)max_bytes);
+    return 0;
+}
+
+static PyObject*
+Resolver_get_negative_ttl(Resolver *self, void *closure) {
+    return Py_BuildValue("I", self->negative_ttl);
+}
+
+static int
+Resolver_set_negative_ttl(Resolver *self, PyObject *value, void *closure) {
+    long ttl;
+
+    if (NULL == value) {
+        PyErr_SetString(PyExc_TypeError, "Can't delete negative_ttl.");
+        return -1;
+    }
+    ttl = PyLong_AsLong(value);
+    if (-1 == ttl && PyErr_Occurred()) {
+        return -1;
+    }
+    if (ttl < 0) {
+        PyErr_SetString(PyExc_ValueError, "negative_ttl must be >= 0.");
+        return -1;
+    }
+    self->negative_ttl = (unsigned)ttl;
+    return 0;
+}
+
+static PyObject*
+Resolver_get_max_inflight(Resolver *self, void *closure) {
+    return Py_BuildValue("i", self->max_inflight);
+}
+
+static int
+Resolver_set_max_inflight(Resolver *self, PyObject *value, void *closure) {
+    long max_inflight;
+
+    if (NULL == value) {
+        PyErr_SetString(PyExc_TypeError, "Can't delete max_inflight.");
+        return -1;
+    }
+    max_inflight = PyLong_AsLong(value);
+    if (-1 == max_inflight && PyErr_Occurred()) {
+        return -1;
+    }
+    if (max_inflight < 0 || max_inflight > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "max_inflight must be in range 0..INT_MAX.");
+        return -1;
+    }
+    self->max_inflight = (int)max_inflight;
+    resolver_release_queue(self);
+    return 0;
+}
+
+static PyObject*
+Resolver_get_queued(Resolver *self, void *closure) {
+    return PyLong_FromSize_t(self->queue_len);
+}
+
+static PyObject*
+Resolver_get_next_deadline(Resolver *self, void *closure) {
+    uint64_t deadline = resolver_next_deadline(self);
+
+    if (0 == deadline) {
+        Py_RETURN_NONE;
+    }
+    return PyFloat_FromDouble(deadline / 1e6);
+}
+
+static PyObject*
+Resolver_get_resolution_delay(Resolver *self, void *closure) {
+    if (self->addr_delay < 0) {
+        Py_RETURN_NONE;
+    }
+    return PyFloat_FromDouble(self->addr_delay);
+}
+
+static int
+Resolver_set_resolution_delay(Resolver *self, PyObject *value, void *closure) {
+    double delay;
+
+    if (NULL == value) {
+        PyErr_SetString(PyExc_TypeError, "Can't delete resolution_delay.");
+        return -1;
+    }
+    if (Py_None == value) {
+        self->addr_delay = -1.0;
+        return 0;
+    }
+    delay = PyFloat_AsDouble(value);
+    if (-1.0 == delay && PyErr_Occurred()) {
+        return -1;
+    }
+    if (delay < 0 || isnan(delay)) {
+        PyErr_SetString(PyExc_ValueError, "resolution_delay must be non-negative number or None.");
+        return -1;
+    }
+    self->addr_delay = delay;
+    return 0;
+}
+
+static PyObject*
+Resolver_get_hosts_file(Resolver *self, void *closure) {
+    if (NULL == self->hosts.path) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_DecodeFSDefault(self->hosts.path);
+}
+
+static int
+Resolver_set_hosts_file(Resolver *self, PyObject *value, void *closure) {
+    PyObject *path = NULL;
+    int r;
+
+    if (NULL == value) {
+        PyErr_SetString(PyExc_TypeError, "Can't delete hosts_file, set it to None.");
+        return -1;
+    }
+    if (Py_None != value && !PyUnicode_FSConverter(value, &path)) {
+        return -1;
+    }
+    r = hosts_set_path(&self->hosts, NULL == path ? NULL : PyBytes_AS_STRING(path));
+    if (r < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, value);
+    }
+    Py_XDECREF(path);
+    return r;
+}
+
+static PyObject*
+Resolver_get_hosts_stats(Resolver *self, void *closure) {
+    dns_hosts *h = &self->hosts;
+
+    return Py_BuildValue("{s:n,s:k,s:k}",
+                         "entries", (Py_ssize_t)h->count,
+                         "hits", h->hits,
+                         "reloads", h->reloads);
+}
+
+static PyObject*
+Resolver_get_cache_stats(Resolver *self, void *closure) {
+    dns_cache *c = &self->cache;
+
+    return Py_BuildValue("{s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:n,s:n,s:n}",
+                         "hits", c->hits,
+                         "misses", c->misses,
+                         "evictions", c->evictions,
+                         "prefetches", c->prefetches,
+                         "prefetch_throttled", c->prefetch_throttled,
+                         "snapshot_entries", (unsigned long)c->snap_count,
+                         "snapshot_hits", c->snap_hits,
+                         "entries", (Py_ssize_t)c->count,
+                         "bytes", (Py_ssize_t)c->bytes,
+                         "max_bytes", (Py_ssize_t)c->max_bytes);
+}
+
+/*@null@*/
+static PyObject*
+Resolver_get_server_stats(Resolver *self, void *closure) {
+    dns_mmsg *t = &self->mmsg;
+    mmsg_serv_stats *s;
+    const void *ip;
+    char addr[64];
+    PyObject *list, *item, *rtt;
+    int i, best;
+
+    list = PyList_New(0);
+    if (NULL == list || t->fd < 0) {
+        return list;
+    }
+    best = mmsg_best_serv(t);
+    for (i = 0; i < t->nservs; i++) {
+        s = &t->stats[i];
+        if (AF_INET6 == t->servs[i].ss_family) {
+            ip = &((struct sockaddr_in6*)&t->servs[i])->sin6_addr;
+        } else {
+            ip = &((struct sockaddr_in*)&t->servs[i])->sin_addr;
+        }
+        if (NULL == dns_ntop(t->servs[i].ss_family, ip, addr, sizeof(addr))) {
+            addr[0] = '\0';
+        }
+        if (0 == s->srtt) {
+            Py_INCREF(Py_None);
+            rtt = Py_None;
+        } else {
+            rtt = PyFloat_FromDouble(s->srtt / 1000);
+        }
+        // N steals rtt, also when building fails
+        item = Py_BuildValue("{s:s,s:N,s:d,s:O,s:k,s:k,s:k,s:k}",
+                             "address", addr,
+                             "rtt_ms", rtt,
+                             "failure_rate", s->fail,
+                             "preferred", i == best ? Py_True : Py_False,
+                             "sent", s->sent,
+                             "replies", s->replies,
+                             "timeouts", s->timeouts,
+                             "probes", s->probes);
+        if (NULL == item || PyList_Append(list, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return list;
+}
+
+static PyObject*
+Resolver_get_tcp_sock(Resolver *self, void *closure) {
+    // created on first use, -1 without epoll
+    return PyLong_FromLong(tcp_open(&self->tcp));
+}
+
+static PyObject*
+Resolver_get_tcp_stats(Resolver *self, void *closure) {
+    dns_tcp *t = &self->tcp;
+
+    return Py_BuildValue("{s:k,s:k,s:k,s:i,s:i}",
+                         "queries", t->queries,
+                         "connects", t->connects,
+                         "resends", t->resends,
+                         "connections", t->nconns,
+                         "active", t->active);
+}
+
+static PyGetSetDef Resolver_getseters[] = {
+    {"active", (getter)Resolver_get_active, NULL,
+        "TODO",
+        NULL},
+    {"cache_max_bytes", (getter)Resolver_get_cache_max_bytes, (setter)Resolver_set_cache_max_bytes,
+        "Memory cap of answer cache in bytes, least recently used answers are\n"
+        "evicted above it. 0 (default) disables cache.",
+        NULL},
+    {"cache_stats", (getter)Resolver_get_cache_stats, NULL,
+        "Dict of cache counters: hits, misses, evictions, prefetches, prefetch_throttled,\n"
+        "snapshot_entries, snapshot_hits, entries, bytes, max_bytes.",
+        NULL},
+    {"hosts_file", (getter)Resolver_get_hosts_file, (setter)Resolver_set_hosts_file,
+        "Path of hosts(5) file to answer submit_a4() and resolve_many() from,\n"
+        "e.g. \"/etc/hosts\". Names found there never reach udns, answer is\n"
+        "delivered on next tick like a cache hit. File is indexed in memory and\n"
+        "reloaded when it changes, checked at most once a second.\n"
+        "None (default) disables it, udns itself does not read hosts file.",
+        NULL},
+    {"hosts_stats", (getter)Resolver_get_hosts_stats, NULL,
+        "Dict of hosts file index counters: entries, hits, reloads.",
+        NULL},
+    {"max_inflight", (getter)Resolver_get_max_inflight, (setter)Resolver_set_max_inflight,
+        "Cap on queries sent and not answered yet. Lookups above it wait in\n"
+        "queue, highest priority first, and are sent as answers come in; cache\n"
+        "and hosts file answers and shared lookups are not held back. Queued\n"
+        "lookups count in active. 0 (default) means no limit.",
+        NULL},
+    {"negative_ttl", (getter)Resolver_get_negative_ttl, (setter)Resolver_set_negative_ttl,
+        "Seconds to cache NXDOMAIN and NODATA answers.",
+        NULL},
+    {"next_deadline", (getter)Resolver_get_next_deadline, NULL,
+        "time.monotonic() by which timeouts() should be called again, None if\n"
+        "nothing waits. Unlike timeouts() wait it is exact for resolution_delay\n"
+        "of submit_addr(); retransmits are as of last timeouts() call.",
+        NULL},
+    {"queued", (getter)Resolver_get_queued, NULL,
+        "Number of lookups waiting for room under max_inflight.",
+        NULL},
+    {"resolution_delay", (getter)Resolver_get_resolution_delay, (setter)Resolver_set_resolution_delay,
+        "Seconds submit_addr() waits for the second family once the first one\n"
+        "has addresses, 0.05 by default (RFC 8305). None waits for both answers.\n"
+        "run() ends it on time, timeouts() wait rounds it up to whole seconds,\n"
+        "next_deadline does not.",
+        NULL},
+    {"server_stats", (getter)Resolver_get_server_stats, NULL,
+        "List of dicts, one per nameserver of TRANSPORT_MMSG: address, rtt_ms\n"
+        "(smoothed, None until first reply), failure_rate (smoothed share of\n"
+        "timeouts and SERVFAIL/REFUSED, 0..1), preferred (new queries are sent\n"
+        "there first), sent, replies, timeouts, probes. Each new query starts at\n"
+        "the healthy server with lowest rtt_ms plus failure_rate times timeout,\n"
+        "servers with failure_rate 0.5 or above are probed by one query every\n"
+        "2 seconds. Empty with TRANSPORT_UDNS, udns tries servers in order.",
+        NULL},
+    {"sock", (getter)Resolver_get_sock, NULL,
+        "TODO",
+        NULL},
+    {"tcp_sock", (getter)Resolver_get_tcp_sock, NULL,
+        "Fd to watch for reading besides sock, readable when TCP connections\n"
+        "have replies for ioevent(). Answers truncated over UDP are asked again\n"
+        "over TCP from the same server, on up to 2 persistent connections per\n"
+        "server with queries pipelined. timeouts() covers their deadlines.\n"
+        "Without epoll it is -1, timeouts() then asks to be called every second.\n"
+        "run() watches it on its own. resolve_many() does not retry over TCP.",
+        NULL},
+    {"tcp_stats", (getter)Resolver_get_tcp_stats, NULL,
+        "Dict of TCP retry counters: queries, connects, resends (queries sent\n"
+        "again after server closed connection), connections, active.",
+        NULL},
+    {"status", (getter)Resolver_get_status, NULL,
+        "TODO",
+        NULL},
+    {NULL} /* Sentinel */
+};
+
+/* ResolverType */
+static PyTypeObject ResolverType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_udns.Resolver",                         /*tp_name*/
+    sizeof(Resolver),                         /*tp_basicsize*/
+    0,                                        /*tp_itemsize*/
+    (destructor)Resolver_dealloc,             /*tp_dealloc*/
+    0,                                        /*tp_print*/
+    0,                                        /*tp_getattr*/
+    0,                                        /*tp_setattr*/
+    0,                                        /*tp_as_async*/
+    0,                                        /*tp_repr*/
+    0,                                        /*tp_as_number*/
+    0,                                        /*tp_as_sequence*/
+    0,                                        /*tp_as_mapping*/
+    0,                                        /*tp_hash */
+    0,                                        /*tp_call*/
+    0,                                        /*tp_str*/
+    0,                                        /*tp_getattro*/
+    0,                                        /*tp_setattro*/
+    0,                                        /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    Resolver_doc,                             /*tp_doc*/
+    (traverseproc)Resolver_traverse,          /*tp_traverse*/
+    (inquiry)Resolver_clear,                  /*tp_clear*/
+    0,                                        /*tp_richcompare*/
+    0,                                        /*tp_weaklistoffset*/
+    0,                                        /*tp_iter*/
+    0,                                        /*tp_iternext*/
+    Resolver_methods,                         /*tp_methods*/
+    0,                                        /*tp_members*/
+    Resolver_getseters,                       /*tp_getsets*/
+    0,                                        /*tp_base*/
+    0,                                        /*tp_dict*/
+    0,                                        /*tp_descr_get*/
+    0,                                        /*tp_descr_set*/
+    offsetof(Resolver, __dict__),             /*tp_dictoffset*/
+    (initproc)Resolver_init,                  /*tp_init*/
+};
+
+// *************************************
+// Resolver ends
+// *************************************
+
+
+// *************************************
+// ResolverPool begins
+// *************************************
+
+PyDoc_STRVAR(ResolverPool_doc,
+"Pool of independent resolvers, each with own udns context and UDP socket.\n"
+"\n"
+"ResolverPool(size, balance=POOL_HASH) constructor.\n"
+"   # size: number of resolvers.\n"
+"   # balance: POOL_HASH sends same name to same resolver, so cache and\n"
+"       in-flight coalescing keep working. POOL_ROUND_ROBIN spreads evenly.\n"
+"\n"
+"Watch all `socks` with your poller and call ioevent(sock) for ready ones.\n"
+);
+
+static int
+ResolverPool_init(ResolverPool *self, PyObject *args) {
+    Py_ssize_t i, size;
+    int balance = PYUDNS_POOL_HASH;
+
+    if (!PyArg_ParseTuple(args, "n|i", &size, &balance)) {
+        PyErr_SetString(PyExc_TypeError, "ResolverPool(size, balance=POOL_HASH) wrong arguments. See help(ResolverPool) for details.");
+        return -1;
+    }
+    if (size < 1) {
+        PyErr_SetString(PyExc_ValueError, "ResolverPool() size must be positive.");
+        return -1;
+    }
+    if (PYUDNS_POOL_HASH != balance && PYUDNS_POOL_ROUND_ROBIN != balance) {
+        PyErr_SetString(PyExc_ValueError, "ResolverPool() balance must be POOL_HASH or POOL_ROUND_ROBIN.");
+        return -1;
+    }
+    if (NULL != self->resolvers) {
+        PyErr_SetString(PyExc_RuntimeError, "ResolverPool() is already initialized.");
+        return -1;
+    }
+
+    self->resolvers = PyMem_New(PyObject*, size);
+    if (NULL == self->resolvers) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        // Resolver(create_new=True, do_open=True)
+        self->resolvers[i] = PyObject_CallFunction((PyObject*)&ResolverType, "ii", 1, 1);
+        if (NULL == self->resolvers[i]) {
+            break;
+        }
+    }
+    self->size = i;
+    self->next = 0;
+    self->balance = balance;
+
+    return i == size ? 0 : -1;
+}
+
+static int
+ResolverPool_traverse (ResolverPool *self, visitproc visit, void *arg) {
+    Py_ssize_t i;
+
+    for (i = 0; i < self->size; i++) {
+        Py_VISIT(self->resolvers[i]);
+    }
+    return 0;
+}
+
+static void
+ResolverPool_dealloc(ResolverPool *self) {
+    Py_ssize_t i;
+
+    PyObject_GC_UnTrack(self);
+    for (i = 0; i < self->size; i++) {
+        Py_DECREF(self->resolvers[i]);
+    }
+    PyMem_Free(self->resolvers);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Resolver*
+pool_pick (PyObject *owner, const char *name) {
+    ResolverPool *self = (ResolverPool*)owner;
+    char qname[CACHE_MAXNAME];
+    Py_ssize_t i;
+
+    if (PYUDNS_POOL_ROUND_ROBIN == self->balance || cache_normalize(name, qname) < 0) {
+        i = self->next++;
+        if (self->next >= self->size) {
+            self->next = 0;
+        }
+    } else {
+        i = cache_hash(qname, DNS_T_A) % self->size;
+    }
+    return (Resolver*)self->resolvers[i];
+}
+
+// Pool methods check this, members are created in init.
+static int
+pool_check (ResolverPool *self) {
+    if (0 == self->size) {
+        PyErr_SetString(PyExc_RuntimeError, "ResolverPool is not initialized.");
+        return -1;
+    }
+    return 0;
+}
+
+// ResolverPool.cancel(query) -> None
+PyDoc_STRVAR(ResolverPool_cancel_doc, "\
+cancel(query)\n\
+\n\
+Same as query.cancel().\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_cancel(ResolverPool *self, PyObject *const *args, Py_ssize_t nargs) {
+    Query *query = NULL;
+
+    if (fastcall_parse(args, nargs, "O", "", &query) < 0 || !PyObject_TypeCheck(query, &QueryType)) {
+        PyErr_SetString(PyExc_TypeError, "ResolverPool.cancel(query) wrong arguments. Pass Query returned by submit_* methods.");
+        return NULL;
+    }
+
+    Query_do_cancel(query);
+
+    Py_RETURN_NONE;
+}
+
+// ResolverPool.drain(max=None) -> list
+PyDoc_STRVAR(ResolverPool_drain_doc, "\
+drain(max=None) -> list\n\
+\n\
+Resolver.drain() of every resolver, concatenated.\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_drain(ResolverPool *self, PyObject *const *args, Py_ssize_t nargs) {
+    PyObject *list;
+    Py_ssize_t i, n, max;
+
+    if (drain_max_from_args(args, nargs, "ResolverPool.drain(max=None) wrong arguments.", &max) < 0) {
+        return NULL;
+    }
+    list = PyList_New(0);
+    if (NULL == list) {
+        return NULL;
+    }
+    for (i = 0; i < self->size && 0 != max; i++) {
+        n = completion_drain(&((Resolver*)self->resolvers[i])->completed, max, list);
+        if (n < 0) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        if (max > 0) {
+            max -= n;
+        }
+    }
+    return list;
+}
+
+// ResolverPool.close() -> None
+PyDoc_STRVAR(ResolverPool_close_doc, "\
+close()\n\
+\n\
+Closes sockets of all resolvers, see Resolver.close().\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_close(ResolverPool *self, PyObject *args) {
+    Py_ssize_t i;
+
+    for (i = 0; i < self->size; i++) {
+        if (resolver_close((Resolver*)self->resolvers[i]) < 0) {
+            return NULL;
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+// ResolverPool.ioevent(sock=-1, now=0) -> None
+PyDoc_STRVAR(ResolverPool_ioevent_doc, "\
+ioevent(sock=-1, now=0)\n\
+\n\
+Processes replies on `sock` (one of `socks` or `tcp_socks`), or on all\n\
+sockets if it is -1. See Resolver.ioevent() for `now`.\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_ioevent(ResolverPool *self, PyObject *const *args, Py_ssize_t nargs) {
+    Resolver *resolver;
+    Py_ssize_t i;
+    long now = 0;
+    int sock = -1;
+
+    if (fastcall_parse(args, nargs, "|il", "ResolverPool.ioevent(sock=-1, now=0) wrong arguments.", &sock, &now) < 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < self->size; i++) {
+        resolver = (Resolver*)self->resolvers[i];
+        if (sock < 0 || resolver_sock(resolver) == sock) {
+            resolver_ioevent(resolver, now);
+        } else if (resolver->tcp.fd >= 0 && resolver->tcp.fd == sock) {
+            // epoll fd handed out by tcp_socks
+            tcp_ioevent(&resolver->tcp, now);
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+// ResolverPool.timeouts(maxwait, now=0) -> wait
+PyDoc_STRVAR(ResolverPool_timeouts_doc, "\
+timeouts(maxwait, now=0) -> wait\n\
+\n\
+Runs Resolver.timeouts() on every resolver, returns the shortest wait.\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_timeouts(ResolverPool *self, PyObject *const *args, Py_ssize_t nargs) {
+    Py_ssize_t i;
+    long now = 0;
+    int r, wait = -1, maxwait = 0;
+
+    if (fastcall_parse(args, nargs, "i|l", "ResolverPool.timeouts(maxwait, now=0) takes 2 int arguments: maxwait and current timestamp.",
+                       &maxwait, &now) < 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < self->size; i++) {
+        r = resolver_timeouts((Resolver*)self->resolvers[i], maxwait, now);
+        if (r >= 0 && (wait < 0 || r < wait)) {
+            wait = r;
+        }
+    }
+    if (wait < 0) {
+        wait = maxwait;
+    }
+
+    return Py_BuildValue("i", wait);
+}
+
+// ResolverPool.submit_a4(domain, callback, data=None, flags=0, priority=0) -> Query
+PyDoc_STRVAR(ResolverPool_submit_a4_doc, "\
+submit_a4(domain, callback, data=None, flags=0, priority=0) -> Query\n\
+\n\
+Submits to one of resolvers, see Resolver.submit_a4().\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_submit_a4(ResolverPool *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (pool_check(self) < 0) {
+        return NULL;
+    }
+    return submit_a4((PyObject*)self, pool_pick, args, nargs);
+}
+
+// ResolverPool.submit_a4_many(names, callback, data=None, flags=0, priority=0) -> Query
+PyDoc_STRVAR(ResolverPool_submit_a4_many_doc, "\
+submit_a4_many(names, callback, data=None, flags=0, priority=0) -> Query\n\
+\n\
+Spreads names of one batch over resolvers, see Resolver.submit_a4_many().\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_submit_a4_many(ResolverPool *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (pool_check(self) < 0) {
+        return NULL;
+    }
+    return submit_a4_many((PyObject*)self, pool_pick, args, nargs);
+}
+
+// ResolverPool.submit_addr(name, callback, data=None, family=AF_UNSPEC, flags=0, priority=0) -> Query
+PyDoc_STRVAR(ResolverPool_submit_addr_doc, "\
+submit_addr(name, callback, data=None, family=AF_UNSPEC, flags=0, priority=0) -> Query\n\
+\n\
+Submits both families to one of resolvers, see Resolver.submit_addr().\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_submit_addr(ResolverPool *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (pool_check(self) < 0) {
+        return NULL;
+    }
+    return submit_addr((PyObject*)self, pool_pick, args, nargs);
+}
+
+// ResolverPool.submit_ptr_many(addrs, family, callback, data=None, flags=0, priority=0) -> Query
+PyDoc_STRVAR(ResolverPool_submit_ptr_many_doc, "\
+submit_ptr_many(addrs, family, callback, data=None, flags=0, priority=0) -> Query\n\
+\n\
+Spreads addresses of one batch over resolvers, see Resolver.submit_ptr_many().\n\
+");
+
+/*@null@*/
+static PyObject*
+ResolverPool_submit_ptr_many(ResolverPool *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (pool_check(self) < 0) {
+        return NULL;
+    }
+    return submit_ptr_many((PyObject*)self, pool_pick, args, nargs);
+}
+
+static PyMethodDef ResolverPool_methods[] = {
+    {"cancel", (PyCFunction)(void(*)(void))ResolverPool_cancel, METH_FASTCALL, ResolverPool_cancel_doc},
+    {"close", (PyCFunction)ResolverPool_close, METH_NOARGS, ResolverPool_close_doc},
+    {"drain", (PyCFunction)(void(*)(void))ResolverPool_drain, METH_FASTCALL, ResolverPool_drain_doc},
+    {"ioevent", (PyCFunction)(void(*)(void))ResolverPool_ioevent, METH_FASTCALL, ResolverPool_ioevent_doc},
+    {"submit_a4", (PyCFunction)(void(*)(void))ResolverPool_submit_a4, METH_FASTCALL, ResolverPool_submit_a4_doc},
+    {"submit_a4_many", (PyCFunction)(void(*)(void))ResolverPool_submit_a4_many, METH_FASTCALL, ResolverPool_submit_a4_many_doc},
+    {"submit_addr", (PyCFunction)(void(*)(void))ResolverPool_submit_addr, METH_FASTCALL, ResolverPool_submit_addr_doc},
+    {"submit_ptr_many", (PyCFunction)(void(*)(void))ResolverPool_submit_ptr_many, METH_FASTCALL, ResolverPool_submit_ptr_many_doc},
+    {"timeouts", (PyCFunction)(void(*)(void))ResolverPool_timeouts, METH_FASTCALL, ResolverPool_timeouts_doc},
+    {NULL} /* Sentinel */
+};
+
+static PyObject*
+ResolverPool_get_active(ResolverPool *self, void *closure) {
+    Py_ssize_t i;
+    int active = 0;
+
+    for (i = 0; i < self->size; i++) {
+        active += resolver_pending((Resolver*)self->resolvers[i]);
+    }
+
+    return Py_BuildValue("i", active);
+}
+
+static PyObject*
+ResolverPool_get_next_deadline(ResolverPool *self, void *closure) {
+    Py_ssize_t i;
+    uint64_t d, deadline = 0;
+
+    for (i = 0; i < self->size; i++) {
+        d = resolver_next_deadline((Resolver*)self->resolvers[i]);
+        if (0 != d && (0 == deadline || d < deadline)) {
+            deadline = d;
+        }
+    }
+    if (0 == deadline) {
+        Py_RETURN_NONE;
+    }
+    return PyFloat_FromDouble(deadline / 1e6);
+}
+
+static PyObject*
+ResolverPool_get_queued(ResolverPool *self, void *closure) {
+    Py_ssize_t i;
+    size_t queued = 0;
+
+    for (i = 0; i < self->size; i++) {
+        queued += ((Resolver*)self->resolvers[i])->queue_len;
+    }
+
+    return PyLong_FromSize_t(queued);
+}
+
+static PyObject*
+ResolverPool_get_resolvers(ResolverPool *self, void *closure) {
+    PyObject *list;
+    Py_ssize_t i;
+
+    list = PyTuple_New(self->size);
+    if (NULL == list) {
+        return NULL;
+    }
+    for (i = 0; i < self->size; i++) {
+        Py_INCREF(self->resolvers[i]);
+        PyTuple_SET_ITEM(list, i, self->resolvers[i]);
+    }
+
+    return list;
+}
+
+static PyObject*
+ResolverPool_get_socks(ResolverPool *self, void *closure) {
+    PyObject *list;
+    Py_ssize_t i;
+
+    list = PyTuple_New(self->size);
+    if (NULL == list) {
+        return NULL;
+    }
+    for (i = 0; i < self->size; i++) {
+        PyTuple_SET_ITEM(list, i, PyLong_FromLong(resolver_sock((Resolver*)self->resolvers[i])));
+    }
+
+    return list;
+}
+
+static PyObject*
+ResolverPool_get_tcp_socks(ResolverPool *self, void *closure) {
+    PyObject *list;
+    Py_ssize_t i;
+
+    list = PyTuple_New(self->size);
+    if (NULL == list) {
+        return NULL;
+    }
+    for (i = 0; i < self->size; i++) {
+        // created on first use, -1 without epoll
+        PyTuple_SET_ITEM(list, i, PyLong_FromLong(tcp_open(&((Resolver*)self->resolvers[i])->tcp)));
+    }
+
+    return list;
+}
+
+static PyGetSetDef ResolverPool_getseters[] = {
+    {"active", (getter)ResolverPool_get_active, NULL,
+        "Number of pending queries in all resolvers.",
+        NULL},
+    {"next_deadline", (getter)ResolverPool_get_next_deadline, NULL,
+        "Earliest next_deadline of resolvers, None if nothing waits.",
+        NULL},
+    {"queued", (getter)ResolverPool_get_queued, NULL,
+        "Number of lookups waiting for room under max_inflight in all resolvers.",
+        NULL},
+    {"resolvers", (getter)ResolverPool_get_resolvers, NULL,
+        "Tuple of member Resolver objects.",
+        NULL},
+    {"socks", (getter)ResolverPool_get_socks, NULL,
+        "Tuple of UDP socket fds, one per resolver.",
+        NULL},
+    {"tcp_socks", (getter)ResolverPool_get_tcp_socks, NULL,
+        "Tuple of Resolver.tcp_sock fds, one per resolver. Watch them too,\n"
+        "truncated answers are retried over TCP.",
+        NULL},
+    {NULL} /* Sentinel */
+};
+
+/* ResolverPoolType */
+static PyTypeObject ResolverPoolType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_udns.ResolverPool",                     /*tp_name*/
+    sizeof(ResolverPool),                     /*tp_basicsize*/
+    0,                                        /*tp_itemsize*/
+    (destructor)ResolverPool_dealloc,         /*tp_dealloc*/
+    0,                                        /*tp_print*/
+    0,                                        /*tp_getattr*/
+    0,                                        /*tp_setattr*/
+    0,                                        /*tp_as_async*/
+    0,                                        /*tp_repr*/
+    0,                                        /*tp_as_number*/
+    0,                                        /*tp_as_sequence*/
+    0,                                        /*tp_as_mapping*/
+    0,                                        /*tp_hash */
+    0,                                        /*tp_call*/
+    0,                                        /*tp_str*/
+    0,                                        /*tp_getattro*/
+    0,                                        /*tp_setattro*/
+    0,                                        /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    ResolverPool_doc,                         /*tp_doc*/
+    (traverseproc)ResolverPool_traverse,      /*tp_traverse*/
+    0,                                        /*tp_clear*/
+    0,                                        /*tp_richcompare*/
+    0,                                        /*tp_weaklistoffset*/
+    0,                                        /*tp_iter*/
+    0,                                        /*tp_iternext*/
+    ResolverPool_methods,                     /*tp_methods*/
+    0,                                        /*tp_members*/
+    ResolverPool_getseters,                   /*tp_getsets*/
+    0,                                        /*tp_base*/
+    0,                                        /*tp_dict*/
+    0,                                        /*tp_descr_get*/
+    0,                                        /*tp_descr_set*/
+    0,                                        /*tp_dictoffset*/
+    (initproc)ResolverPool_init,              /*tp_init*/
+};
+
+// *************************************
+// ResolverPool ends
+// *************************************
+
+
+// *************************************
+// ThreadedResolver begins
+// *************************************
+
+PyDoc_STRVAR(ThreadedResolver_doc,
+"Resolver shared by threads, its udns context is driven by own native thread.\n"
+"\n"
+"ThreadedResolver(do_start=True) creates new udns context and, unless\n"
+"do_start is False, starts its I/O thread. Network I/O happens there\n"
+"without GIL; submits from any Python thread are handed over through\n"
+"a lock-free queue. Completions are signalled on `fd` (an eventfd), which is\n"
+"readable while some wait for ioevent()/drain(). Callbacks are called by\n"
+"the thread calling ioevent(), drain() or run(), never by the I/O thread.\n"
+"No cache and no sharing of identical queries in flight.\n"
+);
+
+static int
+ThreadedResolver_init(ThreadedResolver *self, PyObject *args) {
+    struct dns_ctx *ctx;
+    int do_start = 1;
+
+    if (!PyArg_ParseTuple(args, "|i", &do_start)) {
+        PyErr_SetString(PyExc_TypeError, "ThreadedResolver(do_start=True) wrong arguments. See help(ThreadedResolver) for details.");
+        return -1;
+    }
+    if (NULL != self->thread.ctx) {
+        PyErr_SetString(PyExc_RuntimeError, "ThreadedResolver() is already initialized.");
+        return -1;
+    }
+
+    ctx = dns_new(NULL);
+    if (NULL == ctx) {
+        PyErr_SetString(PyExc_MemoryError, "ThreadedResolver() failed to create new udns context.");
+        return -1;
+    }
+    if (dns_init(ctx, 0) < 0) {
+        dns_free(ctx);
+        PyErr_SetString(PyExc_Exception, "ThreadedResolver() failed to init udns context.");
+        return -1;
+    }
+    dns_set_dbgfn(ctx, NULL); // copied from default context, must not run on I/O thread
+    if (thread_init(&self->thread, ctx) < 0) {
+        dns_free(ctx);
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+
+    if (1 == do_start && thread_start(&self->thread) < 0) {
+        PyErr_SetString(PyExc_IOError, "ThreadedResolver() failed to open udns socket or start thread.");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+ThreadedResolver_traverse (ThreadedResolver *self, visitproc visit, void *arg) {
+    Py_VISIT(self->__dict__);
+    return completion_traverse(&self->completed, visit, arg);
+}
+
+static int
+ThreadedResolver_clear (ThreadedResolver *self) {
+    Py_CLEAR(self->__dict__);
+    completion_clear(&self->completed);
+    return 0;
+}
+
+static void
+ThreadedResolver_dealloc(ThreadedResolver *self) {
+    PyObject_GC_UnTrack(self);
+    // jobs own their queries and queries own the resolver: none is left here
+    if (NULL != self->thread.ctx) {
+        thread_free(&self->thread);
+    }
+    ThreadedResolver_clear(self);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// Methods which need the udns context unused by I/O thread check this.
+static int
+threaded_check_configurable (ThreadedResolver *self, const char *what) {
+    if (NULL == self->thread.ctx) {
+        PyErr_SetString(PyExc_RuntimeError, "ThreadedResolver is not initialized.");
+        return -1;
+    }
+    if (self->thread.started || self->closed) {
+        PyErr_Format(PyExc_RuntimeError, "ThreadedResolver.%s() called after start().", what);
+        return -1;
+    }
+    return 0;
+}
+
+// ThreadedResolver.add_serv(addr) -> int
+PyDoc_STRVAR(ThreadedResolver_add_serv_doc, "\
+add_serv(addr) -> int\n\
+\n\
+Same as Resolver.add_serv(), only allowed before start().\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_add_serv (ThreadedResolver *self, PyObject *args) {
+    const char *addr = NULL;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "z", &addr)) {
+        PyErr_SetString(PyExc_TypeError, "ThreadedResolver.add_serv(addr) takes 1 argument: IP address str or None.");
+        return NULL;
+    }
+    if (threaded_check_configurable(self, "add_serv") < 0) {
+        return NULL;
+    }
+
+    r = dns_add_serv(self->thread.ctx, addr);
+    if (r < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+
+    return Py_BuildValue("i", r);
+}
+
+// ThreadedResolver.set_opts(opts) -> None
+PyDoc_STRVAR(ThreadedResolver_set_opts_doc, "\
+set_opts(opts)\n\
+\n\
+Same as Resolver.set_opts(), only allowed before start().\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_set_opts (ThreadedResolver *self, PyObject *args) {
+    const char *opts;
+
+    if (!PyArg_ParseTuple(args, "s", &opts)) {
+        PyErr_SetString(PyExc_TypeError, "ThreadedResolver.set_opts(opts) takes 1 str argument.");
+        return NULL;
+    }
+    if (threaded_check_configurable(self, "set_opts") < 0) {
+        return NULL;
+    }
+
+    if (0 != dns_set_opts(self->thread.ctx, opts)) {
+        PyErr_SetString(PyExc_ValueError, "ThreadedResolver.set_opts() got unknown option.");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+// ThreadedResolver.start() -> fd
+PyDoc_STRVAR(ThreadedResolver_start_doc, "\
+start() -> fd\n\
+\n\
+Opens udns socket and starts I/O thread, see ThreadedResolver(do_start=False).\n\
+Returns completion fd, same as `fd`.\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_start (ThreadedResolver *self, PyObject *args) {
+    if (threaded_check_configurable(self, "start") < 0) {
+        return NULL;
+    }
+    if (thread_start(&self->thread) < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    return PyLong_FromLong(self->thread.done_fd);
+}
+
+// ThreadedResolver.close() -> None
+PyDoc_STRVAR(ThreadedResolver_close_doc, "\
+close()\n\
+\n\
+Stops I/O thread and closes udns socket. Queries still in flight complete\n\
+with E_TEMPFAIL on next ioevent()/drain(). Submits are refused from now on.\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_close (ThreadedResolver *self, PyObject *args) {
+    if (!self->closed) {
+        self->closed = true;
+        // join waits for I/O thread to leave poll()
+        Py_BEGIN_ALLOW_THREADS
+        thread_stop(&self->thread);
+        Py_END_ALLOW_THREADS
+        if (NULL != self->thread.ctx) {
+            dns_close(self->thread.ctx);
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+// Hands job of new query over to I/O thread. `query` is new reference,
+// it is returned or released on failure.
+/*@null@*/
+static PyObject*
+threaded_submit (ThreadedResolver *self, Query *query, const char *name,
+                 int qclass, int qtype, int flags, dns_parse_fn *parse) {
+    thread_job *job;
+
+    // close() joins I/O thread without GIL, `started` is still set meanwhile
+    if (self->closed || !self->thread.started) {
+        Py_DECREF(query);
+        PyErr_SetString(PyExc_RuntimeError, self->closed ? "ThreadedResolver is closed."
+                                                         : "ThreadedResolver is not started.");
+        return NULL;
+    }
+    job = thread_job_new(name, qclass, qtype, flags & ~PYUDNS_FLAGS_MASK, parse, query);
+    if (NULL == job) {
+        Py_DECREF(query);
+        return PyErr_NoMemory();
+    }
+    // job owns a reference to query until it is taken back
+    Py_INCREF(query);
+    query->job = job;
+    query->npending = 1;
+    self->active++;
+    thread_submit(&self->thread, job);
+    return (PyObject*)query;
+}
+
+// ThreadedResolver.submit_a4(domain, callback, data=None, flags=0) -> Query
+PyDoc_STRVAR(ThreadedResolver_submit_a4_doc, "\
+submit_a4(domain, callback, data=None, flags=0) -> Query\n\
+\n\
+Same as Resolver.submit_a4(), callable from any thread. Callback is called\n\
+by ioevent()/drain()/run(); with callback None result is queued for drain().\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_submit_a4 (ThreadedResolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    const char *name;
+    PyObject *cb, *cb_data = Py_None;
+    Query *query;
+    int flags = 0;
+
+    if (fastcall_parse(args, nargs, "sO|Oi", "ThreadedResolver.submit_a4(domain, callback, data=None, flags=0) wrong arguments.",
+                       &name, &cb, &cb_data, &flags) < 0) {
+        return NULL;
+    }
+    if (Py_None != cb && !PyCallable_Check(cb)) {
+        PyErr_SetString(PyExc_TypeError, "'callback' is not callable or None.");
+        return NULL;
+    }
+
+    query = Query_create((PyObject*)self, cb, cb_data, flags);
+    if (NULL == query) {
+        return NULL;
+    }
+    return threaded_submit(self, query, name, DNS_C_IN, DNS_T_A, flags, (dns_parse_fn*)dns_parse_a4);
+}
+
+// ThreadedResolver.submit(name, qclass, qtype, callback, data=None, flags=0) -> Query
+PyDoc_STRVAR(ThreadedResolver_submit_doc, "\
+submit(name, qclass, qtype, callback, data=None, flags=0) -> Query\n\
+\n\
+Same as Resolver.submit(), callable from any thread.\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_submit (ThreadedResolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    const char *name;
+    PyObject *cb, *cb_data = Py_None;
+    Query *query;
+    int qclass, qtype, flags = 0;
+
+    if (fastcall_parse(args, nargs, "siiO|Oi", "ThreadedResolver.submit(name, qclass, qtype, callback, data=None, flags=0) wrong arguments.",
+                       &name, &qclass, &qtype, &cb, &cb_data, &flags) < 0) {
+        return NULL;
+    }
+    if (Py_None != cb && !PyCallable_Check(cb)) {
+        PyErr_SetString(PyExc_TypeError, "'callback' is not callable or None.");
+        return NULL;
+    }
+    if (qclass < 0 || qclass > 0xffff || qtype < 0 || qtype > 0xffff) {
+        PyErr_SetString(PyExc_ValueError, "'qclass' and 'qtype' must be in range 0..65535.");
+        return NULL;
+    }
+
+    query = Query_create((PyObject*)self, cb, cb_data, flags);
+    if (NULL == query) {
+        return NULL;
+    }
+    return threaded_submit(self, query, name, qclass, qtype, flags, raw_parse);
+}
+
+// Builds result of completed job, NULL on error status.
+/*@null@*/
+static PyObject*
+threaded_result (ThreadedResolver *self, Query *query, thread_job *job) {
+    struct dns_rr_a4 *a4 = job->result;
+    RawRR *rr = job->result;
+
+    if (0 != job->status) {
+        return NULL;
+    }
+    if (raw_parse == job->parse) {
+        // RR owns the result from now
+        job->result = NULL;
+        return RRWrap_create((PyObject*)self, rr);
+    }
+    return addrs_build(DNS_T_A, a4->dnsa4_addr, a4->dnsa4_nrr, query->flags);
+}
+
+// Takes completed jobs back from I/O thread and delivers them in completion
+// order. Stops at first callback exception, the rest waits for next call.
+// Returns number of delivered queries.
+static Py_ssize_t
+threaded_deliver (ThreadedResolver *self) {
+    thread_job *job, *taken;
+    Query *query;
+    PyObject *args[2], *value, *r;
+    Py_ssize_t n = 0;
+
+    taken = thread_take(&self->thread);
+    if (NULL != taken) {
+        if (NULL == self->taken_tail) {
+            self->taken = taken;
+        } else {
+            self->taken_tail->next = taken;
+        }
+        for (job = taken; NULL != job->next; job = job->next) {
+        }
+        self->taken_tail = job;
+    }
+
+    while (NULL != (job = self->taken) && !PyErr_Occurred()) {
+        self->taken = job->next;
+        if (NULL == self->taken) {
+            self->taken_tail = NULL;
+        }
+        self->active--;
+        query = job->data;
+        query->job = NULL;
+        if (0 == query->npending) {
+            // cancelled
+            thread_job_free(job);
+            Py_DECREF(query);
+            continue;
+        }
+        value = threaded_result(self, query, job);
+        query->is_completed = true;
+        query->status = job->status;
+        query->npending = 0;
+        thread_job_free(job);
+        n++;
+        if (NULL == value) {
+            if (PyErr_Occurred()) {
+                // answer could not be wrapped, delivered as failure
+                PyErr_Clear();
+                query->status = DNS_E_NOMEM;
+            }
+            Py_INCREF(Py_None);
+            value = Py_None;
+        }
+        if (Py_None == query->callback) {
+            if (0 != completion_push(&self->completed, query, value)) {
+                completion_lost(query, value);
+            }
+            continue;
+        }
+        args[0] = value;
+        args[1] = query->data;
+        r = PyObject_Vectorcall(query->callback, args, 2, NULL);
+        Py_DECREF(value);
+        Py_XDECREF(r);
+        Py_DECREF(query);
+    }
+    return n;
+}
+
+// ThreadedResolver.ioevent() -> None
+PyDoc_STRVAR(ThreadedResolver_ioevent_doc, "\
+ioevent()\n\
+\n\
+Delivers completions signalled on `fd`: calls callbacks, queues results of\n\
+callback-less queries for drain(). Exception raised by a callback is\n\
+propagated, completions after it are delivered by next call.\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_ioevent (ThreadedResolver *self, PyObject *args) {
+    (void)threaded_deliver(self);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// ThreadedResolver.drain(max=None) -> list
+PyDoc_STRVAR(ThreadedResolver_drain_doc, "\
+drain(max=None) -> list\n\
+\n\
+Delivers new completions as ioevent() does, then returns queued ones\n\
+like Resolver.drain().\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_drain (ThreadedResolver *self, PyObject *const *args, Py_ssize_t nargs) {
+    PyObject *list;
+    Py_ssize_t max;
+
+    if (drain_max_from_args(args, nargs, "ThreadedResolver.drain(max=None) wrong arguments.", &max) < 0) {
+        return NULL;
+    }
+    (void)threaded_deliver(self);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    list = PyList_New(0);
+    if (NULL == list || completion_drain(&self->completed, max, list) < 0) {
+        Py_XDECREF(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Waits up to `timeout` seconds (< 0 forever) for `fd` to become readable,
+// without GIL. Returns 1 if it is, 0 on timeout, -1 with exception set.
+static int
+threaded_wait (ThreadedResolver *self, double timeout) {
+    struct pollfd pfd;
+    double deadline = -1.0, now;
+    int r, ms;
+
+    pfd.fd = self->thread.done_fd;
+    pfd.events = POLLIN;
+    if (timeout >= 0) {
+        deadline = ev_time() + timeout;
+    }
+    for (;;) {
+        ms = -1;
+        if (deadline >= 0) {
+            now = ev_time();
+            ms = now < deadline ? (int)ceil((deadline - now) * 1000) : 0;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        r = poll(&pfd, 1, ms);
+        Py_END_ALLOW_THREADS
+        if (r >= 0) {
+            return r > 0 ? 1 : 0;
+        }
+        if (EINTR != errno) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        if (PyErr_CheckSignals() < 0) {
+            return -1;
+        }
+    }
+}
+
+// ThreadedResolver.wait(timeout=None) -> bool
+PyDoc_STRVAR(ThreadedResolver_wait_doc, "\
+wait(timeout=None) -> bool\n\
+\n\
+Blocks without GIL until completions are signalled on `fd`, or `timeout`\n\
+seconds passed. Returns True if there is something for ioevent().\n\
+");
+
+/*@null@*/
+static PyObject*
+ThreadedResolver_wait (ThreadedResolver *self, PyObject *args) {
+    PyObject *timeout_obj = Py_None;
+    double timeout = -1.0;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "|O", &timeout_obj)) {
+        PyErr_SetString(PyExc_TypeError, "ThreadedResolver.wait(timeout=None) wrong arguments.");
+        return NULL;
+    }
+    if (timeout_from_object(timeout_obj, &timeout) < 0) {
+        return NULL;
+    }
+
+    r = threaded_wait(self, timeout);
+    if (r < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong(r);
+}
+
+// ThreadedResolver.run(timeout=None) -> bool
+PyDoc_STRVAR(ThreadedResolver_run_doc, "\
+run(timeout=None) -> bool\n\
+\n\
+Waits and delivers completions until all queries submitted so far, by any\n\
+thread, are done. Returns True when idle, False if `timeout` seconds passed.\n\
+Exception raised by a callback stops it and is propagated.\n\
+");
 
-    if (!PyArg_ParseTuple(args, "sO|Oi", &domain, &cb, &cb_data, &flags)) {
-        PyErr_SetString(PyExc_TypeError, "Resolver.submit_a4(domain, callback, data=None, flags=0) wrong arguments.");
+/*@null@*/
+static PyObject*
+ThreadedResolver_run (ThreadedResolver *self, PyObject *args) {
+    PyObject *timeout_obj = Py_None;
+    double timeout = -1.0, deadline = -1.0, now;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "|O", &timeout_obj)) {
+        PyErr_SetString(PyExc_TypeError, "ThreadedResolver.run(timeout=None) wrong arguments.");
         return NULL;
     }
-    if (!cb || !PyCallable_Check(cb)) {
-        PyErr_SetString(PyExc_TypeError, "'callback' is not callable.");
+    if (timeout_from_object(timeout_obj, &timeout) < 0) {
         return NULL;
     }
 
-    query = (Query*)PyObject_CallObject((PyObject*)&QueryType, NULL);
-    if (NULL == query) {
-        PyErr_SetString(PyExc_MemoryError, "Can't create Query object.");
-        return NULL;
+    if (timeout >= 0) {
+        deadline = ev_time() + timeout;
     }
-    Py_INCREF(self);
-    query->resolver = (PyObject*)self;
-    Py_INCREF(cb);
-    query->callback = cb;
-    Py_INCREF(cb_data);
-    query->data = cb_data;
-    Py_INCREF(query);
-    query->q = dns_submit_a4(self->ctx, domain, flags, on_dns_resolve_a4, (void*)query);
-
-    return (PyObject*)query;
+    while (self->active > 0 || NULL != self->taken) {
+        now = ev_time();
+        if (deadline >= 0 && now >= deadline) {
+            Py_RETURN_FALSE;
+        }
+        r = threaded_wait(self, deadline >= 0 ? deadline - now : -1.0);
+        if (r < 0) {
+            return NULL;
+        }
+        (void)threaded_deliver(self);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    Py_RETURN_TRUE;
 }
 
-static PyMethodDef Resolver_methods[] = {
-    {"cancel", (PyCFunction)Resolver_cancel, METH_VARARGS, Resolver_cancel_doc},
-    {"close", (PyCFunction)Resolver_close, METH_NOARGS, Resolver_close_doc},
-    {"ioevent", (PyCFunction)Resolver_ioevent, METH_VARARGS, Resolver_ioevent_doc},
-    {"submit_a4", (PyCFunction)Resolver_submit_a4, METH_VARARGS, Resolver_submit_a4_doc},
-    {"timeouts", (PyCFunction)Resolver_timeouts, METH_VARARGS, Resolver_timeouts_doc},
-    {NULL} /* Sentinel */
+static PyMethodDef ThreadedResolver_methods[] = {
+    {"add_serv", (PyCFunction)ThreadedResolver_add_serv, METH_VARARGS, ThreadedResolver_add_serv_doc},
+    {"close", (PyCFunction)ThreadedResolver_close, METH_NOARGS, ThreadedResolver_close_doc},
+    {"drain", (PyCFunction)(void(*)(void))ThreadedResolver_drain, METH_FASTCALL, ThreadedResolver_drain_doc},
+    {"ioevent", (PyCFunction)ThreadedResolver_ioevent, METH_NOARGS, ThreadedResolver_ioevent_doc},
+    {"run", (PyCFunction)ThreadedResolver_run, METH_VARARGS, ThreadedResolver_run_doc},
+    {"set_opts", (PyCFunction)ThreadedResolver_set_opts, METH_VARARGS, ThreadedResolver_set_opts_doc},
+    {"start", (PyCFunction)ThreadedResolver_start, METH_NOARGS, ThreadedResolver_start_doc},
+    {"submit", (PyCFunction)(void(*)(void))ThreadedResolver_submit, METH_FASTCALL, ThreadedResolver_submit_doc},
+    {"submit_a4", (PyCFunction)(void(*)(void))ThreadedResolver_submit_a4, METH_FASTCALL, ThreadedResolver_submit_a4_doc},
+    {"wait", (PyCFunction)ThreadedResolver_wait, METH_VARARGS, ThreadedResolver_wait_doc},
+    {NULL} // Sentinel
 };
 
 static PyObject*
-Resolver_get_active(Resolver *self, void *closure) {
-    int active = dns_active(self->ctx);
-
-    return Py_BuildValue("i", active);
-}
-
-static PyObject*
-Resolver_get_sock(Resolver *self, void *closure) {
-    int sock = dns_sock(self->ctx);
-
-    return Py_BuildValue("i", sock);
+ThreadedResolver_get_active(ThreadedResolver *self, void *closure) {
+    return PyLong_FromSsize_t(self->active);
 }
 
 static PyObject*
-Resolver_get_status(Resolver *self, void *closure) {
-    int status = dns_status(self->ctx);
-
-    return Py_BuildValue("i", status);
+ThreadedResolver_get_fd(ThreadedResolver *self, void *closure) {
+    return PyLong_FromLong(self->thread.done_fd);
 }
 
-static PyGetSetDef Resolver_getseters[] = {
-    {"active", (getter)Resolver_get_active, NULL,
-        "TODO",
-        NULL},
-    {"sock", (getter)Resolver_get_sock, NULL,
-        "TODO",
-        NULL},
-    {"status", (getter)Resolver_get_status, NULL,
-        "TODO",
-        NULL},
-    {NULL} /* Sentinel */
+static PyGetSetDef ThreadedResolver_getseters[] = {
+    {"active", (getter)ThreadedResolver_get_active, NULL,
+     "Number of queries submitted and not delivered yet.", NULL},
+    {"fd", (getter)ThreadedResolver_get_fd, NULL,
+     "eventfd readable while completions wait for ioevent(), e.g. for select() or add_reader().", NULL},
+    {NULL} // Sentinel
 };
 
-/* ResolverType */
-static PyTypeObject ResolverType = {
+static PyTypeObject ThreadedResolverType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "_udns.Resolver",                         /*tp_name*/
-    sizeof(Resolver),                         /*tp_basicsize*/
+    "_udns.ThreadedResolver",                 /*tp_name*/
+    sizeof(ThreadedResolver),                 /*tp_basicsize*/
     0,                                        /*tp_itemsize*/
-    (destructor)Resolver_dealloc,             /*tp_dealloc*/
+    (destructor)ThreadedResolver_dealloc,     /*tp_dealloc*/
     0,                                        /*tp_print*/
     0,                                        /*tp_getattr*/
     0,                                        /*tp_setattr*/
-    0,                                        /*tp_compare*/
+    0,                                        /*tp_as_async*/
     0,                                        /*tp_repr*/
     0,                                        /*tp_as_number*/
     0,                                        /*tp_as_sequence*/
@@ -346,27 +4663,27 @@ static PyTypeObject ResolverType = {
     0,                                        /*tp_getattro*/
     0,                                        /*tp_setattro*/
     0,                                        /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
-    Resolver_doc,                             /*tp_doc*/
-    0,                                        /*tp_traverse*/
-    0,                                        /*tp_clear*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    ThreadedResolver_doc,                     /*tp_doc*/
+    (traverseproc)ThreadedResolver_traverse,  /*tp_traverse*/
+    (inquiry)ThreadedResolver_clear,          /*tp_clear*/
     0,                                        /*tp_richcompare*/
     0,                                        /*tp_weaklistoffset*/
     0,                                        /*tp_iter*/
     0,                                        /*tp_iternext*/
-    Resolver_methods,                         /*tp_methods*/
+    ThreadedResolver_methods,                 /*tp_methods*/
     0,                                        /*tp_members*/
-    Resolver_getseters,                       /*tp_getsets*/
+    ThreadedResolver_getseters,               /*tp_getset*/
     0,                                        /*tp_base*/
     0,                                        /*tp_dict*/
     0,                                        /*tp_descr_get*/
     0,                                        /*tp_descr_set*/
-    offsetof(Resolver, __dict__),             /*tp_dictoffset*/
-    (initproc)Resolver_init,                  /*tp_init*/
+    offsetof(ThreadedResolver, __dict__),     /*tp_dictoffset*/
+    (initproc)ThreadedResolver_init,          /*tp_init*/
 };
 
 // *************************************
-// Resolver ends
+// ThreadedResolver ends
 // *************************************
 
 
@@ -378,35 +4695,126 @@ PyDoc_STRVAR(Query_doc, "\
 DNS Query\n\
 ");
 
-/*@null@*/ static PyObject *
-Query_new (PyTypeObject *type, PyObject *args, /*@unused@*/ PyObject *kwargs) {
+// Finished Query objects are kept here and reused by next submits,
+// saving allocator round trip per lookup. Only exact QueryType is recycled.
+static Query *query_freelist[PYUDNS_QUERY_FREELIST_MAX];
+static int query_numfree = 0;
+static int query_freelist_size = PYUDNS_QUERY_FREELIST_MAX;
+static unsigned long query_allocated = 0; // by tp_alloc
+static unsigned long query_reused = 0; // from freelist
+
+/*@null@*/ static Query*
+query_alloc (PyTypeObject *type) {
+    Query *self;
+
+    if (&QueryType == type && query_numfree > 0) {
+        self = query_freelist[--query_numfree];
+        // tp_alloc zeroes memory, do the same for recycled object
+        memset((char*)self + sizeof(PyObject), 0, sizeof(Query) - sizeof(PyObject));
+        (void)PyObject_INIT(self, type);
+        PyObject_GC_Track(self);
+        query_reused++;
+        return self;
+    }
+
+    self = (Query*)type->tp_alloc(type, 0);
+    if (NULL != self) {
+        query_allocated++;
+    }
+    return self;
+}
+
+// Query constructor for C code, no argument parsing.
+/*@null@*/ static Query*
+Query_create (PyObject *resolver, PyObject *callback, PyObject *data, int flags) {
     Query *self;
 
+    self = query_alloc(&QueryType);
+    if (NULL == self) {
+        return NULL;
+    }
+    Py_INCREF(resolver);
+    self->resolver = resolver;
+    Py_INCREF(callback);
+    self->callback = callback;
+    Py_INCREF(data);
+    self->data = data;
+    self->flags = flags & PYUDNS_FLAGS_MASK;
+
+    return self;
+}
+
+/*@null@*/ static PyObject *
+Query_new (PyTypeObject *type, PyObject *args, /*@unused@*/ PyObject *kwargs) {
     if (!PyArg_ParseTuple(args, "")) {
         return NULL;
     }
 
-    self = (Query*)type->tp_alloc(type, 0);
-    if (!self) { return NULL; }
+    return (PyObject*)query_alloc(type);
+}
 
-    self->resolver = NULL;
-    self->q = NULL;
-    self->callback = NULL;
-    self->data = NULL;
-    self->is_completed = false;
+static int
+Query_traverse (Query *self, visitproc visit, void *arg) {
+    Py_VISIT(self->resolver);
+    Py_VISIT(self->callback);
+    Py_VISIT(self->data);
+    Py_VISIT(self->results);
+    return 0;
+}
 
-    return (PyObject*)self;
+// Only completed queries can be garbage, pending ones hold reference to
+// themselves. `resolver` stays, Query methods rely on it.
+static int
+Query_clear (Query *self) {
+    Py_CLEAR(self->callback);
+    Py_CLEAR(self->data);
+    Py_CLEAR(self->results);
+    return 0;
 }
 
 static void
 Query_dealloc(Query *self)
 {
-    Py_DECREF(self->resolver);
-    Py_DECREF(self->callback);
-    Py_DECREF(self->data);
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->resolver);
+    Py_XDECREF(self->callback);
+    Py_XDECREF(self->data);
+    Py_XDECREF(self->results);
+    if (&self->slot != self->slots) {
+        PyMem_Free(self->slots);
+    }
+    if (&QueryType == Py_TYPE(self) && query_numfree < query_freelist_size) {
+        query_freelist[query_numfree++] = self;
+        return;
+    }
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
+// Cancels all pending names of self and drops their reference to it.
+static void
+Query_do_cancel(Query *self) {
+    Py_ssize_t i;
+
+    if (0 == self->npending) {
+        return;
+    }
+    if (NULL != self->job) {
+        // job keeps its reference until ThreadedResolver takes it back
+        thread_cancel(self->job);
+        self->npending = 0;
+        return;
+    }
+
+    if (0 != self->addr_deadline) {
+        addr_unlink(self);
+    }
+    for (i = 0; i < self->nslots; i++) {
+        slot_cancel(&self->slots[i]);
+    }
+    self->npending = 0;
+    Py_DECREF(self);
+}
+
 // Query.cancel(query) -> None
 PyDoc_STRVAR(Query_cancel_doc, "\
 TODO\n\
@@ -415,24 +4823,15 @@ TODO\n\
 /*@null@*/
 static PyObject*
 Query_cancel(Query *self, PyObject *args) {
-    if (!PyArg_ParseTuple(args, "")) {
-        PyErr_SetString(PyExc_TypeError, "Query.cancel() wrong arguments.");
-        return NULL;
-    }
-
     assert(NULL != self->resolver);
 
-    if (NULL != self->q) {
-        dns_cancel(((Resolver*)self->resolver)->ctx, self->q);
-        // q is invalid pointer afterwards, so we forget it
-        self->q = NULL;
-    }
+    Query_do_cancel(self);
 
     Py_RETURN_NONE;
 }
 
 static PyMethodDef Query_methods[] = {
-    {"cancel", (PyCFunction)Query_cancel, METH_VARARGS, Query_cancel_doc},
+    {"cancel", (PyCFunction)Query_cancel, METH_NOARGS, Query_cancel_doc},
     {NULL} // Sentinel
 };
 
@@ -457,8 +4856,19 @@ Query_is_completed_get (Query *self, /*@unused@*/ void *closure)
     else { Py_RETURN_FALSE; }
 }
 
+// Query.status -> int
+PyDoc_STRVAR(Query_status_doc,
+"0 or E_* error code of completed single name query. Callback only gets None on error.");
+
+/*@null@*/ static PyObject *
+Query_status_get (Query *self, /*@unused@*/ void *closure)
+{
+    return PyLong_FromLong(self->status);
+}
+
 static PyGetSetDef Query_getsets[] = {
     {"is_completed", (getter)Query_is_completed_get, NULL, Query_is_completed_doc, NULL},
+    {"status", (getter)Query_status_get, NULL, Query_status_doc, NULL},
     {NULL} // Sentinel
 };
 
@@ -472,7 +4882,7 @@ static PyTypeObject QueryType = {
     0,                                        /*tp_print*/
     0,                                        /*tp_getattr*/
     0,                                        /*tp_setattr*/
-    0,                                        /*tp_compare*/
+    0,                                        /*tp_as_async*/
     0,                                        /*tp_repr*/
     0,                                        /*tp_as_number*/
     0,                                        /*tp_as_sequence*/
@@ -483,10 +4893,10 @@ static PyTypeObject QueryType = {
     0,                                        /*tp_getattro*/
     0,                                        /*tp_setattro*/
     0,                                        /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
     Query_doc,                                /*tp_doc*/
-    0,                                        /*tp_traverse*/
-    0,                                        /*tp_clear*/
+    (traverseproc)Query_traverse,             /*tp_traverse*/
+    (inquiry)Query_clear,                     /*tp_clear*/
     0,                                        /*tp_richcompare*/
     0,                                        /*tp_weaklistoffset*/
     0,                                        /*tp_iter*/
@@ -498,7 +4908,7 @@ static PyTypeObject QueryType = {
     0,                                        /*tp_dict*/
     0,                                        /*tp_descr_get*/
     0,                                        /*tp_descr_set*/
-    offsetof(Query, __dict__),                /*tp_dictoffset*/
+    0,                                        /*tp_dictoffset*/
     0,                                        /*tp_init*/
     0,                                        /*tp_alloc*/
     Query_new,                                /*tp_new*/
@@ -514,48 +4924,159 @@ static PyTypeObject QueryType = {
 // *************************************
 
 PyDoc_STRVAR(RRWrap_doc,
-"DNS Result Record");
+"DNS Result Record, delivered by Resolver.submit().\n"
+"\n"
+"len(rr) is number of answer records, rr[i] decodes i-th record data:\n"
+"address str for A/AAAA, name for NS/CNAME/PTR, (preference, name) for MX,\n"
+"(priority, weight, port, target) for SRV, bytes of text for TXT, raw rdata\n"
+"bytes otherwise.\n"
+"Nothing is decoded before access. Buffer protocol gives the reply packet,\n"
+"e.g. memoryview(rr), without copying.\n"
+);
+
+// Takes ownership of `rr`, frees it on failure.
+/*@null@*/
+static PyObject*
+RRWrap_create (PyObject *resolver, RawRR *rr) {
+    RRWrap *self;
+
+    self = (RRWrap*)RRWrapType.tp_alloc(&RRWrapType, 0);
+    if (NULL == self) {
+        free(rr);
+        return NULL;
+    }
+    Py_INCREF(resolver);
+    self->resolver = resolver;
+    self->ctx = PyObject_TypeCheck(resolver, &ResolverType) ? ((Resolver*)resolver)->ctx : NULL;
+    self->rr = rr;
+    return (PyObject*)self;
+}
+
+static int
+RRWrap_traverse (RRWrap *self, visitproc visit, void *arg) {
+    Py_VISIT(self->__dict__);
+    Py_VISIT(self->resolver);
+    return 0;
+}
+
+static int
+RRWrap_clear (RRWrap *self) {
+    Py_CLEAR(self->__dict__);
+    return 0;
+}
+
+static void
+RRWrap_dealloc (RRWrap *self) {
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->__dict__);
+    Py_XDECREF(self->resolver);
+    free(self->rr);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int
+rrwrap_check (RRWrap *self) {
+    if (NULL == self->rr) {
+        PyErr_SetString(PyExc_ValueError, "RR holds no answer.");
+        return -1;
+    }
+    return 0;
+}
 
 static PyObject*
 RRWrap_get_query (RRWrap *self, void *closure) {
-    assert(NULL != self->rr);
+    if (rrwrap_check(self) < 0) {
+        return NULL;
+    }
 
-    return Py_BuildValue("s", self->rr->dnsn_qname);
+    return Py_BuildValue("s", self->rr->base.dnsn_qname);
 }
 
 static PyObject*
 RRWrap_get_cname (RRWrap *self, void *closure) {
-    assert(NULL != self->rr);
+    if (rrwrap_check(self) < 0) {
+        return NULL;
+    }
 
-    return Py_BuildValue("s", self->rr->dnsn_cname);
+    return Py_BuildValue("s", self->rr->base.dnsn_cname);
 }
 
 static PyObject*
 RRWrap_get_ttl (RRWrap *self, void *closure) {
-    assert(NULL != self->rr);
+    if (rrwrap_check(self) < 0) {
+        return NULL;
+    }
 
-    return Py_BuildValue("i", self->rr->dnsn_ttl);
+    return Py_BuildValue("i", self->rr->base.dnsn_ttl);
 }
 
 static PyObject*
 RRWrap_get_count (RRWrap *self, void *closure) {
-    assert(NULL != self->rr);
+    if (rrwrap_check(self) < 0) {
+        return NULL;
+    }
+
+    return Py_BuildValue("i", self->rr->base.dnsn_nrr);
+}
+
+static PyObject*
+RRWrap_get_qclass (RRWrap *self, void *closure) {
+    if (rrwrap_check(self) < 0) {
+        return NULL;
+    }
+
+    return Py_BuildValue("i", self->rr->qclass);
+}
+
+static PyObject*
+RRWrap_get_qtype (RRWrap *self, void *closure) {
+    if (rrwrap_check(self) < 0) {
+        return NULL;
+    }
+
+    return Py_BuildValue("i", self->rr->qtype);
+}
+
+static PyObject*
+RRWrap_get_types (RRWrap *self, void *closure) {
+    PyObject *list;
+    int i;
 
-    return Py_BuildValue("i", self->rr->dnsn_nrr);
+    if (rrwrap_check(self) < 0) {
+        return NULL;
+    }
+
+    list = PyTuple_New(self->rr->base.dnsn_nrr);
+    if (NULL == list) {
+        return NULL;
+    }
+    for (i = 0; i < self->rr->base.dnsn_nrr; i++) {
+        PyTuple_SET_ITEM(list, i, PyLong_FromLong(self->rr->records[i].type));
+    }
+    return list;
 }
 
 static PyGetSetDef RRWrap_getseters[] = {
     {"query", (getter)RRWrap_get_query, NULL,
-        "TODO",
+        "Queried name, str.",
         NULL},
     {"cname", (getter)RRWrap_get_cname, NULL,
-        "TODO",
+        "Canonical name if answer followed CNAME, or None.",
         NULL},
     {"ttl", (getter)RRWrap_get_ttl, NULL,
-        "TODO",
+        "Lowest TTL of answer records, int seconds.",
         NULL},
     {"count", (getter)RRWrap_get_count, NULL,
-        "TODO",
+        "Number of answer records, same as len().",
+        NULL},
+    {"qclass", (getter)RRWrap_get_qclass, NULL,
+        "Query class, C_* int.",
+        NULL},
+    {"qtype", (getter)RRWrap_get_qtype, NULL,
+        "Query type, T_* int.",
+        NULL},
+    {"types", (getter)RRWrap_get_types, NULL,
+        "Tuple of record types, useful for T_ANY queries.",
         NULL},
     {NULL} /* Sentinel */
 };
@@ -563,36 +5084,160 @@ static PyGetSetDef RRWrap_getseters[] = {
 /*@null@*/
 static PyObject*
 RRWrap_str(RRWrap *self) {
-    assert(NULL != self->rr);
+    if (NULL == self->rr) {
+        return Py_BuildValue("s", "");
+    }
+
+    return PyUnicode_FromFormat("%s ttl=%u count=%d", self->rr->base.dnsn_qname,
+                               self->rr->base.dnsn_ttl, self->rr->base.dnsn_nrr);
+}
+
+static Py_ssize_t
+RRWrap_length (RRWrap *self) {
+    return NULL == self->rr ? 0 : self->rr->base.dnsn_nrr;
+}
+
+// Decodes compressed domain name at *cur, advances *cur past it.
+/*@null@*/
+static PyObject*
+rr_decode_dn (RawRR *rr, dnscc_t **cur) {
+    dnsc_t dn[DNS_MAXDN];
+    char name[DNS_MAXNAME];
+
+    if (dns_getdn(rr->pkt, cur, rr->pkt + rr->plen, dn, sizeof(dn)) <= 0 ||
+        dns_dntop(dn, name, sizeof(name)) <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Malformed domain name in record.");
+        return NULL;
+    }
+    return Py_BuildValue("s", name);
+}
+
+/*@null@*/
+static PyObject*
+RRWrap_item (RRWrap *self, Py_ssize_t i) {
+    RawRecord *rec;
+    dnscc_t *cur, *end;
+    PyObject *name, *value;
+    char buf[INET6_ADDRSTRLEN + 1];
+    char *out;
+    unsigned n;
+
+    if (NULL == self->rr || i < 0 || i >= self->rr->base.dnsn_nrr) {
+        PyErr_SetString(PyExc_IndexError, "RR index out of range");
+        return NULL;
+    }
+    rec = &self->rr->records[i];
+    cur = self->rr->pkt + rec->offset;
+    end = cur + rec->length;
+
+    switch (rec->type) {
+    case DNS_T_A:
+    case DNS_T_AAAA:
+        if (rec->length != (DNS_T_A == rec->type ? sizeof(struct in_addr) : sizeof(struct in6_addr))) {
+            break;
+        }
+        if (NULL == dns_ntop(DNS_T_A == rec->type ? AF_INET : AF_INET6, cur, buf, sizeof(buf))) {
+            break;
+        }
+        return Py_BuildValue("s", buf);
+    case DNS_T_NS:
+    case DNS_T_CNAME:
+    case DNS_T_PTR:
+        return rr_decode_dn(self->rr, &cur);
+    case DNS_T_MX:
+        if (rec->length < 3) {
+            break;
+        }
+        n = dns_get16(cur);
+        cur += 2;
+        name = rr_decode_dn(self->rr, &cur);
+        if (NULL == name) {
+            return NULL;
+        }
+        return Py_BuildValue("(IN)", n, name);
+    case DNS_T_SRV:
+        if (rec->length < 7) {
+            break;
+        }
+        cur += 6;
+        name = rr_decode_dn(self->rr, &cur);
+        if (NULL == name) {
+            return NULL;
+        }
+        cur = self->rr->pkt + rec->offset;
+        return Py_BuildValue("(IIIN)", dns_get16(cur), dns_get16(cur + 2), dns_get16(cur + 4), name);
+    case DNS_T_TXT:
+        // character-strings are joined, as udns dns_parse_txt() does
+        for (n = 0; cur < end; cur += *cur + 1) {
+            n += *cur;
+        }
+        if (cur != end) {
+            break;
+        }
+        value = PyBytes_FromStringAndSize(NULL, n);
+        if (NULL == value) {
+            return NULL;
+        }
+        out = PyBytes_AS_STRING(value);
+        for (cur = self->rr->pkt + rec->offset; cur < end; cur += *cur + 1) {
+            memcpy(out, cur + 1, *cur);
+            out += *cur;
+        }
+        return value;
+    default:
+        return PyBytes_FromStringAndSize((const char*)cur, rec->length);
+    }
+
+    PyErr_SetString(PyExc_ValueError, "Malformed record data.");
+    return NULL;
+}
+
+static PySequenceMethods RRWrap_as_sequence = {
+    (lenfunc)RRWrap_length,                   /*sq_length*/
+    0,                                        /*sq_concat*/
+    0,                                        /*sq_repeat*/
+    (ssizeargfunc)RRWrap_item,                /*sq_item*/
+};
 
-    return Py_BuildValue("s", "");
+// Buffer protocol exposes the reply packet, read-only.
+static int
+RRWrap_getbuffer (RRWrap *self, Py_buffer *view, int flags) {
+    if (rrwrap_check(self) < 0) {
+        return -1;
+    }
+    return PyBuffer_FillInfo(view, (PyObject*)self, self->rr->pkt, self->rr->plen, 1, flags);
 }
 
+static PyBufferProcs RRWrap_as_buffer = {
+    (getbufferproc)RRWrap_getbuffer,          /*bf_getbuffer*/
+    0,                                        /*bf_releasebuffer*/
+};
+
 /* RRWrapType */
 static PyTypeObject RRWrapType = {
     PyVarObject_HEAD_INIT(NULL, 0)
     "_udns.RR",                               /*tp_name*/
     sizeof(RRWrap),                           /*tp_basicsize*/
     0,                                        /*tp_itemsize*/
-    0,                                        /*tp_dealloc*/
+    (destructor)RRWrap_dealloc,               /*tp_dealloc*/
     0,                                        /*tp_print*/
     0,                                        /*tp_getattr*/
     0,                                        /*tp_setattr*/
-    0,                                        /*tp_compare*/
+    0,                                        /*tp_as_async*/
     0,                                        /*tp_repr*/
     0,                                        /*tp_as_number*/
-    0,                                        /*tp_as_sequence*/
+    &RRWrap_as_sequence,                      /*tp_as_sequence*/
     0,                                        /*tp_as_mapping*/
     0,                                        /*tp_hash */
     0,                                        /*tp_call*/
     (reprfunc)RRWrap_str,                     /*tp_str*/
     0,                                        /*tp_getattro*/
     0,                                        /*tp_setattro*/
-    0,                                        /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    &RRWrap_as_buffer,                        /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
     RRWrap_doc,                               /*tp_doc*/
-    0,                                        /*tp_traverse*/
-    0,                                        /*tp_clear*/
+    (traverseproc)RRWrap_traverse,            /*tp_traverse*/
+    (inquiry)RRWrap_clear,                    /*tp_clear*/
     0,                                        /*tp_richcompare*/
     0,                                        /*tp_weaklistoffset*/
     0,                                        /*tp_iter*/
@@ -635,26 +5280,75 @@ module_abi_version(PyObject *self, PyObject *args) {
     return Py_BuildValue("s", version);
 }
 
+PyDoc_STRVAR(module_query_freelist_stats_doc, "\
+query_freelist_stats() -> dict\n\
+\n\
+Query allocation counters: `allocated` new objects, `reused` from freelist,\n\
+`free` objects in freelist now, `size` freelist limit.\n\
+");
+
+/*@null@*/
+static PyObject*
+module_query_freelist_stats(PyObject *self, PyObject *args) {
+    return Py_BuildValue("{s:k,s:k,s:i,s:i}",
+                         "allocated", query_allocated,
+                         "reused", query_reused,
+                         "free", query_numfree,
+                         "size", query_freelist_size);
+}
+
+PyDoc_STRVAR(module_set_query_freelist_size_doc, "\
+set_query_freelist_size(size)\n\
+\n\
+Limits number of finished Query objects kept for reuse, 0 disables freelist.\n\
+");
+
+/*@null@*/
+static PyObject*
+module_set_query_freelist_size(PyObject *self, PyObject *args) {
+    int size;
+    Query *query;
+
+    if (!PyArg_ParseTuple(args, "i", &size)) {
+        return NULL;
+    }
+    if (size < 0 || size > PYUDNS_QUERY_FREELIST_MAX) {
+        PyErr_Format(PyExc_ValueError, "size must be in range 0..%d.", PYUDNS_QUERY_FREELIST_MAX);
+        return NULL;
+    }
+
+    query_freelist_size = size;
+    while (query_numfree > size) {
+        query = query_freelist[--query_numfree];
+        QueryType.tp_free((PyObject*)query);
+    }
+
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef module_methods[] = {
     {"get_version", (PyCFunction)module_abi_version, METH_NOARGS, module_abi_version_doc},
+    {"query_freelist_stats", (PyCFunction)module_query_freelist_stats, METH_NOARGS, module_query_freelist_stats_doc},
+    {"set_query_freelist_size", (PyCFunction)module_set_query_freelist_size, METH_VARARGS, module_set_query_freelist_size_doc},
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
-PyMODINIT_FUNC
-init_udns(void) {
+// Multi-phase init (PEP 489). Types are static and the Query freelist is
+// process wide, like CPython own freelists, so module has no state of its own.
+static int
+module_exec(PyObject *module) {
     // init types
     ResolverType.tp_new = PyType_GenericNew;
+    ResolverPoolType.tp_new = PyType_GenericNew;
+    ThreadedResolverType.tp_new = PyType_GenericNew;
     RRWrapType.tp_new = PyType_GenericNew;
     if (PyType_Ready(&ResolverType) ||
+        PyType_Ready(&ResolverPoolType) ||
+        PyType_Ready(&ThreadedResolverType) ||
         PyType_Ready(&QueryType) ||
         PyType_Ready(&RRWrapType)
        )
-        return;
-
-    // init module
-    module = Py_InitModule("_udns", module_methods);
-    if (NULL == module)
-        return;
+        return -1;
 
     PyModule_AddIntConstant(module, "E_TEMPFAIL", DNS_E_TEMPFAIL);
     PyModule_AddIntConstant(module, "E_PROTOCOL", DNS_E_PROTOCOL);
@@ -663,12 +5357,59 @@ init_udns(void) {
     PyModule_AddIntConstant(module, "E_NOMEM",    DNS_E_NOMEM);
     PyModule_AddIntConstant(module, "E_BADQUERY", DNS_E_BADQUERY);
 
-    Py_INCREF(&ResolverType);
-    PyModule_AddObject(module, "Resolver", (PyObject*)&ResolverType);
-    Py_INCREF(&QueryType);
-    PyModule_AddObject(module, "Query", (PyObject*)&QueryType);
-    Py_INCREF(&RRWrapType);
-    PyModule_AddObject(module, "RR", (PyObject*)&RRWrapType);
+    PyModule_AddIntConstant(module, "C_IN",  DNS_C_IN);
+    PyModule_AddIntConstant(module, "C_CH",  DNS_C_CH);
+    PyModule_AddIntConstant(module, "C_ANY", DNS_C_ANY);
+
+    PyModule_AddIntConstant(module, "T_A",     DNS_T_A);
+    PyModule_AddIntConstant(module, "T_NS",    DNS_T_NS);
+    PyModule_AddIntConstant(module, "T_CNAME", DNS_T_CNAME);
+    PyModule_AddIntConstant(module, "T_SOA",   DNS_T_SOA);
+    PyModule_AddIntConstant(module, "T_PTR",   DNS_T_PTR);
+    PyModule_AddIntConstant(module, "T_MX",    DNS_T_MX);
+    PyModule_AddIntConstant(module, "T_TXT",   DNS_T_TXT);
+    PyModule_AddIntConstant(module, "T_AAAA",  DNS_T_AAAA);
+    PyModule_AddIntConstant(module, "T_SRV",   DNS_T_SRV);
+    PyModule_AddIntConstant(module, "T_ANY",   DNS_T_ANY);
+
+    PyModule_AddIntConstant(module, "RESULT_PACKED", PYUDNS_RESULT_PACKED);
+    PyModule_AddIntConstant(module, "POOL_HASH", PYUDNS_POOL_HASH);
+    PyModule_AddIntConstant(module, "POOL_ROUND_ROBIN", PYUDNS_POOL_ROUND_ROBIN);
+
+    PyModule_AddIntConstant(module, "TRANSPORT_UDNS", PYUDNS_TRANSPORT_UDNS);
+    PyModule_AddIntConstant(module, "TRANSPORT_MMSG", PYUDNS_TRANSPORT_MMSG);
+
+    if (PyModule_AddType(module, &ResolverType) ||
+        PyModule_AddType(module, &ResolverPoolType) ||
+        PyModule_AddType(module, &ThreadedResolverType) ||
+        PyModule_AddType(module, &QueryType) ||
+        PyModule_AddType(module, &RRWrapType)
+       )
+        return -1;
+
+    return 0;
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, module_exec},
+    {0, NULL} /* Sentinel */
+};
+
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    "_udns",                                  /*m_name*/
+    "Python binding to udns, asynchronous DNS resolver library.", /*m_doc*/
+    0,                                        /*m_size*/
+    module_methods,                           /*m_methods*/
+    module_slots,                             /*m_slots*/
+    NULL,                                     /*m_traverse*/
+    NULL,                                     /*m_clear*/
+    NULL,                                     /*m_free*/
+};
+
+PyMODINIT_FUNC
+PyInit__udns(void) {
+    return PyModuleDef_Init(&module_def);
 }
 
 // *************************************
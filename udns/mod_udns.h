@@ -8,32 +8,227 @@ extern "C" {
 #include <Python.h>
 #include <stdbool.h>
 
+#include <ev.h>
 #include <udns.h>
 
+#include "cache.h"
+#include "hosts.h"
+#include "mmsg.h"
+#include "probes.h"
+#include "stats.h"
+#include "tcp.h"
+#include "thread.h"
+
+// pyudns own submit flags. Must not clash with udns DNS_NOSRCH and friends,
+// they are stripped before flags are passed to udns.
+#define PYUDNS_RESULT_PACKED 0x40000000 // deliver raw 4-byte addresses as one bytes object
+#define PYUDNS_FLAGS_MASK    (PYUDNS_RESULT_PACKED)
+
+// Lookup key of generic Resolver.submit() queries, never equal to plain DNS_T_*
+// used by typed submits which deliver different result objects.
+#define PYUDNS_RAW_KEY(qclass, qtype) ((((qclass) + 1) << 16) | (qtype))
+
+#define PYUDNS_NEGATIVE_TTL 60 // default seconds to cache NXDOMAIN/NODATA
+#define PYUDNS_RESOLUTION_DELAY 0.05 // default seconds submit_addr() waits for second family (RFC 8305)
+#define PYUDNS_QUERY_FREELIST_MAX 1024 // recycled Query objects kept by module
+
+// ResolverPool balancing
+#define PYUDNS_POOL_HASH        0 // by name hash, same name always goes to same Resolver
+#define PYUDNS_POOL_ROUND_ROBIN 1
+
+// Resolver.set_transport()
+#define PYUDNS_TRANSPORT_UDNS 0 // udns sends and receives one datagram per syscall
+#define PYUDNS_TRANSPORT_MMSG 1 // own sendmmsg/recvmmsg transport, see mmsg.h
+
+
+typedef struct Deferred Deferred;
+typedef struct Lookup Lookup;
+typedef struct Query Query;
+
+// Completion of query submitted with callback None, waiting for Resolver.drain().
+typedef struct {
+    PyObject *query;
+    PyObject *value; // result passed to callback otherwise
+} Completion;
+
+// FIFO of Completions, grows as needed.
+typedef struct {
+    Completion *items;
+    size_t cap;
+    size_t head;
+    size_t count;
+} CompletionRing;
 
 typedef struct {
     PyObject_HEAD
     PyObject *__dict__;
     struct dns_ctx *ctx;
     int fd;
+    // run() event loop, created on first use
+    struct ev_loop *loop;
+    ev_io io_watcher;
+    ev_timer retry_watcher; // udns timeouts, armed from dns_set_tmcbck
+    ev_timer deadline_watcher; // run(timeout)
+    ev_check signal_watcher;
+    ev_prepare deferred_watcher; // delivers deferred completions
+    ev_idle deferred_idle; // keeps poll from blocking while some are queued
+    ev_io tcp_watcher; // tcp.fd
+    ev_timer tcp_timer; // tcp deadlines, armed before poll while queries are active
+    ev_timer addr_timer; // resolution delay of addr_head, armed before poll
+    PyThreadState *thread_state; // saved while loop is blocked in poll
+    bool run_expired;
+    // answer cache
+    dns_cache cache;
+    unsigned negative_ttl;
+    // in-flight lookups by (qname, qtype), duplicate submits wait on them
+    Lookup **inflight;
+    size_t inflight_size; // number of buckets, power of 2
+    size_t inflight_count;
+    // lookups waiting for room under max_inflight, binary heap, see queue_before()
+    int max_inflight; // 0 is unlimited
+    Lookup **queue;
+    size_t queue_len;
+    size_t queue_cap;
+    uint64_t queue_seq;
+    // completions waiting for next ioevent()/run() tick, FIFO
+    Deferred *deferred_head;
+    Deferred *deferred_tail;
+    Py_ssize_t ndeferred;
+    // submit_addr() queries with one family answered, by deadline
+    double addr_delay; // seconds, < 0 waits for both families
+    Query *addr_head;
+    Query *addr_tail;
+    uint64_t timeouts_deadline; // stats_now() of transport wait from last timeouts(), 0 if none
+    CompletionRing completed; // callback-less completions
+    dns_stats stats;
+    dns_mmsg mmsg; // socket I/O in TRANSPORT_MMSG mode, fd is -1 otherwise
+    dns_tcp tcp; // retries of answers truncated over UDP
+    dns_hosts hosts;
 } Resolver;
 
+// One name of a Query. Single queries embed one slot, batch queries own an array.
+typedef struct QuerySlot {
+    Lookup *lookup; // in-flight udns query, or NULL
+    struct QuerySlot *prev; // other waiters of the same lookup
+    struct QuerySlot *next;
+    Deferred *deferred; // queued completion, or NULL
+    PyObject *query; // owning Query, borrowed
+    Py_ssize_t index; // position in batch results, -1 for single query
+    Resolver *resolver; // which counts it in stats, borrowed
+    uint64_t submitted; // stats_now() at submit
+} QuerySlot;
+
+// In-flight udns query, passed to udns as callback data.
+// Every slot waiting for its answer is linked into `waiters`.
+struct Lookup {
+    Lookup *hnext; // Resolver.inflight chain
+    struct dns_query *q; // NULL once udns completed it
+    mmsg_query *mq; // same for TRANSPORT_MMSG
+    tcp_query *tq; // same for retry over TCP
+    int tc_serv; // tcp server which sent truncated answer, or -1
+    PyObject *resolver; // borrowed
+    QuerySlot *waiters; // in submit order
+    QuerySlot *waiters_tail;
+    unsigned hash;
+    int qtype; // DNS_T_*, or PYUDNS_RAW_KEY() for Resolver.submit()
+    int flags; // udns flags, lookups with different flags are not shared
+    int priority; // highest of its submitters
+    bool absolute; // submitted with trailing dot, kept for queued lookups
+    Py_ssize_t queue_index; // in Resolver.queue, -1 unless queued
+    uint64_t seq; // queue order among equal priorities
+    char qname[1]; // normalized
+};
+
+// Completion delivered on next ioevent()/run() tick instead of from udns,
+// e.g. cache hit.
+struct Deferred {
+    Deferred *next;
+    PyObject *resolver; // borrowed
+    QuerySlot *slot; // NULL if cancelled
+    PyObject *value; // result, NULL on error
+    int status;
+};
+
+// One name of Resolver.resolve_many(), filled by udns callbacks without GIL.
+#define PYUDNS_RESOLVE_PENDING 1 // status until callback is called
+#define PYUDNS_RESOLVE_CACHED  2 // answered from cache, not submitted
 typedef struct {
+    const char *name; // copy, owned by resolve_many()
+    Py_ssize_t *npending; // counter of the whole batch
+    int status; // 0, DNS_E_* or PYUDNS_RESOLVE_*
+    void *rr; // struct dns_rr_a4 or dns_rr_a6, NULL on error
+    uint64_t completed; // stats_now() in callback
+} ResolveItem;
+
+// No __dict__ on purpose, Query objects are created for every lookup.
+struct Query {
     PyObject_HEAD
-    PyObject *__dict__;
-    PyObject *resolver;
-    struct dns_query *q;
+    PyObject *resolver; // Resolver or ResolverPool it was submitted to
     PyObject *callback;
     PyObject *data; // and its data pointer
     bool is_completed;
-} Query;
+    int status; // 0 or DNS_E_* of completed single query
+    int flags; // PYUDNS_* flags
+    QuerySlot *slots; // points to `slot` for single query
+    Py_ssize_t nslots;
+    Py_ssize_t npending;
+    PyObject *results; // batch queries (submit_a4_many) only
+    thread_job *job; // ThreadedResolver query until it is delivered
+    // submit_addr(): A and AAAA slots, results merged into one tuple
+    bool addrs;
+    uint64_t addr_deadline; // stats_now() to complete without second family, 0 if not waiting
+    Query *addr_prev; // Resolver.addr_head list
+    Query *addr_next;
+    QuerySlot slot;
+};
+
+// N independent Resolvers, each with own udns context and socket.
+typedef struct {
+    PyObject_HEAD
+    PyObject **resolvers;
+    Py_ssize_t size;
+    Py_ssize_t next; // round robin position
+    int balance; // PYUDNS_POOL_*
+} ResolverPool;
+
+// Resolver whose udns context is driven by own native thread, see thread.h.
+// Python side is only used with GIL held.
+typedef struct {
+    PyObject_HEAD
+    PyObject *__dict__;
+    dns_thread thread;
+    bool closed;
+    Py_ssize_t active; // jobs submitted and not taken back yet
+    thread_job *taken; // taken back, not delivered yet, FIFO
+    thread_job *taken_tail;
+    CompletionRing completed; // callback-less completions
+} ThreadedResolver;
+
+// Answer record of RawRR, rdata position in packet copy.
+typedef struct {
+    unsigned offset;
+    unsigned length;
+    int type;
+} RawRecord;
+
+// Result of Resolver.submit() parser, one malloc block: header, record table,
+// reply packet copy, then qname/cname text. Layout starts as dns_rr_null,
+// so it is freed and passed around like other udns results.
+typedef struct {
+    struct dns_rr_null base;
+    int qclass;
+    int qtype;
+    RawRecord *records; // base.dnsn_nrr entries
+    unsigned char *pkt;
+    unsigned plen;
+} RawRR;
 
 typedef struct {
     PyObject_HEAD
     PyObject *__dict__;
     PyObject *resolver;
     struct dns_ctx *ctx;
-    struct dns_rr_null *rr;
+    RawRR *rr; // owned, NULL for RR() created from Python
 } RRWrap;
 
 
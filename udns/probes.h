@@ -0,0 +1,71 @@
+#ifndef udns_probes_h
+#define udns_probes_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// USDT (systemtap SDT) probes of provider "pyudns" on the lookup lifecycle,
+// compiled in with -DPYUDNS_USDT=1 (`make USDT=1`), which needs <sys/sdt.h>
+// from systemtap-sdt-dev. Without it probes expand to nothing.
+// Probe site is a nop until a tracer attaches, arguments are evaluated only
+// while its semaphore says one is attached. List them with
+//   bpftrace -l 'usdt:udns/_udns*.so:pyudns:*'
+//
+// `lookup` is the Lookup pointer shared by all probes of one query on the
+// wire, `ts` is stats_now() in microseconds (CLOCK_MONOTONIC).
+//   submit(lookup, qname, qtype, ts)                 query goes to transport
+//   queue(lookup, qname, qtype, ts)                  waits under max_inflight
+//   reply(lookup, qname, qtype, status, ts)          answer, error or timeout
+//   retry(lookup, qname, qtype, serv, ts)            truncated, asked over TCP
+//   mmsg_retry(lookup, qtype, serv, sends, ts)       TRANSPORT_MMSG timeout at
+//                                                    serv, resent to next one
+//   callback__entry(lookup, qname, qtype, status, ts)  before waiter callbacks
+//   callback__return(lookup, qname, qtype, status, ts) after them
+//   cancel(lookup, qname, qtype, ts)                 last waiter cancelled
+
+#if PYUDNS_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// Defined in mod_udns.c, tracers increment them while attached.
+#define PYUDNS_PROBE_SEMAPHORE(name) \
+    unsigned short pyudns_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+
+extern PYUDNS_PROBE_SEMAPHORE(submit);
+extern PYUDNS_PROBE_SEMAPHORE(queue);
+extern PYUDNS_PROBE_SEMAPHORE(reply);
+extern PYUDNS_PROBE_SEMAPHORE(retry);
+extern PYUDNS_PROBE_SEMAPHORE(mmsg_retry);
+extern PYUDNS_PROBE_SEMAPHORE(callback__entry);
+extern PYUDNS_PROBE_SEMAPHORE(callback__return);
+extern PYUDNS_PROBE_SEMAPHORE(cancel);
+
+#define PYUDNS_PROBE_ENABLED(name) __builtin_expect(pyudns_##name##_semaphore, 0)
+
+#define PYUDNS_PROBE4(name, a, b, c, d) do { \
+    if (PYUDNS_PROBE_ENABLED(name)) { \
+        DTRACE_PROBE4(pyudns, name, a, b, c, d); \
+    } \
+} while (0)
+
+#define PYUDNS_PROBE5(name, a, b, c, d, e) do { \
+    if (PYUDNS_PROBE_ENABLED(name)) { \
+        DTRACE_PROBE5(pyudns, name, a, b, c, d, e); \
+    } \
+} while (0)
+
+#else
+
+#define PYUDNS_PROBE_ENABLED(name) 0
+#define PYUDNS_PROBE4(name, a, b, c, d) do {} while (0)
+#define PYUDNS_PROBE5(name, a, b, c, d, e) do {} while (0)
+
+#endif // PYUDNS_USDT
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // udns_probes_h
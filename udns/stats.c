@@ -0,0 +1,76 @@
+#include <math.h>
+#include <string.h>
+
+#include <udns.h>
+
+#include "stats.h"
+
+
+void
+stats_init (dns_stats *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void
+stats_reset (dns_stats *s) {
+    long inflight = s->inflight;
+
+    memset(s, 0, sizeof(*s));
+    s->inflight = s->inflight_peak = inflight;
+}
+
+void
+stats_complete (dns_stats *s, int status, uint64_t latency) {
+    s->completions++;
+    s->inflight--;
+    if (status < 0) {
+        s->errors[-status < STATS_NERRORS ? -status : 0]++;
+        if (DNS_E_TEMPFAIL == status) {
+            s->timeouts++;
+        }
+    }
+    if (0 == s->latency_count || latency < s->latency_min) {
+        s->latency_min = latency;
+    }
+    if (latency > s->latency_max) {
+        s->latency_max = latency;
+    }
+    s->latency_count++;
+    s->latency_sum += latency;
+    s->buckets[stats_bucket(latency)]++;
+}
+
+uint64_t
+stats_bucket_max (size_t i) {
+    size_t shift;
+
+    if (i < STATS_SUB) {
+        return i;
+    }
+    i -= STATS_SUB;
+    shift = i / STATS_HALF + 1;
+    return (((uint64_t)(i % STATS_HALF + STATS_HALF + 1)) << shift) - 1;
+}
+
+uint64_t
+stats_percentile (const dns_stats *s, double q) {
+    unsigned long long rank, seen = 0;
+    uint64_t v;
+    size_t i;
+
+    if (0 == s->latency_count) {
+        return 0;
+    }
+    rank = (unsigned long long)ceil(q * s->latency_count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i = 0; i < STATS_NBUCKETS; i++) {
+        seen += s->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    v = stats_bucket_max(i);
+    return v < s->latency_max ? v : s->latency_max;
+}
@@ -0,0 +1,94 @@
+#ifndef udns_stats_h
+#define udns_stats_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Log-linear latency buckets, HDR histogram style: values below STATS_SUB
+// have exact buckets, above that every power of 2 range is split into
+// STATS_SUB / 2 buckets, so relative error is at most 2 / STATS_SUB (~6%).
+#define STATS_SUB_BITS 5
+#define STATS_SUB      (1 << STATS_SUB_BITS)
+#define STATS_HALF     (STATS_SUB / 2)
+#define STATS_MAX_MSB  40 // values are clamped to 2^41 - 1 microseconds
+#define STATS_NBUCKETS (STATS_SUB + (STATS_MAX_MSB - STATS_SUB_BITS + 1) * STATS_HALF)
+
+#define STATS_NERRORS 7 // indexed by -DNS_E_*, 0 counts unknown codes
+
+
+// Lookup counters and submit-to-completion latency of one Resolver.
+// Plain increments, Resolver is only used with GIL held.
+typedef struct {
+    unsigned long long submits;
+    unsigned long long completions;
+    unsigned long long cancels;
+    unsigned long long timeouts;
+    unsigned long long errors[STATS_NERRORS];
+    long inflight;
+    long inflight_peak;
+    unsigned long long latency_count;
+    unsigned long long latency_sum;
+    uint64_t latency_min;
+    uint64_t latency_max;
+    unsigned long long buckets[STATS_NBUCKETS];
+} dns_stats;
+
+// Monotonic clock in microseconds.
+static inline uint64_t
+stats_now (void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static inline size_t
+stats_bucket (uint64_t v) {
+    int msb;
+
+    if (v < STATS_SUB) {
+        return (size_t)v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    if (msb > STATS_MAX_MSB) {
+        return STATS_NBUCKETS - 1;
+    }
+    // v >> shift is in [STATS_HALF, STATS_SUB)
+    return STATS_SUB + (msb - STATS_SUB_BITS) * STATS_HALF
+           + (size_t)(v >> (msb - STATS_SUB_BITS + 1)) - STATS_HALF;
+}
+
+static inline void
+stats_submit (dns_stats *s) {
+    s->submits++;
+    if (++s->inflight > s->inflight_peak) {
+        s->inflight_peak = s->inflight;
+    }
+}
+
+static inline void
+stats_cancel (dns_stats *s) {
+    s->cancels++;
+    s->inflight--;
+}
+
+void stats_init(dns_stats *s);
+// Clears counters and histogram, current in-flight gauge is kept.
+void stats_reset(dns_stats *s);
+// `status` is 0 or DNS_E_*, `latency` in microseconds.
+void stats_complete(dns_stats *s, int status, uint64_t latency);
+// Largest value of bucket `i`.
+uint64_t stats_bucket_max(size_t i);
+// Latency at quantile `q` (0..1), upper bound of its bucket, 0 if empty.
+uint64_t stats_percentile(const dns_stats *s, double q);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // udns_stats_h
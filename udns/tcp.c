@@ -0,0 +1,644 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <udns.h>
+
+#include "tcp.h"
+
+#define TCP_QR 0x80 // byte 2 of header
+#define TCP_TC 0x02
+#define TCP_RD 0x01
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on socket instead
+#endif
+
+
+void
+tcp_init (dns_tcp *t, int timeout) {
+    memset(t, 0, sizeof(*t));
+    t->fd = -1;
+    t->timeout = timeout > 0 ? timeout : 1;
+    // ids only tell apart queries of one connection, forged replies would
+    // have to come through the connection itself
+    t->qid_state = ((unsigned)time(NULL) ^ ((unsigned)getpid() << 16)) | 1;
+}
+
+static unsigned
+tcp_random (dns_tcp *t) {
+    // xorshift32, same as mmsg
+    unsigned x = t->qid_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    t->qid_state = x;
+    return x;
+}
+
+// Registers events connection waits for with epoll, if it has changed.
+static void
+tcp_watch (dns_tcp *t, tcp_conn *c) {
+#ifdef __linux__
+    struct epoll_event ev;
+    unsigned events = EPOLLIN;
+
+    if (!c->connected || c->outlen > 0) {
+        events |= EPOLLOUT;
+    }
+    if (t->fd < 0 || events == c->events) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    if (0 == epoll_ctl(t->fd, 0 == c->events ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd, &ev)) {
+        c->events = events;
+    }
+#endif
+}
+
+int
+tcp_open (dns_tcp *t) {
+#ifdef __linux__
+    tcp_conn *c;
+    int i;
+
+    if (t->fd >= 0) {
+        return t->fd;
+    }
+    t->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (t->fd < 0) {
+        return -1;
+    }
+    for (i = 0; i < t->nservs; i++) {
+        for (c = t->servs[i].conns; NULL != c; c = c->next) {
+            c->events = 0;
+            tcp_watch(t, c);
+        }
+    }
+    return t->fd;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int
+tcp_add_serv (dns_tcp *t, const struct sockaddr *sa, socklen_t salen) {
+    tcp_server *s;
+    int i;
+
+    if (salen > sizeof(s->addr)) {
+        return -1;
+    }
+    for (i = 0; i < t->nservs; i++) {
+        s = &t->servs[i];
+        if (salen == s->addrlen && 0 == memcmp(sa, &s->addr, salen)) {
+            return i;
+        }
+    }
+    if (t->nservs >= TCP_MAXSERV) {
+        return -1;
+    }
+    s = &t->servs[t->nservs];
+    memset(s, 0, sizeof(*s));
+    memcpy(&s->addr, sa, salen);
+    s->addrlen = salen;
+    return t->nservs++;
+}
+
+// Unlinks active query from its connection or from orphans.
+static void
+query_unlink (dns_tcp *t, tcp_query *q) {
+    tcp_conn *c = q->conn;
+
+    if (NULL != c) {
+        if (NULL != q->prev) {
+            q->prev->next = q->next;
+        } else {
+            c->qhead = q->next;
+        }
+        if (NULL != q->next) {
+            q->next->prev = q->prev;
+        } else {
+            c->qtail = q->prev;
+        }
+        c->nqueries--;
+    } else {
+        if (NULL != q->prev) {
+            q->prev->next = q->next;
+        } else {
+            t->orphans = q->next;
+        }
+        if (NULL != q->next) {
+            q->next->prev = q->prev;
+        }
+    }
+    q->prev = q->next = NULL;
+    q->conn = NULL;
+}
+
+static void
+query_orphan (dns_tcp *t, tcp_query *q) {
+    query_unlink(t, q);
+    q->next = t->orphans;
+    if (NULL != t->orphans) {
+        t->orphans->prev = q;
+    }
+    t->orphans = q;
+}
+
+// Calls back unlinked query and frees it.
+static void
+query_finish (dns_tcp *t, tcp_query *q, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status) {
+    t->active--;
+    q->done(q->data, q->pkt + 2 + DNS_HSIZE, pkt, cur, end, status);
+    free(q);
+}
+
+/*@null@*/
+static tcp_conn*
+conn_open (dns_tcp *t, int serv, time_t now) {
+    tcp_server *s = &t->servs[serv];
+    tcp_conn *c;
+    int fd, one = 1;
+
+    fd = socket(s->addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        close(fd);
+        return NULL;
+    }
+    // queries are small and written as soon as they are queued
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    (void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    c = malloc(sizeof(*c));
+    if (NULL == c) {
+        close(fd);
+        return NULL;
+    }
+    memset(c, 0, offsetof(tcp_conn, in));
+    c->fd = fd;
+    c->serv = serv;
+    c->used = c->received = now;
+    if (0 == connect(fd, (struct sockaddr*)&s->addr, s->addrlen)) {
+        c->connected = true;
+    } else if (EINPROGRESS != errno) {
+        close(fd);
+        free(c);
+        return NULL;
+    }
+    c->next = s->conns;
+    s->conns = c;
+    s->nconns++;
+    t->nconns++;
+    t->connects++;
+    tcp_watch(t, c);
+    return c;
+}
+
+// Closes connection, its queries are left to tcp_orphans().
+static void
+conn_close (dns_tcp *t, tcp_conn *c) {
+    tcp_server *s = &t->servs[c->serv];
+    tcp_conn **p;
+
+    for (p = &s->conns; *p != c; p = &(*p)->next) {
+    }
+    *p = c->next;
+    s->nconns--;
+    t->nconns--;
+    while (NULL != c->qhead) {
+        query_orphan(t, c->qhead);
+    }
+    close(c->fd); // removes it from epoll too
+    free(c->out);
+    free(c);
+}
+
+// Least busy connection to server, new one while all are busy and pool is not full.
+/*@null@*/
+static tcp_conn*
+conn_pick (dns_tcp *t, int serv, time_t now) {
+    tcp_server *s = &t->servs[serv];
+    tcp_conn *c, *best = NULL;
+
+    for (c = s->conns; NULL != c; c = c->next) {
+        if (NULL == best || c->nqueries < best->nqueries) {
+            best = c;
+        }
+    }
+    if (NULL != best && (best->nqueries < TCP_PIPELINE || s->nconns >= TCP_MAXCONN)) {
+        return best;
+    }
+    c = conn_open(t, serv, now);
+    return NULL != c ? c : best;
+}
+
+// Gives query an id unique on connection and queues it for writing.
+static int
+conn_add (dns_tcp *t, tcp_conn *c, tcp_query *q, time_t now) {
+    tcp_query *other;
+    unsigned char *out;
+    size_t cap;
+
+    if (c->outlen + q->plen > c->outcap) {
+        for (cap = c->outcap > 0 ? c->outcap * 2 : 1024; cap < c->outlen + q->plen; cap *= 2) {
+        }
+        out = realloc(c->out, cap);
+        if (NULL == out) {
+            return -1;
+        }
+        c->out = out;
+        c->outcap = cap;
+    }
+    do {
+        q->qid = tcp_random(t) & 0xffff;
+        for (other = c->qhead; NULL != other && other->qid != q->qid; other = other->next) {
+        }
+    } while (NULL != other);
+    q->pkt[2] = q->qid >> 8;
+    q->pkt[3] = q->qid & 0xff;
+    memcpy(c->out + c->outlen, q->pkt, q->plen);
+    c->outlen += q->plen;
+
+    q->conn = c;
+    q->prev = c->qtail;
+    q->next = NULL;
+    if (NULL != c->qtail) {
+        c->qtail->next = q;
+    } else {
+        c->qhead = q;
+    }
+    c->qtail = q;
+    c->nqueries++;
+    c->used = now;
+    q->sent = now;
+    q->deadline = now + t->timeout;
+    return 0;
+}
+
+// Resends queries of closed connections once, fails expired ones and ones
+// resent already. Returns true if some query was resent.
+static bool
+tcp_orphans (dns_tcp *t, time_t now) {
+    tcp_query *q;
+    tcp_conn *c;
+    bool resent = false;
+
+    // callbacks may cancel other orphans, so always take the current head
+    while (NULL != (q = t->orphans)) {
+        query_unlink(t, q);
+        if (!q->resent && !q->expired &&
+            NULL != (c = conn_pick(t, q->serv, now)) && 0 == conn_add(t, c, q, now)) {
+            q->resent = true;
+            t->resends++;
+            resent = true;
+            continue;
+        }
+        query_finish(t, q, NULL, NULL, NULL, DNS_E_TEMPFAIL);
+    }
+    return resent;
+}
+
+static void
+tcp_reply (dns_tcp *t, tcp_conn *c, dnscc_t *pkt, unsigned len, time_t now) {
+    dnscc_t *end = pkt + len, *cur, *qcur;
+    tcp_query *q;
+    dnsc_t dn[DNS_MAXDN];
+    unsigned qid, qlen;
+
+    if (len < DNS_HSIZE || !(pkt[2] & TCP_QR)) {
+        return;
+    }
+    qid = dns_get16(pkt);
+    for (q = c->qhead; NULL != q && q->qid != qid; q = q->next) {
+    }
+    if (NULL == q) {
+        return; // reply to cancelled query
+    }
+    // question must be the one asked, as in mmsg_reply()
+    cur = pkt + DNS_HSIZE;
+    qcur = q->pkt + 2 + DNS_HSIZE;
+    qlen = dns_dnlen(qcur);
+    if (1 != dns_get16(pkt + 4) ||
+        dns_getdn(pkt, &cur, end, dn, sizeof(dn)) <= 0 ||
+        cur + 4 > end ||
+        !dns_dnequal(dn, qcur) ||
+        0 != memcmp(cur, qcur + qlen, 4)) {
+        return;
+    }
+
+    c->used = now;
+    query_unlink(t, q);
+    if (pkt[2] & TCP_TC) {
+        query_finish(t, q, NULL, NULL, NULL, DNS_E_PROTOCOL);
+        return;
+    }
+    switch (pkt[3] & 0x0f) {
+    case 0: // NOERROR
+        query_finish(t, q, pkt, cur, end, 0);
+        return;
+    case 3: // NXDOMAIN
+        query_finish(t, q, NULL, NULL, NULL, DNS_E_NXDOMAIN);
+        return;
+    default:
+        query_finish(t, q, NULL, NULL, NULL, DNS_E_TEMPFAIL);
+    }
+}
+
+// Completes non-blocking connect once socket reports it. Returns -1 if
+// connection failed and was closed.
+static int
+conn_connected (dns_tcp *t, tcp_conn *c, short revents) {
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (!(revents & (POLLOUT | POLLERR | POLLHUP))) {
+        return 0;
+    }
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || 0 != err ||
+        !(revents & POLLOUT)) {
+        conn_close(t, c);
+        return -1;
+    }
+    c->connected = true;
+    tcp_watch(t, c);
+    return 0;
+}
+
+// Reads what socket has, handles complete replies. Returns -1 if connection
+// was closed by server or failed.
+static int
+conn_read (dns_tcp *t, tcp_conn *c, time_t now) {
+    size_t off, len;
+    ssize_t r;
+
+    for (;;) {
+        r = recv(c->fd, c->in + c->inlen, TCP_INSIZ - c->inlen, 0);
+        if (r < 0 && EINTR == errno) {
+            continue;
+        }
+        if (r < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            return 0;
+        }
+        if (r <= 0) {
+            conn_close(t, c);
+            return -1;
+        }
+        c->inlen += r;
+        c->received = now;
+        // buffer holds one largest reply, so a partial one always has room
+        for (off = 0; c->inlen - off >= 2; off += 2 + len) {
+            len = dns_get16(c->in + off);
+            if (c->inlen - off < 2 + len) {
+                break;
+            }
+            tcp_reply(t, c, c->in + off + 2, len, now);
+        }
+        memmove(c->in, c->in + off, c->inlen - off);
+        c->inlen -= off;
+    }
+}
+
+static int
+conn_write (dns_tcp *t, tcp_conn *c) {
+    ssize_t r;
+
+    while (c->outlen > 0) {
+        r = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL);
+        if (r < 0 && EINTR == errno) {
+            continue;
+        }
+        if (r < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            break;
+        }
+        if (r < 0) {
+            conn_close(t, c);
+            return -1;
+        }
+        memmove(c->out, c->out + r, c->outlen - r);
+        c->outlen -= r;
+    }
+    tcp_watch(t, c);
+    return 0;
+}
+
+tcp_query*
+tcp_submit (dns_tcp *t, int serv, dnscc_t *dn, int qcls, int qtyp, int flags, tcp_done_fn *done, void *data) {
+    tcp_query *q;
+    tcp_conn *c;
+    dnsc_t *p;
+    unsigned dnlen = dns_dnlen(dn);
+    time_t now = time(NULL);
+
+    if (serv < 0 || serv >= t->nservs || t->active >= 0xffff) {
+        t->status = DNS_E_TEMPFAIL;
+        return NULL;
+    }
+    q = malloc(sizeof(*q));
+    if (NULL == q) {
+        t->status = DNS_E_NOMEM;
+        return NULL;
+    }
+    memset(q, 0, offsetof(tcp_query, pkt));
+    q->serv = serv;
+    q->done = done;
+    q->data = data;
+
+    // length prefix, then header as in mmsg_submit(), id is set by conn_add()
+    p = q->pkt;
+    memset(p, 0, 2 + DNS_HSIZE);
+    p[4] = (flags & DNS_NORD) ? 0 : TCP_RD;
+    p[7] = 1; // qdcount
+    memcpy(p + 2 + DNS_HSIZE, dn, dnlen);
+    p = dns_put16(p + 2 + DNS_HSIZE + dnlen, qtyp);
+    p = dns_put16(p, qcls);
+    q->plen = p - q->pkt;
+    dns_put16(q->pkt, q->plen - 2);
+
+    c = conn_pick(t, serv, now);
+    if (NULL == c || conn_add(t, c, q, now) < 0) {
+        free(q);
+        t->status = DNS_E_TEMPFAIL;
+        return NULL;
+    }
+    t->active++;
+    t->queries++;
+    return q;
+}
+
+void
+tcp_cancel (dns_tcp *t, tcp_query *q) {
+    // bytes queued already are still written, reply is ignored
+    query_unlink(t, q);
+    t->active--;
+    free(q);
+}
+
+void
+tcp_flush (dns_tcp *t) {
+    tcp_conn *c, *next;
+    int i;
+
+    // connection list of ioevent() in progress must stay intact
+    if (t->in_ioevent) {
+        return;
+    }
+    do {
+        for (i = 0; i < t->nservs; i++) {
+            for (c = t->servs[i].conns; NULL != c; c = next) {
+                next = c->next;
+                if (c->connected && c->outlen > 0) {
+                    (void)conn_write(t, c);
+                }
+            }
+        }
+    } while (tcp_orphans(t, time(NULL)));
+}
+
+void
+tcp_ioevent (dns_tcp *t, time_t now) {
+    struct pollfd pfd[TCP_MAXSERV * TCP_MAXCONN];
+    tcp_conn *conns[TCP_MAXSERV * TCP_MAXCONN], *c;
+    int i, n = 0;
+
+    // reply callback calling ioevent() again would close connections under it
+    if (t->in_ioevent || 0 == t->nconns) {
+        return;
+    }
+    if (0 == now) {
+        now = time(NULL);
+    }
+    // few connections, polling them all is cheaper than epoll_wait() bookkeeping
+    for (i = 0; i < t->nservs; i++) {
+        for (c = t->servs[i].conns; NULL != c && n < TCP_MAXSERV * TCP_MAXCONN; c = c->next) {
+            pfd[n].fd = c->fd;
+            pfd[n].events = POLLIN | (!c->connected || c->outlen > 0 ? POLLOUT : 0);
+            pfd[n].revents = 0;
+            conns[n++] = c;
+        }
+    }
+    t->in_ioevent = true;
+    if (poll(pfd, n, 0) > 0) {
+        for (i = 0; i < n; i++) {
+            c = conns[i];
+            if (0 == pfd[i].revents) {
+                continue;
+            }
+            if (!c->connected && conn_connected(t, c, pfd[i].revents) < 0) {
+                continue;
+            }
+            if ((pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) && conn_read(t, c, now) < 0) {
+                continue;
+            }
+            if (c->connected && c->outlen > 0) {
+                (void)conn_write(t, c);
+            }
+        }
+    }
+    t->in_ioevent = false;
+    tcp_flush(t);
+}
+
+int
+tcp_timeouts (dns_tcp *t, int maxwait, time_t now) {
+    tcp_conn *c, *next;
+    tcp_query *q, *qnext;
+    time_t first = 0, at;
+    bool dead;
+    int i, wait;
+
+    if (0 == now) {
+        now = time(NULL);
+    }
+    if (!t->in_ioevent) {
+        if (t->fd < 0) {
+            tcp_ioevent(t, now); // nothing signals replies without epoll
+        }
+        for (i = 0; i < t->nservs; i++) {
+            for (c = t->servs[i].conns; NULL != c; c = next) {
+                next = c->next;
+                dead = false;
+                for (q = c->qhead; NULL != q; q = qnext) {
+                    qnext = q->next;
+                    if (q->deadline <= now) {
+                        // nothing read since it was sent: server is gone
+                        dead = dead || c->received < q->sent;
+                        q->expired = true;
+                        query_orphan(t, q);
+                    }
+                }
+                if (dead || (0 == c->nqueries && now - c->used >= TCP_IDLE)) {
+                    conn_close(t, c);
+                }
+            }
+        }
+        tcp_flush(t);
+    }
+
+    for (i = 0; i < t->nservs; i++) {
+        for (c = t->servs[i].conns; NULL != c; c = c->next) {
+            if (0 == c->nqueries) {
+                at = c->used + TCP_IDLE;
+                if (0 == first || at < first) {
+                    first = at;
+                }
+            }
+            for (q = c->qhead; NULL != q; q = q->next) {
+                if (0 == first || q->deadline < first) {
+                    first = q->deadline;
+                }
+            }
+        }
+    }
+    if (0 == first) {
+        return maxwait;
+    }
+    wait = first > now ? (int)(first - now) : 0;
+    if (t->fd < 0 && t->active > 0 && wait > 1) {
+        wait = 1;
+    }
+    if (maxwait >= 0 && wait > maxwait) {
+        wait = maxwait;
+    }
+    return wait;
+}
+
+void
+tcp_free (dns_tcp *t) {
+    tcp_query *q;
+    int i;
+
+    for (i = 0; i < t->nservs; i++) {
+        while (NULL != t->servs[i].conns) {
+            conn_close(t, t->servs[i].conns);
+        }
+    }
+    while (NULL != (q = t->orphans)) {
+        query_unlink(t, q);
+        free(q);
+    }
+    t->active = 0;
+    if (t->fd >= 0) {
+        close(t->fd);
+        t->fd = -1;
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef udns_tcp_h
+#define udns_tcp_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <udns.h>
+
+#define TCP_MAXSERV  8   // servers with own connection pool
+#define TCP_MAXCONN  2   // pooled connections per server
+#define TCP_PIPELINE 32  // queries in flight on connection before another is opened
+#define TCP_IDLE     30  // seconds unused connection is kept open
+#define TCP_INSIZ    (2 + 0xffff) // receive buffer, one largest reply
+#define TCP_QSIZ     (2 + DNS_HSIZE + DNS_MAXDN + 4) // length prefix and largest query
+
+
+// TCP transport for answers truncated over UDP (RFC 7766). Every server has
+// a pool of up to TCP_MAXCONN persistent connections, queries are pipelined
+// on them and told apart by query id, replies may come in any order.
+// New query goes to the connection with fewest queries in flight, another one
+// is opened only when all have TCP_PIPELINE. Queries are written by
+// tcp_flush(), all queued on a connection with one send(). Queries on
+// connection the server closed are resent once on a new one.
+// On Linux `fd` is an epoll fd which is readable while some connection needs
+// tcp_ioevent(). Without epoll it is -1, tcp_timeouts() then does the I/O and
+// asks to be called again within a second while queries are active.
+
+typedef struct tcp_query tcp_query;
+typedef struct tcp_conn tcp_conn;
+
+// Same contract as mmsg_done_fn. Status is DNS_E_TEMPFAIL on timeout or
+// connection failure and DNS_E_PROTOCOL on truncated reply.
+typedef void tcp_done_fn(void *data, dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, int status);
+
+struct tcp_query {
+    tcp_query *prev; // connection queries in send order, or orphan list
+    tcp_query *next;
+    tcp_conn *conn; // NULL while orphaned
+    int serv;
+    unsigned qid;
+    bool resent;
+    bool expired;
+    time_t sent;
+    time_t deadline;
+    tcp_done_fn *done;
+    void *data;
+    unsigned plen; // with length prefix
+    dnsc_t pkt[TCP_QSIZ];
+};
+
+struct tcp_conn {
+    tcp_conn *next; // server pool
+    int fd;
+    int serv;
+    bool connected;
+    unsigned events; // registered with epoll
+    tcp_query *qhead;
+    tcp_query *qtail;
+    int nqueries;
+    time_t used; // last query sent or answered
+    time_t received; // last reply read
+    unsigned char *out; // queries not written yet
+    size_t outlen;
+    size_t outcap;
+    size_t inlen;
+    unsigned char in[TCP_INSIZ];
+};
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    tcp_conn *conns;
+    int nconns;
+} tcp_server;
+
+typedef struct {
+    int fd; // epoll, -1 until tcp_open()
+    tcp_server servs[TCP_MAXSERV];
+    int nservs;
+    int timeout; // seconds per query
+    int status; // DNS_E_* of failed tcp_submit()
+    int active;
+    int nconns;
+    bool in_ioevent;
+    unsigned qid_state;
+    tcp_query *orphans; // to resend or fail, see tcp_orphans()
+    unsigned long queries;
+    unsigned long connects;
+    unsigned long resends;
+} dns_tcp;
+
+void tcp_init(dns_tcp *t, int timeout);
+// Closes connections, frees active queries without calling their callbacks.
+void tcp_free(dns_tcp *t);
+// Creates epoll fd if not done yet. Returns it, or -1 with errno set.
+int tcp_open(dns_tcp *t);
+// Returns index of server with address `sa`, adding it if needed, or -1 if
+// there are TCP_MAXSERV already.
+int tcp_add_serv(dns_tcp *t, const struct sockaddr *sa, socklen_t salen);
+// Queues query to server `serv` for next tcp_flush(). Returns NULL and sets
+// `status` on failure.
+/*@null@*/ tcp_query *tcp_submit(dns_tcp *t, int serv, dnscc_t *dn, int qcls, int qtyp, int flags,
+                                 tcp_done_fn *done, void *data);
+void tcp_cancel(dns_tcp *t, tcp_query *q);
+// Writes queued queries.
+void tcp_flush(dns_tcp *t);
+// Reads replies from all connections that have some, then flushes.
+void tcp_ioevent(dns_tcp *t, time_t now);
+// Fails expired queries, closes idle connections, flushes.
+// Same contract as dns_timeouts().
+int tcp_timeouts(dns_tcp *t, int maxwait, time_t now);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // udns_tcp_h
@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <udns.h>
+
+#include "thread.h"
+
+
+// Opens signal fd pair: eventfd used for both ends, or non-blocking pipe.
+static int
+signal_open (int *rfd, int *wfd) {
+#ifdef __linux__
+    *rfd = *wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return *rfd < 0 ? -1 : 0;
+#else
+    int fds[2], i;
+
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+    for (i = 0; i < 2; i++) {
+        (void)fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        (void)fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    *rfd = fds[0];
+    *wfd = fds[1];
+    return 0;
+#endif
+}
+
+static void
+signal_close (int rfd, int wfd) {
+    if (rfd >= 0) {
+        close(rfd);
+    }
+    if (wfd >= 0 && wfd != rfd) {
+        close(wfd);
+    }
+}
+
+static void
+signal_raise (int wfd) {
+    uint64_t one = 1;
+    ssize_t r;
+
+    // full counter or pipe means reader is signalled already
+    r = write(wfd, &one, sizeof(one));
+    (void)r;
+}
+
+static void
+signal_reset (int rfd) {
+    uint64_t buf[8];
+
+    while (read(rfd, buf, sizeof(buf)) > 0) {
+        // eventfd is reset by one read, pipe needs draining
+    }
+}
+
+// Pushes job to lock-free stack. Returns true if stack was empty,
+// then the consumer has to be signalled.
+static bool
+stack_push (_Atomic(thread_job*) *stack, thread_job *job) {
+    thread_job *head = atomic_load_explicit(stack, memory_order_relaxed);
+
+    do {
+        job->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(stack, &head, job,
+                                                    memory_order_release, memory_order_relaxed));
+    return NULL == head;
+}
+
+// Takes whole stack and returns it in push order. Consumer takes all jobs
+// at once, so popped nodes are never seen again by CAS (no ABA).
+static thread_job*
+stack_take (_Atomic(thread_job*) *stack) {
+    thread_job *job, *next, *fifo = NULL;
+
+    job = atomic_exchange_explicit(stack, NULL, memory_order_acquire);
+    for (; NULL != job; job = next) {
+        next = job->next;
+        job->next = fifo;
+        fifo = job;
+    }
+    return fifo;
+}
+
+static void
+thread_complete (dns_thread *t, thread_job *job, int status, void *result) {
+    job->q = NULL;
+    job->status = status;
+    job->result = result;
+    if (stack_push(&t->completed, job)) {
+        signal_raise(t->done_wfd);
+    }
+}
+
+static void
+active_remove (dns_thread *t, thread_job *job) {
+    if (NULL != job->aprev) {
+        job->aprev->anext = job->anext;
+    } else {
+        t->active = job->anext;
+    }
+    if (NULL != job->anext) {
+        job->anext->aprev = job->aprev;
+    }
+}
+
+static void
+on_job_done (struct dns_ctx *ctx, void *result, void *data) {
+    thread_job *job = data;
+
+    active_remove(job->thread, job);
+    thread_complete(job->thread, job, NULL == result ? dns_status(ctx) : 0, result);
+}
+
+// Hands queued jobs over to udns, in submit order.
+static void
+thread_send_queued (dns_thread *t) {
+    thread_job *job, *next;
+    int status;
+
+    for (job = stack_take(&t->submitted); NULL != job; job = next) {
+        next = job->next;
+        if (atomic_load_explicit(&job->cancelled, memory_order_relaxed)) {
+            thread_complete(t, job, DNS_E_TEMPFAIL, NULL);
+            continue;
+        }
+        job->q = dns_submit_p(t->ctx, job->name, job->qclass, job->qtype, job->flags,
+                              job->parse, on_job_done, job);
+        if (NULL == job->q) {
+            status = dns_status(t->ctx);
+            thread_complete(t, job, status < 0 ? status : DNS_E_BADQUERY, NULL);
+            continue;
+        }
+        job->aprev = NULL;
+        job->anext = t->active;
+        if (NULL != t->active) {
+            t->active->aprev = job;
+        }
+        t->active = job;
+    }
+}
+
+// Drops jobs cancelled while udns had them.
+static void
+thread_cancel_active (dns_thread *t) {
+    thread_job *job, *next;
+
+    for (job = t->active; NULL != job; job = next) {
+        next = job->anext;
+        if (atomic_load_explicit(&job->cancelled, memory_order_relaxed)) {
+            active_remove(t, job);
+            dns_cancel(t->ctx, job->q);
+            thread_complete(t, job, DNS_E_TEMPFAIL, NULL);
+        }
+    }
+}
+
+static void*
+thread_main (void *arg) {
+    dns_thread *t = arg;
+    struct pollfd pfd[2];
+    thread_job *job, *next;
+    int wait;
+
+    pfd[0].fd = dns_sock(t->ctx);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = t->wake_fd;
+    pfd[1].events = POLLIN;
+
+    while (!atomic_load(&t->stop)) {
+        thread_send_queued(t);
+        if (atomic_exchange(&t->cancels, false)) {
+            thread_cancel_active(t);
+        }
+        // sends new queries and retries, fails expired ones
+        wait = dns_timeouts(t->ctx, -1, time(NULL));
+        if (poll(pfd, 2, wait < 0 ? -1 : wait * 1000) <= 0) {
+            continue;
+        }
+        if (pfd[1].revents & POLLIN) {
+            // before taking the stack: pushes after this signal again
+            signal_reset(t->wake_fd);
+        }
+        if (pfd[0].revents & POLLIN) {
+            dns_ioevent(t->ctx, time(NULL));
+        }
+    }
+
+    while (NULL != (job = t->active)) {
+        active_remove(t, job);
+        dns_cancel(t->ctx, job->q);
+        thread_complete(t, job, DNS_E_TEMPFAIL, NULL);
+    }
+    for (job = stack_take(&t->submitted); NULL != job; job = next) {
+        next = job->next;
+        thread_complete(t, job, DNS_E_TEMPFAIL, NULL);
+    }
+    return NULL;
+}
+
+int
+thread_init (dns_thread *t, struct dns_ctx *ctx) {
+    memset(t, 0, sizeof(*t));
+    t->wake_fd = t->wake_wfd = t->done_fd = t->done_wfd = -1;
+    if (signal_open(&t->wake_fd, &t->wake_wfd) < 0 ||
+        signal_open(&t->done_fd, &t->done_wfd) < 0) {
+        signal_close(t->wake_fd, t->wake_wfd);
+        return -1;
+    }
+    atomic_init(&t->stop, false);
+    atomic_init(&t->cancels, false);
+    atomic_init(&t->submitted, NULL);
+    atomic_init(&t->completed, NULL);
+    t->ctx = ctx;
+    return 0;
+}
+
+int
+thread_start (dns_thread *t) {
+    int r;
+
+    if (dns_open(t->ctx) < 0) {
+        return -1;
+    }
+    r = pthread_create(&t->tid, NULL, thread_main, t);
+    if (0 != r) {
+        dns_close(t->ctx);
+        errno = r;
+        return -1;
+    }
+    t->started = true;
+    return 0;
+}
+
+void
+thread_stop (dns_thread *t) {
+    thread_job *job, *next;
+
+    if (!t->started) {
+        return;
+    }
+    atomic_store(&t->stop, true);
+    signal_raise(t->wake_wfd);
+    pthread_join(t->tid, NULL);
+    t->started = false;
+    // submitted while I/O thread was leaving its loop
+    for (job = stack_take(&t->submitted); NULL != job; job = next) {
+        next = job->next;
+        thread_complete(t, job, DNS_E_TEMPFAIL, NULL);
+    }
+}
+
+void
+thread_free (dns_thread *t) {
+    thread_stop(t);
+    if (NULL != t->ctx) {
+        dns_free(t->ctx);
+    }
+    signal_close(t->wake_fd, t->wake_wfd);
+    signal_close(t->done_fd, t->done_wfd);
+    memset(t, 0, sizeof(*t));
+    t->wake_fd = t->wake_wfd = t->done_fd = t->done_wfd = -1;
+}
+
+thread_job*
+thread_job_new (const char *name, int qclass, int qtype, int flags, dns_parse_fn *parse, void *data) {
+    size_t len = strlen(name);
+    thread_job *job;
+
+    job = calloc(1, sizeof(thread_job) + len);
+    if (NULL == job) {
+        return NULL;
+    }
+    memcpy(job->name, name, len + 1);
+    job->qclass = qclass;
+    job->qtype = qtype;
+    job->flags = flags;
+    job->parse = parse;
+    job->data = data;
+    atomic_init(&job->cancelled, false);
+    return job;
+}
+
+void
+thread_job_free (thread_job *job) {
+    free(job->result);
+    free(job);
+}
+
+void
+thread_submit (dns_thread *t, thread_job *job) {
+    job->thread = t;
+    if (stack_push(&t->submitted, job)) {
+        signal_raise(t->wake_wfd);
+    }
+}
+
+void
+thread_cancel (thread_job *job) {
+    atomic_store(&job->cancelled, true);
+    // seen by I/O thread after the flag above
+    atomic_store(&job->thread->cancels, true);
+    signal_raise(job->thread->wake_wfd);
+}
+
+thread_job*
+thread_take (dns_thread *t) {
+    // reset first: completions pushed after it signal again
+    signal_reset(t->done_fd);
+    return stack_take(&t->completed);
+}
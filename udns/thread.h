@@ -0,0 +1,82 @@
+#ifndef udns_thread_h
+#define udns_thread_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <udns.h>
+
+
+// udns context driven by its own native thread. Jobs are submitted from any
+// thread through a lock-free MPSC stack and a wake eventfd; finished jobs come
+// back through a second stack and `done_fd`, which is readable while some wait
+// in it. The I/O thread only touches jobs and its context, never owner data.
+// Without eventfd (non-Linux) pipes are used.
+
+typedef struct dns_thread dns_thread;
+typedef struct thread_job thread_job;
+
+struct thread_job {
+    thread_job *next; // submitted or completed stack, then FIFO list
+    thread_job *aprev; // in-flight list, I/O thread only
+    thread_job *anext;
+    dns_thread *thread;
+    struct dns_query *q;
+    dns_parse_fn *parse; // dns_parse_a4, or owner's parser
+    int qclass;
+    int qtype;
+    int flags; // udns flags
+    int status; // 0 or DNS_E_* once completed
+    void *result; // parser result, malloc block, NULL on error
+    atomic_bool cancelled; // set by thread_cancel(), job is not sent if still queued
+    void *data; // owner's, not touched by I/O thread
+    char name[1];
+};
+
+struct dns_thread {
+    struct dns_ctx *ctx; // owned, only I/O thread uses it once started
+    int wake_fd; // eventfd, submitters -> I/O thread
+    int done_fd; // eventfd, I/O thread -> owner
+    int wake_wfd; // write ends, same fds unless pipes are used instead
+    int done_wfd;
+    pthread_t tid;
+    bool started;
+    atomic_bool stop;
+    atomic_bool cancels; // thread_cancel() was called, I/O thread checks active jobs
+    _Atomic(thread_job*) submitted; // LIFO
+    _Atomic(thread_job*) completed; // LIFO
+    thread_job *active; // sent to udns, I/O thread only
+};
+
+// Takes ownership of initialized, not yet opened `ctx`. Returns 0 or -1 with errno.
+int thread_init(dns_thread *t, struct dns_ctx *ctx);
+// Opens udns socket and starts I/O thread. Returns 0 or -1 with errno set.
+int thread_start(dns_thread *t);
+// Stops and joins I/O thread. Jobs it had not finished complete with
+// DNS_E_TEMPFAIL, so every submitted job comes back through thread_take().
+void thread_stop(dns_thread *t);
+// Frees context and eventfds, thread must be stopped and jobs taken.
+void thread_free(dns_thread *t);
+/*@null@*/ thread_job *thread_job_new(const char *name, int qclass, int qtype, int flags,
+                                      dns_parse_fn *parse, void *data);
+void thread_job_free(thread_job *job);
+// Queues job for I/O thread, safe from any thread.
+void thread_submit(dns_thread *t, thread_job *job);
+// Asks I/O thread to drop submitted job from udns, safe from any thread.
+// It still comes back through thread_take(), with DNS_E_TEMPFAIL unless it
+// was answered already.
+void thread_cancel(thread_job *job);
+// Returns jobs completed so far in completion order, NULL if none.
+// Single consumer: owner must serialize calls.
+/*@null@*/ thread_job *thread_take(dns_thread *t);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // udns_thread_h